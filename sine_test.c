@@ -17,15 +17,507 @@
 
 // This code is a simple example in C of how to create a MEF 3.0 channel, add some data to it,
 // then close the channel.
+//
+// Run as "sine_test benchmark [options]" it is instead a benchmark of the writer, see run_benchmark() below.
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include "write_mef_channel.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif
+
 extern MEF_GLOBALS	*MEF_globals;
 
-int main()
+/********************************  BENCHMARK ***************************************/
+
+// Workload and writer mode of a benchmark run, set from the command line
+typedef struct {
+    si4     num_channels;
+    sf8     sampling_frequency;
+    sf8     seconds_per_block;
+    ui8     seconds_per_segment;      // 0 means one segment
+    sf8     seconds;                  // of recording time written
+    sf8     seconds_per_write;        // samples passed to each write_mef_channel_data() call
+    sf8     gaps_per_minute;          // discontinuities, of one second each
+    sf8     notes_per_minute;         // Note records
+    si4     encrypt;
+    si4     mode;                     // BENCHMARK_SYNC, BENCHMARK_ASYNC or BENCHMARK_SESSION
+    si4     worker_threads;           // for BENCHMARK_SESSION, 0 is one per processor
+    si4     checkpoint_mode;
+    ui8     checkpoint_blocks;
+    sf8     checkpoint_seconds;
+    ui8     data_batch_bytes;         // 0 leaves the default
+    si4     mapped_io;
+    si4     journal;
+    si4     preopen;
+    sf8     adaptive_min_seconds;     // 0 for fixed blocks
+    si4     interleaved;              // all channels in one write_mef_channels_interleaved() call per write
+    si4     offline;
+    char    dir_name[512];
+} BENCHMARK_OPTIONS;
+
+#define BENCHMARK_SYNC      0
+#define BENCHMARK_ASYNC     1
+#define BENCHMARK_SESSION   2
+
+static sf8 benchmark_clock_usecs(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (sf8) count.QuadPart * 1e6 / (sf8) frequency.QuadPart;
+#else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sf8) ts.tv_sec * 1e6 + (sf8) ts.tv_nsec / 1e3;
+#endif
+}
+
+static si8 benchmark_peak_rss_kb(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return -1;
+    return (si8) (counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#ifdef __APPLE__
+    return (si8) usage.ru_maxrss / 1024;  // bytes on Mac OS X
+#else
+    return (si8) usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Total bytes of the files under path
+static si8 benchmark_directory_bytes(const char *path)
+{
+    char child[1024];
+    si8 bytes;
+#ifdef _WIN32
+    WIN32_FIND_DATAA find_data;
+    HANDLE find;
+    
+    bytes = 0;
+    sprintf(child, "%s\\*", path);
+    find = FindFirstFileA(child, &find_data);
+    if (find == INVALID_HANDLE_VALUE)
+        return 0;
+    do {
+        if (!strcmp(find_data.cFileName, ".") || !strcmp(find_data.cFileName, ".."))
+            continue;
+        sprintf(child, "%s\\%s", path, find_data.cFileName);
+        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            bytes += benchmark_directory_bytes(child);
+        else
+            bytes += ((si8) find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+    } while (FindNextFileA(find, &find_data));
+    FindClose(find);
+#else
+    DIR *dir;
+    struct dirent *entry;
+    struct stat sb;
+    
+    bytes = 0;
+    dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        sprintf(child, "%s/%s", path, entry->d_name);
+        if (stat(child, &sb) != 0)
+            continue;
+        if (S_ISDIR(sb.st_mode))
+            bytes += benchmark_directory_bytes(child);
+        else
+            bytes += (si8) sb.st_size;
+    }
+    closedir(dir);
+#endif
+    
+    return bytes;
+}
+
+static int compare_sf8(const void *a, const void *b)
+{
+    sf8 x = *(const sf8 *) a, y = *(const sf8 *) b;
+    
+    return (x > y) - (x < y);
+}
+
+static void benchmark_usage(void)
+{
+    fprintf(stderr, "usage: sine_test benchmark [options]\n"
+            "  --channels N              number of channels (1)\n"
+            "  --rate HZ                 sampling frequency (1000)\n"
+            "  --block-seconds S         seconds per block (1)\n"
+            "  --segment-seconds S       seconds per segment, 0 for one segment (0)\n"
+            "  --seconds S               seconds of data per channel (60)\n"
+            "  --write-seconds S         seconds of data per write_mef_channel_data() call (0.1)\n"
+            "  --gaps-per-minute G       one second discontinuities (0)\n"
+            "  --notes-per-minute A      Note records (0)\n"
+            "  --encrypt                 level 1 and level 2 passwords\n"
+            "  --mode sync|async|session writer mode (sync)\n"
+            "  --threads N               session worker threads, 0 for one per processor (0)\n"
+            "  --checkpoint-blocks N     checkpoint every N blocks (1)\n"
+            "  --checkpoint-seconds T    checkpoint every T seconds of recording time\n"
+            "  --checkpoint-close        checkpoint only at segment rolls and close\n"
+            "  --data-batch BYTES        data batch size\n"
+            "  --mmap                    memory mapped data and index files\n"
+            "  --journal                 checkpoint journal\n"
+            "  --preopen                 pre-open the next segment\n"
+            "  --adaptive-blocks S       adaptive block length, from S seconds up to --block-seconds\n"
+            "  --interleaved             write interleaved frames of all channels at once\n"
+            "  --offline                 offline (bulk conversion) mode\n"
+            "  --dir PATH                session directory (sine_benchmark), must not already hold a session\n");
+}
+
+static int parse_benchmark_options(int argc, char **argv, BENCHMARK_OPTIONS *options)
+{
+    int i;
+    
+    memset(options, 0, sizeof(BENCHMARK_OPTIONS));
+    options->num_channels = 1;
+    options->sampling_frequency = 1000.0;
+    options->seconds_per_block = 1.0;
+    options->seconds = 60.0;
+    options->seconds_per_write = 0.1;
+    options->mode = BENCHMARK_SYNC;
+    options->checkpoint_mode = CHECKPOINT_EVERY_N_BLOCKS;
+    options->checkpoint_blocks = 1;
+    sprintf(options->dir_name, "sine_benchmark");
+    
+    for (i = 0; i < argc; i++)
+    {
+        // options without a value
+        if (!strcmp(argv[i], "--encrypt"))
+            options->encrypt = 1;
+        else if (!strcmp(argv[i], "--checkpoint-close"))
+            options->checkpoint_mode = CHECKPOINT_ON_CLOSE;
+        else if (!strcmp(argv[i], "--mmap"))
+            options->mapped_io = 1;
+        else if (!strcmp(argv[i], "--journal"))
+            options->journal = 1;
+        else if (!strcmp(argv[i], "--preopen"))
+            options->preopen = 1;
+        else if (!strcmp(argv[i], "--interleaved"))
+            options->interleaved = 1;
+        else if (!strcmp(argv[i], "--offline"))
+            options->offline = 1;
+        else if (i + 1 >= argc)
+            return -1;
+        // options with a value
+        else if (!strcmp(argv[i], "--channels"))
+            options->num_channels = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--rate"))
+            options->sampling_frequency = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--block-seconds"))
+            options->seconds_per_block = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--segment-seconds"))
+            options->seconds_per_segment = (ui8) atof(argv[++i]);
+        else if (!strcmp(argv[i], "--seconds"))
+            options->seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--write-seconds"))
+            options->seconds_per_write = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--gaps-per-minute"))
+            options->gaps_per_minute = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--notes-per-minute"))
+            options->notes_per_minute = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--threads"))
+            options->worker_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--checkpoint-blocks"))
+        {
+            options->checkpoint_mode = CHECKPOINT_EVERY_N_BLOCKS;
+            options->checkpoint_blocks = (ui8) atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--checkpoint-seconds"))
+        {
+            options->checkpoint_mode = CHECKPOINT_EVERY_T_SECONDS;
+            options->checkpoint_seconds = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--adaptive-blocks"))
+            options->adaptive_min_seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--data-batch"))
+            options->data_batch_bytes = (ui8) atof(argv[++i]);
+        else if (!strcmp(argv[i], "--dir"))
+            snprintf(options->dir_name, sizeof(options->dir_name), "%s", argv[++i]);
+        else if (!strcmp(argv[i], "--mode"))
+        {
+            i++;
+            if (!strcmp(argv[i], "sync"))
+                options->mode = BENCHMARK_SYNC;
+            else if (!strcmp(argv[i], "async"))
+                options->mode = BENCHMARK_ASYNC;
+            else if (!strcmp(argv[i], "session"))
+                options->mode = BENCHMARK_SESSION;
+            else
+                return -1;
+        }
+        else
+            return -1;
+    }
+    
+    if (options->num_channels < 1 || options->sampling_frequency <= 0.0 || options->seconds_per_block <= 0.0 ||
+        options->seconds <= 0.0 || options->seconds_per_write <= 0.0)
+        return -1;
+    
+    return 0;
+}
+
+// Writes the workload described by the options, timing each write_mef_channel_data() call, and prints one line of
+// JSON with the results.  Runs with the same options write the same data, so modes and versions can be compared.
+static int run_benchmark(int argc, char **argv)
+{
+    BENCHMARK_OPTIONS options;
+    MEF_WRITER_STATS stats, channel_stats;
+    CHANNEL_STATE **channels;
+    SESSION_STATE *session;
+    ANNOTATION_STATE *annotation_state;
+    si4 **samps, *frames;
+    ui8 *packet_times;
+    sf8 *latencies, start_usecs, end_usecs, call_usecs, next_note_time, gap_odds;
+    si8 base_timestamp, samples_per_write, num_writes, num_latencies, total_samples, bytes, sample_number, time_offset;
+    si8 w, i;
+    si4 c, num_notes;
+    ui4 random_state;
+    char chan_name[64], note_text[64], mefd_name[600];
+    
+    if (parse_benchmark_options(argc, argv, &options) != 0)
+    {
+        benchmark_usage();
+        return 1;
+    }
+    
+    // bytes_written is the size of the session directory afterwards, so it must start out empty
+    sprintf(mefd_name, "%s.mefd", options.dir_name);
+    if (benchmark_directory_bytes(mefd_name) > 0)
+    {
+        fprintf(stderr, "%s already holds files, give an empty --dir\n", mefd_name);
+        return 1;
+    }
+    
+    (void) initialize_meflib();
+    MEF_globals->recording_time_offset_mode = RTO_IGNORE;
+    
+    samples_per_write = (si8) (options.sampling_frequency * options.seconds_per_write + 0.5);
+    if (samples_per_write < 1)
+        samples_per_write = 1;
+    num_writes = (si8) ceil(options.seconds * options.sampling_frequency / (sf8) samples_per_write);
+    channels = (CHANNEL_STATE **) calloc((size_t) options.num_channels, sizeof(CHANNEL_STATE *));
+    samps = (si4 **) calloc((size_t) options.num_channels, sizeof(si4 *));
+    packet_times = (ui8 *) calloc((size_t) samples_per_write, sizeof(ui8));
+    latencies = (sf8 *) calloc((size_t) (num_writes * options.num_channels), sizeof(sf8));
+    frames = (si4 *) calloc((size_t) (samples_per_write * options.num_channels), sizeof(si4));
+    if (channels == NULL || samps == NULL || packet_times == NULL || latencies == NULL || frames == NULL)
+    {
+        fprintf(stderr, "Insufficient memory for benchmark\n");
+        return 1;
+    }
+    
+    session = NULL;
+    if (options.mode == BENCHMARK_SESSION)
+        session = create_mef_session(options.worker_threads, 4);
+    
+    // create channels
+    for (c = 0; c < options.num_channels; c++)
+    {
+        samps[c] = (si4 *) calloc((size_t) samples_per_write, sizeof(si4));
+        channels[c] = (CHANNEL_STATE *) calloc((size_t) 1, sizeof(CHANNEL_STATE));
+        if (samps[c] == NULL || channels[c] == NULL)
+        {
+            fprintf(stderr, "Insufficient memory for benchmark\n");
+            return 1;
+        }
+        sprintf(chan_name, "bench-%03d", c + 1);
+        initialize_mef_channel_data(channels[c], options.seconds_per_block, chan_name, 0, 0.0, options.sampling_frequency / 2.0, -1.0, 60.0, 1.0,
+                                    "benchmark", options.sampling_frequency, (si8) (options.seconds_per_block * 1e6), c + 1, options.dir_name,
+                                    -6.0, "benchmark", "anon", "Mickey", "Mouse", "", "",
+                                    options.encrypt ? "benchmark_level_1" : NULL, options.encrypt ? "benchmark_level_2" : NULL,
+                                    "benchmark", "benchmark", options.seconds_per_segment);
+        set_mef_channel_checkpoint_policy(channels[c], options.checkpoint_mode, options.checkpoint_blocks, options.checkpoint_seconds);
+        if (options.offline)
+            set_mef_channel_offline_mode(channels[c], 1);
+        if (options.data_batch_bytes > 0)
+            set_mef_channel_data_batch_size(channels[c], options.data_batch_bytes);
+        if (options.mapped_io)
+            set_mef_channel_mapped_io(channels[c], 1, 0, MAPPED_SYNC_NONE);
+        if (options.journal)
+            set_mef_channel_journal(channels[c], 1);
+        if (options.preopen)
+            set_mef_channel_segment_preopen(channels[c], 1);
+        if (options.adaptive_min_seconds > 0.0)
+            set_mef_channel_adaptive_blocks(channels[c], 1, options.adaptive_min_seconds);
+        if (options.mode == BENCHMARK_ASYNC)
+            set_mef_channel_async_mode(channels[c], 2);
+        else if (options.mode == BENCHMARK_SESSION)
+            add_mef_session_channel(session, channels[c]);
+    }
+    
+    annotation_state = NULL;
+    if (options.notes_per_minute > 0.0)
+    {
+        annotation_state = (ANNOTATION_STATE *) calloc((size_t) 1, sizeof(ANNOTATION_STATE));
+        create_or_append_annotations(annotation_state, options.dir_name, -6.0, "anon");
+    }
+    
+    base_timestamp = 946684800000000;  // midnight, 1 January 2000
+    gap_odds = options.gaps_per_minute * options.seconds_per_write / 60.0;
+    random_state = 12345;
+    next_note_time = 0.0;
+    num_notes = 0;
+    num_latencies = 0;
+    total_samples = 0;
+    time_offset = 0;
+    
+    start_usecs = benchmark_clock_usecs();
+    for (w = 0; w < num_writes; w++)
+    {
+        // a gap now and then, the same for every run
+        random_state = random_state * 1103515245 + 12345;
+        if (gap_odds > 0.0 && (sf8) (random_state >> 8) / 16777216.0 < gap_odds)
+            time_offset += 1000000;
+        
+        sample_number = w * samples_per_write;
+        for (i = 0; i < samples_per_write; i++)
+            packet_times[i] = base_timestamp + time_offset + (si8) ((sample_number + i) * (1e6 / options.sampling_frequency));
+        
+        for (c = 0; c < options.num_channels; c++)
+        {
+            // sine wave plus a little noise, so the data doesn't compress unrealistically well
+            for (i = 0; i < samples_per_write; i++)
+            {
+                random_state = random_state * 1103515245 + 12345;
+                samps[c][i] = (si4) (20000.0 * sin(2 * M_PI * (sample_number + i) * (10.0 + c) / options.sampling_frequency)) +
+                              (si4) ((random_state >> 16) & 0xff) - 128;
+            }
+            
+            if (options.interleaved)
+            {
+                // the same samples, as frames of one sample per channel
+                for (i = 0; i < samples_per_write; i++)
+                    frames[(i * options.num_channels) + c] = samps[c][i];
+                continue;
+            }
+            
+            call_usecs = benchmark_clock_usecs();
+            write_mef_channel_data(channels[c], packet_times, samps[c], (ui8) samples_per_write, options.seconds_per_block, options.sampling_frequency);
+            latencies[num_latencies++] = benchmark_clock_usecs() - call_usecs;
+            total_samples += samples_per_write;
+        }
+        
+        if (options.interleaved)
+        {
+            call_usecs = benchmark_clock_usecs();
+            write_mef_channels_interleaved(channels, options.num_channels, packet_times, frames, (ui8) samples_per_write,
+                                           options.num_channels, options.seconds_per_block, options.sampling_frequency);
+            latencies[num_latencies++] = benchmark_clock_usecs() - call_usecs;
+            total_samples += samples_per_write * options.num_channels;
+        }
+        
+        if (annotation_state != NULL)
+        {
+            while (next_note_time <= (sf8) ((w + 1) * samples_per_write) / options.sampling_frequency)
+            {
+                sprintf(note_text, "benchmark note %d", ++num_notes);
+                write_annotation(annotation_state, (ui8) (base_timestamp + time_offset + (si8) (next_note_time * 1e6)), "Note", note_text);
+                next_note_time += 60.0 / options.notes_per_minute;
+            }
+        }
+    }
+    
+    // closing writes the last blocks, so it is part of the time
+    if (session != NULL)
+        close_mef_session(session);
+    else
+        for (c = 0; c < options.num_channels; c++)
+            close_mef_channel(channels[c]);
+    if (annotation_state != NULL)
+        close_annotation(annotation_state);
+    end_usecs = benchmark_clock_usecs();
+    
+    qsort(latencies, (size_t) num_latencies, sizeof(sf8), compare_sf8);
+    bytes = benchmark_directory_bytes(mefd_name);
+    
+    printf("{\"channels\": %d, \"sampling_frequency\": %.1f, \"block_seconds\": %.3f, \"segment_seconds\": %lu, "
+           "\"seconds\": %.1f, \"gaps_per_minute\": %.2f, \"notes_per_minute\": %.2f, \"encrypt\": %d, "
+           "\"mode\": \"%s\", \"checkpoint_mode\": %d, \"mmap\": %d, \"journal\": %d, \"interleaved\": %d, \"offline\": %d, "
+           "\"samples\": %ld, \"elapsed_seconds\": %.6f, \"samples_per_second\": %.1f, "
+           "\"bytes_written\": %ld, \"mb_per_second\": %.3f, "
+           "\"write_latency_p50_us\": %.2f, \"write_latency_p99_us\": %.2f, \"write_latency_max_us\": %.2f, "
+           "\"peak_rss_kb\": %ld",
+           options.num_channels, options.sampling_frequency, options.seconds_per_block, (unsigned long) options.seconds_per_segment,
+           options.seconds, options.gaps_per_minute, options.notes_per_minute, options.encrypt,
+           options.mode == BENCHMARK_SYNC ? "sync" : (options.mode == BENCHMARK_ASYNC ? "async" : "session"),
+           options.checkpoint_mode, options.mapped_io, options.journal, options.interleaved, options.offline,
+           (long) total_samples, (end_usecs - start_usecs) / 1e6, (sf8) total_samples / ((end_usecs - start_usecs) / 1e6),
+           (long) bytes, ((sf8) bytes / 1e6) / ((end_usecs - start_usecs) / 1e6),
+           latencies[num_latencies / 2], latencies[(si8) (num_latencies * 0.99)], latencies[num_latencies - 1],
+           (long) benchmark_peak_rss_kb());
+    
+    // where the writer's time went, if the library was compiled with MEF_ENABLE_WRITER_STATS
+    memset(&stats, 0, sizeof(MEF_WRITER_STATS));
+    for (c = 0; c < options.num_channels; c++)
+    {
+        if (get_mef_channel_writer_stats(channels[c], &channel_stats) != 0)
+            break;
+        stats.blocks_encoded += channel_stats.blocks_encoded;
+        stats.writes += channel_stats.writes;
+        stats.segment_rolls += channel_stats.segment_rolls;
+        stats.encode_nsecs += channel_stats.encode_nsecs;
+        stats.extrema_nsecs += channel_stats.extrema_nsecs;
+        stats.crc_nsecs += channel_stats.crc_nsecs;
+        stats.write_nsecs += channel_stats.write_nsecs;
+        stats.metadata_nsecs += channel_stats.metadata_nsecs;
+        stats.segment_roll_nsecs += channel_stats.segment_roll_nsecs;
+    }
+    if (c == options.num_channels)
+        printf(", \"blocks_encoded\": %lu, \"writes\": %lu, \"segment_rolls\": %lu, \"encode_seconds\": %.6f, "
+               "\"extrema_seconds\": %.6f, \"crc_seconds\": %.6f, \"write_seconds\": %.6f, \"metadata_seconds\": %.6f, "
+               "\"segment_roll_seconds\": %.6f",
+               (unsigned long) stats.blocks_encoded, (unsigned long) stats.writes, (unsigned long) stats.segment_rolls,
+               stats.encode_nsecs / 1e9, stats.extrema_nsecs / 1e9, stats.crc_nsecs / 1e9, stats.write_nsecs / 1e9,
+               stats.metadata_nsecs / 1e9, stats.segment_roll_nsecs / 1e9);
+    printf("}\n");
+    
+    for (c = 0; c < options.num_channels; c++)
+    {
+        free(samps[c]);
+        free(channels[c]);
+    }
+    free(annotation_state);
+    free(channels);
+    free(samps);
+    free(packet_times);
+    free(latencies);
+    free(frames);
+    
+    return 0;
+}
+
+/********************************  END OF BENCHMARK ********************************/
+
+int main(int argc, char **argv)
 {
     int i;
     sf8 sampling_frequency;
@@ -43,6 +535,9 @@ int main()
     MEFREC_Epoc_1_0 *epoch_pointer;
     FILE_PROCESSING_STRUCT *records_fps;
     
+    if (argc > 1 && !strcmp(argv[1], "benchmark"))
+        return run_benchmark(argc - 2, argv + 2);
+    
     // initialize MEF3 library
     (void) initialize_meflib();
     MEF_globals->recording_time_offset_mode = RTO_IGNORE;  // turn off timestamp offsetting by default
@@ -45,21 +45,871 @@
 #include "write_mef_channel.h"
 #include "mefrec.h"
 
-// TBD Won't be thread-safe without pthread, but for now ignore it
-//pthread_mutex_t lock1 = PTHREAD_MUTEX_INITIALIZER;
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+// vector instruction sets used by the bit shift kernels.  SSE2 and NEON are part of the 64-bit x86 and ARM
+// baselines; AVX2 is compiled in where the compiler allows it per function, and only used if the CPU has it.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MEF_HAVE_SSE2
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#define MEF_HAVE_AVX2
+#define MEF_AVX2_FUNCTION
+#include <immintrin.h>
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__clang__) || __GNUC__ >= 5)
+#define MEF_HAVE_AVX2
+#define MEF_AVX2_FUNCTION __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define MEF_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+
+// Minimal threading layer, so the session writer works with both pthreads and the Windows API.
+// SRW locks (rather than critical sections) are used on Windows, since they can be statically initialized.
+// mef_once() runs a MEF_ONCE_FUNCTION exactly once, and every caller returns only after it has finished.
+// mef_store_release() and mef_load_acquire() publish an si4 to threads that don't take the lock guarding it.
+#ifdef _WIN32
+typedef SRWLOCK             MEF_MUTEX;
+typedef CONDITION_VARIABLE  MEF_COND;
+typedef HANDLE              MEF_THREAD;
+typedef INIT_ONCE           MEF_ONCE;
+#define MEF_MUTEX_INITIALIZER           SRWLOCK_INIT
+#define mef_mutex_init(m)               InitializeSRWLock(m)
+#define mef_mutex_destroy(m)
+#define mef_mutex_lock(m)               AcquireSRWLockExclusive(m)
+#define mef_mutex_unlock(m)             ReleaseSRWLockExclusive(m)
+#define mef_cond_init(c)                InitializeConditionVariable(c)
+#define mef_cond_destroy(c)
+#define mef_cond_wait(c, m)             SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define mef_cond_signal(c)              WakeConditionVariable(c)
+#define mef_cond_broadcast(c)           WakeAllConditionVariable(c)
+#define MEF_THREAD_FUNCTION(name, arg)  DWORD WINAPI name(LPVOID arg)
+#define MEF_THREAD_RETURN               0
+#define mef_thread_create(t, f, arg)    ((*(t) = CreateThread(NULL, 0, f, arg, 0, NULL)) == NULL ? -1 : 0)
+#define mef_thread_join(t)              (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define MEF_ONCE_INITIALIZER            INIT_ONCE_STATIC_INIT
+#define MEF_ONCE_FUNCTION(name)         BOOL CALLBACK name(PINIT_ONCE once, PVOID parameter, PVOID *context)
+#define MEF_ONCE_RETURN                 TRUE
+#define mef_once(o, f)                  InitOnceExecuteOnce(o, f, NULL, NULL)
+#define mef_store_release(p, v)         InterlockedExchange((volatile LONG *) (p), (LONG) (v))
+#define mef_load_acquire(p)             ((si4) InterlockedCompareExchange((volatile LONG *) (p), 0, 0))
+#else
+typedef pthread_mutex_t     MEF_MUTEX;
+typedef pthread_cond_t      MEF_COND;
+typedef pthread_t           MEF_THREAD;
+typedef pthread_once_t      MEF_ONCE;
+#define MEF_MUTEX_INITIALIZER           PTHREAD_MUTEX_INITIALIZER
+#define mef_mutex_init(m)               pthread_mutex_init(m, NULL)
+#define mef_mutex_destroy(m)            pthread_mutex_destroy(m)
+#define mef_mutex_lock(m)               pthread_mutex_lock(m)
+#define mef_mutex_unlock(m)             pthread_mutex_unlock(m)
+#define mef_cond_init(c)                pthread_cond_init(c, NULL)
+#define mef_cond_destroy(c)             pthread_cond_destroy(c)
+#define mef_cond_wait(c, m)             pthread_cond_wait(c, m)
+#define mef_cond_signal(c)              pthread_cond_signal(c)
+#define mef_cond_broadcast(c)           pthread_cond_broadcast(c)
+#define MEF_THREAD_FUNCTION(name, arg)  void *name(void *arg)
+#define MEF_THREAD_RETURN               NULL
+#define mef_thread_create(t, f, arg)    pthread_create(t, NULL, f, arg)
+#define mef_thread_join(t)              pthread_join(t, NULL)
+#define MEF_ONCE_INITIALIZER            PTHREAD_ONCE_INIT
+#define MEF_ONCE_FUNCTION(name)         void name(void)
+#define MEF_ONCE_RETURN
+#define mef_once(o, f)                  pthread_once(o, f)
+#define mef_store_release(p, v)         __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define mef_load_acquire(p)             __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#endif
+
+// Writer counters, see get_mef_channel_writer_stats().  Without MEF_ENABLE_WRITER_STATS these compile to
+// nothing (WRITER_STATS_TIME() to just its statement), so there is no cost to leaving them in the hot path.
+#ifdef MEF_ENABLE_WRITER_STATS
+static ui8 writer_stats_clock_nsecs(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER count;
+    
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (ui8) ((sf8) count.QuadPart * 1e9 / (sf8) frequency.QuadPart);
+#else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ui8) ts.tv_sec * 1000000000 + (ui8) ts.tv_nsec;
+#endif
+}
+#define WRITER_STATS_CLOCK(start)               ui8 start = 0
+#define WRITER_STATS_START(start)               ((start) = writer_stats_clock_nsecs())
+#define WRITER_STATS_STOP(cs, field, start)     ((cs)->writer_stats.field += writer_stats_clock_nsecs() - (start))
+#define WRITER_STATS_TIME(cs, field, statement) do { ui8 stats_start = writer_stats_clock_nsecs(); statement; \
+                                                     (cs)->writer_stats.field += writer_stats_clock_nsecs() - stats_start; } while (0)
+#define WRITER_STATS_ADD(cs, field, n)          ((cs)->writer_stats.field += (ui8) (n))
+#define WRITER_STATS_MEASURE(nsecs, statement)  do { ui8 stats_start = writer_stats_clock_nsecs(); statement; \
+                                                     (nsecs) = writer_stats_clock_nsecs() - stats_start; } while (0)
+#define WRITER_STATS_REPORT(cs)                 do { if ((cs)->writer_stats_callback != NULL) \
+                                                     (cs)->writer_stats_callback((cs)->channel_path, &(cs)->writer_stats, (cs)->writer_stats_context); } while (0)
+#else
+#define WRITER_STATS_CLOCK(start)
+#define WRITER_STATS_START(start)
+#define WRITER_STATS_STOP(cs, field, start)
+#define WRITER_STATS_TIME(cs, field, statement) statement
+#define WRITER_STATS_ADD(cs, field, n)
+#define WRITER_STATS_MEASURE(nsecs, statement)  statement
+#define WRITER_STATS_REPORT(cs)
+#endif
+
+// protects process-global state shared by all channels: the recording time offset in MEF_globals,
+// and UUID generation.
+static MEF_MUTEX mef_globals_lock = MEF_MUTEX_INITIALIZER;
+
+// protects the session-level .mefd files and their in-memory copies, which every new channel is added to.
+static MEF_MUTEX mefd_file_lock = MEF_MUTEX_INITIALIZER;
+
+// protects the cache of directories known to exist, see make_directory()
+static MEF_MUTEX directory_cache_lock = MEF_MUTEX_INITIALIZER;
+
+
+// Directories are created in-process, rather than with system("mkdir ..."), which forks a shell for every
+// segment of every channel.  Directories known to exist (the session and channel directories, mostly) are kept
+// in a small hash set, so the many channels of a session don't each have to ask the file system again.
+#define DIRECTORY_CACHE_SLOTS   4096    // power of 2; once full, directories are simply not cached
+
+static si1 *directory_cache[DIRECTORY_CACHE_SLOTS];
+
+// FNV-1a
+static ui4 string_hash(const si1 *string)
+{
+    ui4 hash;
+    
+    hash = 2166136261u;
+    while (*string)
+    {
+        hash ^= (ui1) *string++;
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+static ui4 directory_cache_slot(const si1 *path)
+{
+    return string_hash(path) & (DIRECTORY_CACHE_SLOTS - 1);
+}
+
+static si4 directory_is_cached(const si1 *path)
+{
+    ui4 slot, i;
+    si4 found;
+    
+    found = 0;
+    mef_mutex_lock(&directory_cache_lock);
+    slot = directory_cache_slot(path);
+    for (i = 0; i < DIRECTORY_CACHE_SLOTS && directory_cache[slot] != NULL; i++, slot = (slot + 1) & (DIRECTORY_CACHE_SLOTS - 1))
+    {
+        if (!strcmp(directory_cache[slot], path))
+        {
+            found = 1;
+            break;
+        }
+    }
+    mef_mutex_unlock(&directory_cache_lock);
+    
+    return found;
+}
+
+static void cache_directory(const si1 *path)
+{
+    ui4 slot, i;
+    
+    mef_mutex_lock(&directory_cache_lock);
+    slot = directory_cache_slot(path);
+    for (i = 0; i < DIRECTORY_CACHE_SLOTS; i++, slot = (slot + 1) & (DIRECTORY_CACHE_SLOTS - 1))
+    {
+        if (directory_cache[slot] == NULL)
+        {
+            directory_cache[slot] = (si1 *) malloc(strlen(path) + 1);
+            if (directory_cache[slot] != NULL)
+                strcpy(directory_cache[slot], path);
+            break;
+        }
+        if (!strcmp(directory_cache[slot], path))
+            break;
+    }
+    mef_mutex_unlock(&directory_cache_lock);
+}
+
+static void forget_directory(const si1 *path)
+{
+    ui4 slot, next, home;
+    
+    mef_mutex_lock(&directory_cache_lock);
+    slot = directory_cache_slot(path);
+    while (directory_cache[slot] != NULL && strcmp(directory_cache[slot], path))
+        slot = (slot + 1) & (DIRECTORY_CACHE_SLOTS - 1);
+    if (directory_cache[slot] != NULL)
+    {
+        free(directory_cache[slot]);
+        directory_cache[slot] = NULL;
+        // move later entries of the probe sequence up into the hole, so they can still be found
+        next = (slot + 1) & (DIRECTORY_CACHE_SLOTS - 1);
+        while (directory_cache[next] != NULL)
+        {
+            home = directory_cache_slot(directory_cache[next]);
+            if (((next - home) & (DIRECTORY_CACHE_SLOTS - 1)) >= ((next - slot) & (DIRECTORY_CACHE_SLOTS - 1)))
+            {
+                directory_cache[slot] = directory_cache[next];
+                directory_cache[next] = NULL;
+                slot = next;
+            }
+            next = (next + 1) & (DIRECTORY_CACHE_SLOTS - 1);
+        }
+    }
+    mef_mutex_unlock(&directory_cache_lock);
+}
+
+// Creates a directory, and any missing parent directories (like "mkdir -p").  Returns 0 if the directory exists
+// afterwards, -1 otherwise.
+static si4 make_directory(const si1 *path)
+{
+    si1 parent[MEF_FULL_FILE_NAME_BYTES];
+    si1 *c;
+    si4 created, missing_parent;
+    
+    if (path == NULL || *path == 0)
+        return -1;
+    if (directory_is_cached(path))
+        return 0;
+    
+#ifdef _WIN32
+    created = (CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS);
+    missing_parent = (!created && GetLastError() == ERROR_PATH_NOT_FOUND);
+#else
+    created = (mkdir(path, 0777) == 0 || errno == EEXIST);
+    missing_parent = (!created && errno == ENOENT);
+#endif
+    
+    if (missing_parent && strlen(path) < MEF_FULL_FILE_NAME_BYTES)
+    {
+        // strip the last path component (and any trailing separators), make the parent, and try again
+        strcpy(parent, path);
+        c = parent + strlen(parent) - 1;
+        while (c > parent && (*c == '/' || *c == '\\'))
+            *c-- = 0;
+        while (c > parent && *c != '/' && *c != '\\')
+            c--;
+        while (c > parent && (*c == '/' || *c == '\\'))
+            *c-- = 0;
+        if (c > parent && make_directory(parent) == 0)
+        {
+#ifdef _WIN32
+            created = (CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS);
+#else
+            created = (mkdir(path, 0777) == 0 || errno == EEXIST);
+#endif
+        }
+    }
+    
+    if (!created)
+        return -1;
+    
+    cache_directory(path);
+    
+    return 0;
+}
+
+
+// One filled block of raw samples, waiting to be RED-encoded and written.  A block handed over by
+// write_mef_channel_block() is encoded from the caller's memory (external_samples) instead of the slot's buffer.
+typedef struct {
+    si4     *samples;
+    si4     *external_samples;
+    MEF_BLOCK_RELEASE release;
+    void    *release_context;
+    ui4     num_entries;
+    ui8     block_len;
+    si4     discontinuity_flag;
+    ui8     block_hdr_time;
+    si4     minimum_sample_value;
+    si4     maximum_sample_value;
+    RED_PROCESSING_STRUCT   *rps;   // the slot's own, when the channel's blocks are encoded in parallel
+    si4     encoded;
+    ui8     encode_nsecs;
+} FILLED_BLOCK;
+
+// Per-channel block pipeline.  Each slot owns one raw sample buffer.  The producer (the thread calling
+// write_mef_channel_data()) fills slot (head + count) % num_buffers, while slots head ... head + count - 1 are
+// queued for (or being processed by) a worker.  Only one worker processes a given channel at a time, which
+// keeps each channel's blocks in order.  With parallel_encode, slots are encoded by any number of workers (each
+// slot has its own RED processing struct), and only committing them to the files is one worker at a time.
+typedef struct MEF_BLOCK_PIPELINE {
+    SESSION_STATE   *session;
+    CHANNEL_STATE   *channel_state;
+    FILLED_BLOCK    *blocks;
+    si4     *original_buffer;    // the channel's own raw buffer, given back when the pipeline is removed
+    si4     num_buffers;
+    si4     head;
+    si4     count;
+    si4     scheduled;   // channel is in the session's ready list, or a worker is processing it
+    si4     private_session;  // session was created just for this channel by set_mef_channel_async_mode()
+    si4     parallel_encode;  // several workers encode the channel's blocks at once, see set_mef_channel_offline_mode()
+    si4     started;     // with parallel_encode, queued blocks (from head) that a worker has taken
+    si4     committing;  // with parallel_encode, a worker is committing encoded blocks, in order
+    struct MEF_BLOCK_PIPELINE *next_ready;
+} MEF_BLOCK_PIPELINE;
+
+// A batch given to enqueue_mef_channel_data(), copied into buffers that belong to the queue slot.  Slots are
+// taken in order by producers, filled outside the queue lock, and written in order by the queue's writer.
+#define INGEST_SLOT_FREE    0
+#define INGEST_SLOT_FILLING 1
+#define INGEST_SLOT_READY   2
+
+typedef struct {
+    CHANNEL_STATE   *channel_state;
+    ui8     *packet_times;
+    si4     *samps;
+    ui8     n_packets;
+    ui8     capacity;    // packets the slot's buffers have room for
+    sf8     secs_per_block;
+    sf8     sampling_frequency;
+    si4     state;
+} INGEST_BATCH;
+
+// Bounded multi-producer queue with one writer thread, see start_mef_session_ingest().  Slots head ... head +
+// count - 1 are in use; a producer waiting for room waits on batch_done.
+typedef struct MEF_INGEST_QUEUE {
+    MEF_MUTEX   lock;
+    MEF_COND    batch_ready;
+    MEF_COND    batch_done;
+    MEF_THREAD  writer;
+    INGEST_BATCH    *batches;
+    ui4     num_batches;
+    ui4     head;
+    ui4     count;
+    si4     shutting_down;
+    ui8     full_queue_count;   // times a producer found the queue full
+} MEF_INGEST_QUEUE;
+
+struct SESSION_STATE {
+    MEF_MUTEX   lock;
+    MEF_COND    work_available;
+    MEF_COND    work_done;
+    MEF_THREAD  *workers;
+    si4         num_workers;
+    si4         buffers_per_channel;
+    si4         shutting_down;
+    MEF_BLOCK_PIPELINE  *ready_head;
+    MEF_BLOCK_PIPELINE  *ready_tail;
+    CHANNEL_STATE       **channels;
+    si4         num_channels;
+    si4         max_channels;
+    MEF_INGEST_QUEUE    *ingest_queues;      // see start_mef_session_ingest()
+    si4         num_ingest_queues;
+    si4         next_ingest_queue;          // queue given to the next channel to be fed, round robin
+};
+
+// Samples in a raw block buffer of a channel, which also sizes its RED buffers.  Blocks are cut every block_interval,
+// so this is twice one block_interval (or secs_per_block, if that is longer) at the channel's sampling frequency,
+// leaving room for rate drift; each channel's buffers scale with its own rate.  write_mef_channel_data() cuts a
+// block short rather than overflow the buffer, so a channel whose rate goes up is still safe.
+static ui8 block_buffer_samples(si8 block_interval, sf8 secs_per_block, sf8 sampling_frequency)
+{
+    sf8 block_seconds;
+    
+    block_seconds = (sf8) block_interval / 1e6;
+    if (secs_per_block > block_seconds)
+        block_seconds = secs_per_block;
+    
+    return (ui8) ceil(block_seconds * sampling_frequency * 2) + 1;
+}
+
+// Channel arena: the raw sample buffer, the index batch and the data staging buffer of a channel are carved out of
+// one allocation, sized once from the channel's block size and batch sizes.  Each piece starts on a 64 byte
+// boundary from the start of the arena.  A channel reopened after reset_mef_channel() keeps its arena if it's big
+// enough, and arena_bytes stays the size it was allocated with.
+#define ARENA_ROUND(bytes)      (((size_t) (bytes) + 63) & ~((size_t) 63))
+
+static void allocate_channel_arena(CHANNEL_STATE *channel_state)
+{
+    size_t raw_bytes, index_bytes, data_bytes;
+    
+    raw_bytes = ARENA_ROUND(channel_state->raw_data_buffer_samples * sizeof(si4));
+    index_bytes = ARENA_ROUND((size_t) channel_state->index_batch_max_entries * TIME_SERIES_INDEX_BYTES);
+    data_bytes = ARENA_ROUND(channel_state->data_batch_max_bytes);
+    
+    if (channel_state->arena != NULL && raw_bytes + index_bytes + data_bytes <= (size_t) channel_state->arena_bytes)
+        memset(channel_state->arena, 0, raw_bytes + index_bytes + data_bytes);
+    else
+    {
+        free(channel_state->arena);
+        channel_state->arena_bytes = raw_bytes + index_bytes + data_bytes;
+        channel_state->arena = (ui1 *) calloc((size_t) 1, (size_t) channel_state->arena_bytes);
+        if (channel_state->arena == NULL)
+        {
+            fprintf(stderr, "Insufficient memory to allocate channel buffers\n");
+            exit(1);
+        }
+    }
+    
+    channel_state->raw_data_ptr_start = (si4 *) channel_state->arena;
+    channel_state->temp_time_series_index = channel_state->arena + raw_bytes;
+    channel_state->data_batch = (channel_state->data_batch_max_bytes > 0) ? channel_state->arena + raw_bytes + index_bytes : NULL;
+}
+
+// Buffers resized after the channel was created are allocated on their own, and have to be freed on their own.
+static si4 in_channel_arena(CHANNEL_STATE *channel_state, void *ptr)
+{
+    return ((ui1 *) ptr >= channel_state->arena && (ui1 *) ptr < channel_state->arena + channel_state->arena_bytes);
+}
+
+// Called by initialize_mef_channel_data() and append_mef_channel_data() before the channel's buffers are allocated.
+// The buffers kept by reset_mef_channel() are reused; otherwise channel_state is whatever the caller allocated, and
+// none of its pointers mean anything.
+static void claim_retained_buffers(CHANNEL_STATE *channel_state)
+{
+    if (channel_state->buffers_retained != CHANNEL_BUFFERS_RETAINED)
+    {
+        channel_state->arena = NULL;
+        channel_state->arena_bytes = 0;
+        channel_state->rps = NULL;
+        channel_state->rps_buffer_samples = 0;
+        channel_state->metadata_image = NULL;  // see write_encrypted_metadata()
+    }
+    channel_state->buffers_retained = 0;
+}
+
+// RED buffers of the channel, sized from raw_data_buffer_samples.  Those of a channel reopened after
+// reset_mef_channel() are kept, with their directives back to how they were allocated, if they are big enough.
+static void allocate_channel_rps(CHANNEL_STATE *channel_state)
+{
+    ui4 max_samps;
+    
+    max_samps = (ui4) channel_state->raw_data_buffer_samples;
+    if (channel_state->rps != NULL && channel_state->rps_buffer_samples >= max_samps)
+    {
+        channel_state->rps->directives.encryption_level = NO_ENCRYPTION;  // see set_mef_channel_block_encryption()
+        channel_state->rps->password_data = channel_state->pwd;
+        return;
+    }
+    if (channel_state->rps != NULL)
+    {
+        channel_state->rps->original_data = NULL;  // points into the raw buffer
+        RED_free_processing_struct(channel_state->rps);
+    }
+    
+    // original_data isn't allocated (size 0), since it is pointed at the raw buffer before each RED compression
+    channel_state->rps = RED_allocate_processing_struct(0, RED_MAX_COMPRESSED_BYTES(max_samps, 1), 0, RED_MAX_DIFFERENCE_BYTES(max_samps), 0, 0, channel_state->pwd);
+    channel_state->rps_buffer_samples = max_samps;
+}
 
+// Defaults of the writer options and internal state a new recording starts with, the same whether the channel is
+// initialized or appended to, or reopened after reset_mef_channel().  The batch sizes must be set before the
+// arena is allocated.
+static void init_channel_defaults(CHANNEL_STATE *channel_state)
+{
+    channel_state->index_batch_max_entries     = DEFAULT_INDEX_BATCH_ENTRIES;  // see write_index_batch()
+    channel_state->index_batch_entries         = 0;
+    channel_state->data_batch_max_bytes        = DEFAULT_DATA_BATCH_BYTES;  // see write_data_batch()
+    channel_state->data_batch_bytes            = 0;
+    channel_state->session                     = NULL;
+    channel_state->pipeline                    = NULL;
+    channel_state->ingest_queue                = NULL;  // see enqueue_mef_channel_data()
+    channel_state->ingest_pending              = 0;
+    channel_state->offline_mode                = 0;  // see set_mef_channel_offline_mode()
+    channel_state->raw_data_minimum            = (si4) 0x7FFFFFFF;  // no samples in the block yet
+    channel_state->raw_data_maximum            = (si4) 0x80000000;
+    channel_state->statistics_enabled          = 0;
+    channel_state->segment_preopen_enabled     = 0;  // see set_mef_channel_segment_preopen()
+    channel_state->next_segment_prepared       = 0;
+    channel_state->next_segment_data_fp        = NULL;
+    channel_state->next_segment_inds_fp        = NULL;
+    channel_state->next_segment_metadata_fp    = NULL;
+    channel_state->mapped_io_enabled           = 0;  // see set_mef_channel_mapped_io()
+    channel_state->mapped_sync_mode            = MAPPED_SYNC_NONE;
+    channel_state->mapped_extent_bytes         = DEFAULT_MAPPED_EXTENT_BYTES;
+    memset(&channel_state->data_map, 0, sizeof(MEF_MAPPED_FILE));
+    memset(&channel_state->inds_map, 0, sizeof(MEF_MAPPED_FILE));
+    channel_state->journal_enabled             = 0;  // see set_mef_channel_journal()
+    channel_state->journal_pending             = 0;
+    channel_state->journal_fp                  = NULL;
+    memset(&channel_state->writer_stats, 0, sizeof(MEF_WRITER_STATS));  // see get_mef_channel_writer_stats()
+    channel_state->writer_stats_callback       = NULL;
+    channel_state->writer_stats_context        = NULL;
+    channel_state->adaptive_blocks_enabled     = 0;  // see set_mef_channel_adaptive_blocks()
+    channel_state->metadata_section_3_cached   = 0;  // see write_encrypted_metadata()
+    channel_state->regular_anchor_time         = 0;  // see write_mef_channel_data_regular()
+    channel_state->regular_samples_since_anchor = 0;
+    channel_state->regular_sampling_frequency  = 0.0;
+    
+    // default is to rewrite metadata after every block, see set_mef_channel_checkpoint_policy()
+    channel_state->checkpoint_mode             = CHECKPOINT_EVERY_N_BLOCKS;
+    channel_state->checkpoint_interval_blocks  = 1;
+    channel_state->checkpoint_interval_usecs   = 0;
+    channel_state->blocks_since_checkpoint     = 0;
+    channel_state->last_checkpoint_time        = 0;
+    channel_state->mefd_registry               = NULL;  // see register_mefd_channel()
+    channel_state->mefd_listed                 = 0;
+}
+
+// Contents of the resume file, see resume_mef_channel_data()
+typedef struct {
+    ui4     CRC;                      // of the rest of the struct
+    ui4     version;
+    si4     next_segment_number;
+} MEF_RESUME_STATE;
+
+// One entry of a segment's checkpoint journal, see set_mef_channel_journal().  Everything before metadata is
+// in the universal headers, in the clear, anyway.
+typedef struct {
+    si8     recording_duration;
+    si8     number_of_samples;
+    si8     number_of_blocks;
+    si8     maximum_block_bytes;
+    si8     number_of_discontinuities;
+    si8     maximum_contiguous_blocks;
+    si8     maximum_contiguous_block_bytes;
+    si8     maximum_contiguous_samples;
+    sf8     maximum_native_sample_value;
+    sf8     minimum_native_sample_value;
+    ui4     maximum_block_samples;
+    ui4     maximum_difference_bytes;
+    ui1     pad[8];                   // to a whole number of AES blocks
+} MEF_JOURNAL_METADATA;
+
+typedef struct {
+    ui4     CRC;                      // of the rest of the entry, as stored
+    si4     encryption;               // of metadata: NO_ENCRYPTION, or the level section 2 is encrypted with
+    si8     data_file_bytes;
+    si8     index_file_bytes;
+    ui4     data_body_CRC;
+    ui4     index_body_CRC;
+    si8     number_of_entries;
+    si8     maximum_entry_size;
+    si8     start_time;
+    si8     end_time;
+    MEF_JOURNAL_METADATA metadata;
+} MEF_JOURNAL_ENTRY;
+
+// meflib's generate_UUID() isn't safe to call from several threads at once, so every UUID in this file comes from here.
+static void generate_UUID_thread_safe(ui1 *uuid)
+{
+    mef_mutex_lock(&mef_globals_lock);
+    generate_UUID(uuid);
+    mef_mutex_unlock(&mef_globals_lock);
+}
+
+// CRCs, slicing-by-8.  meflib's CRC_update() does one table lookup per byte.  The MEF CRC is a reflected table CRC
+// (Koopman polynomial), so the eight tables below are built from meflib's own table, read back through
+// CRC_update() one byte at a time, and the result is checked against CRC_update() and CRC_calculate() before it
+// is used.  If the check fails, mef_crc_update() and mef_crc_calculate() fall back to meflib's functions.  The CRC instructions of SSE4.2 and ARMv8 are
+// for other polynomials, so they can't be used here.
+static ui4 crc_slice_table[8][256];
+static si4 crc_slice_state;  // 1 tables in use, -1 use meflib; set once, by build_crc_slice_tables()
+static MEF_ONCE crc_slice_once = MEF_ONCE_INITIALIZER;
+
+static ui4 crc_update_sliced(const ui1 *block_ptr, si8 block_bytes, ui4 current_crc)
+{
+    ui4 one, two;
+    
+    for (; block_bytes >= 8; block_bytes -= 8, block_ptr += 8)
+    {
+        one = ((ui4) block_ptr[0] | ((ui4) block_ptr[1] << 8) | ((ui4) block_ptr[2] << 16) | ((ui4) block_ptr[3] << 24)) ^ current_crc;
+        two = (ui4) block_ptr[4] | ((ui4) block_ptr[5] << 8) | ((ui4) block_ptr[6] << 16) | ((ui4) block_ptr[7] << 24);
+        current_crc = crc_slice_table[7][one & 0xFF] ^ crc_slice_table[6][(one >> 8) & 0xFF] ^
+                      crc_slice_table[5][(one >> 16) & 0xFF] ^ crc_slice_table[4][one >> 24] ^
+                      crc_slice_table[3][two & 0xFF] ^ crc_slice_table[2][(two >> 8) & 0xFF] ^
+                      crc_slice_table[1][(two >> 16) & 0xFF] ^ crc_slice_table[0][two >> 24];
+    }
+    for (; block_bytes > 0; block_bytes--)
+        current_crc = crc_slice_table[0][(current_crc ^ *block_ptr++) & 0xFF] ^ (current_crc >> 8);
+    
+    return current_crc;
+}
+
+static MEF_ONCE_FUNCTION(build_crc_slice_tables)
+{
+    ui1 test_data[1031], byte;
+    ui4 i, k, rs, start;
+    si4 state;
+    
+    for (i = 0; i < 256; i++)
+    {
+        byte = (ui1) i;
+        crc_slice_table[0][i] = CRC_update(&byte, 1, 0);
+    }
+    for (k = 1; k < 8; k++)
+        for (i = 0; i < 256; i++)
+            crc_slice_table[k][i] = (crc_slice_table[k - 1][i] >> 8) ^ crc_slice_table[0][crc_slice_table[k - 1][i] & 0xFF];
+    
+    rs = 12345;
+    for (i = 0; i < sizeof(test_data); i++)
+    {
+        rs = rs * 1103515245 + 12345;
+        test_data[i] = (ui1) (rs >> 16);
+    }
+    state = 1;
+    for (i = 0; i < 16 && state == 1; i++)
+    {
+        start = (i == 0) ? CRC_START_VALUE : (rs = rs * 1103515245 + 12345);
+        if (crc_update_sliced(test_data + i, (si8) sizeof(test_data) - i, start) != CRC_update(test_data + i, (si8) sizeof(test_data) - i, start))
+            state = -1;
+    }
+    if (crc_update_sliced(test_data, (si8) sizeof(test_data), CRC_START_VALUE) != CRC_calculate(test_data, (si8) sizeof(test_data)))
+        state = -1;
+    crc_slice_state = state;
+    
+    return MEF_ONCE_RETURN;
+}
+
+static si4 crc_slice_tables_ready(void)
+{
+    mef_once(&crc_slice_once, build_crc_slice_tables);
+    
+    return (crc_slice_state == 1);
+}
+
+static ui4 mef_crc_update(const ui1 *block_ptr, si8 block_bytes, ui4 current_crc)
+{
+    if (crc_slice_tables_ready())
+        return crc_update_sliced(block_ptr, block_bytes, current_crc);
+    
+    return CRC_update((ui1 *) block_ptr, block_bytes, current_crc);
+}
+
+static ui4 mef_crc_calculate(const ui1 *block_ptr, si8 block_bytes)
+{
+    if (crc_slice_tables_ready())
+        return crc_update_sliced(block_ptr, block_bytes, CRC_START_VALUE);
+    
+    return CRC_calculate((ui1 *) block_ptr, block_bytes);
+}
+
+static ui4 gf2_matrix_times(const ui4 *matrix, ui4 vector)
+{
+    ui4 sum;
+    
+    for (sum = 0; vector; vector >>= 1, matrix++)
+        if (vector & 1)
+            sum ^= *matrix;
+    
+    return sum;
+}
+
+// CRC of the concatenation A + B, from the CRC of A and the CRC of B started from 0 (not CRC_START_VALUE), where B is
+// block_b_bytes long.  The CRC is linear in its starting value, so this is the CRC of A run through block_b_bytes
+// zero bytes, xor the CRC of B.  Running through zero bytes is a 32 x 32 bit matrix, squared for each bit of the
+// length, as in zlib's crc32_combine().  This lets pieces of a large file be CRCed in parallel.
+static ui4 mef_crc_combine(ui4 crc_a, ui4 crc_b, si8 block_b_bytes)
+{
+    ui4 op[32], square[32];
+    si4 n;
+    
+    if (block_b_bytes <= 0)
+        return crc_a ^ crc_b;
+    if (!crc_slice_tables_ready())
+    {
+        // no tables to build the operator from, so just run the zero bytes through meflib
+        ui1 zeros[4096];
+        memset(zeros, 0, sizeof(zeros));
+        for (; block_b_bytes > 0; block_b_bytes -= (si8) sizeof(zeros))
+            crc_a = CRC_update(zeros, (block_b_bytes < (si8) sizeof(zeros)) ? block_b_bytes : (si8) sizeof(zeros), crc_a);
+        return crc_a ^ crc_b;
+    }
+    
+    // operator for one zero byte
+    for (n = 0; n < 32; n++)
+        op[n] = crc_slice_table[0][((ui4) 1 << n) & 0xFF] ^ (((ui4) 1 << n) >> 8);
+    
+    while (1)
+    {
+        if (block_b_bytes & 1)
+            crc_a = gf2_matrix_times(op, crc_a);
+        block_b_bytes >>= 1;
+        if (block_b_bytes == 0)
+            break;
+        for (n = 0; n < 32; n++)
+            square[n] = gf2_matrix_times(op, op[n]);
+        memcpy(op, square, sizeof(op));
+    }
+    
+    return crc_a ^ crc_b;
+}
+
+// One piece of a large buffer, CRCed (from 0) on its own thread, see crc_update_parallel()
+typedef struct {
+    const ui1   *block_ptr;
+    si8         block_bytes;
+    ui4         crc;
+} CRC_PIECE;
+
+static MEF_THREAD_FUNCTION(crc_piece_thread, arg)
+{
+    CRC_PIECE *piece = (CRC_PIECE *) arg;
+    
+    piece->crc = mef_crc_update(piece->block_ptr, piece->block_bytes, 0);
+    
+    return MEF_THREAD_RETURN;
+}
+
+// mef_crc_update() of a large buffer, split into up to VIDEO_CRC_THREADS pieces that are CRCed at the same time
+static ui4 crc_update_parallel(const ui1 *block_ptr, si8 block_bytes, ui4 current_crc)
+{
+    CRC_PIECE pieces[VIDEO_CRC_THREADS];
+    MEF_THREAD threads[VIDEO_CRC_THREADS];
+    si4 started[VIDEO_CRC_THREADS];
+    si8 piece_bytes;
+    si4 i, n;
+    
+    // not worth a thread for less than a read's worth of data each
+    n = (si4) (block_bytes / VIDEO_FILE_READ_SIZE);
+    if (n > VIDEO_CRC_THREADS)
+        n = VIDEO_CRC_THREADS;
+    if (n < 2)
+        return mef_crc_update(block_ptr, block_bytes, current_crc);
+    
+    piece_bytes = block_bytes / n;
+    for (i = 0; i < n; i++)
+    {
+        pieces[i].block_ptr = block_ptr + (i * piece_bytes);
+        pieces[i].block_bytes = (i == n - 1) ? block_bytes - (i * piece_bytes) : piece_bytes;
+        started[i] = (i > 0 && mef_thread_create(&threads[i], crc_piece_thread, &pieces[i]) == 0);
+    }
+    
+    // the first piece is done here, along with any thread that couldn't be started
+    for (i = 0; i < n; i++)
+    {
+        if (started[i])
+            mef_thread_join(threads[i]);
+        else
+            crc_piece_thread(&pieces[i]);
+        current_crc = mef_crc_combine(current_crc, pieces[i].crc, pieces[i].block_bytes);
+    }
+    
+    return current_crc;
+}
 
+// Channels with the same passwords share one password data, with the expanded AES keys; the channels of a session
+// nearly always share their passwords.  Entries are found by the validation fields process_password_data() puts
+// in the universal header, which are hashes of the passwords, so the passwords themselves are never kept.
+typedef struct MEF_PASSWORD_CACHE_ENTRY {
+    PASSWORD_DATA   *password_data;
+    ui1     level_1_password_validation_field[PASSWORD_VALIDATION_FIELD_BYTES];
+    ui1     level_2_password_validation_field[PASSWORD_VALIDATION_FIELD_BYTES];
+    struct MEF_PASSWORD_CACHE_ENTRY *next;
+} MEF_PASSWORD_CACHE_ENTRY;
 
-// this creates a single static data block for use by all channels
-// this assumes all channels will need the same size data block
-ui1* GetDataBlockBuffer(ui8 block_len)
+static MEF_PASSWORD_CACHE_ENTRY *password_cache = NULL;  // protected by mef_globals_lock
+
+static PASSWORD_DATA *cached_password_data(si1 *level_1_password, si1 *level_2_password, UNIVERSAL_HEADER *uh)
 {
-    static ui1 *buff = 0;
+    MEF_PASSWORD_CACHE_ENTRY *entry;
+    PASSWORD_DATA *password_data;
+    
+    // not under the lock, so other threads aren't held up by the hashing and key expansion
+    password_data = process_password_data(NULL, level_1_password, level_2_password, uh);
+    if (password_data == NULL)
+        return NULL;
+    
+    mef_mutex_lock(&mef_globals_lock);
+    for (entry = password_cache; entry != NULL; entry = entry->next)
+        if (!memcmp(entry->level_1_password_validation_field, uh->level_1_password_validation_field, PASSWORD_VALIDATION_FIELD_BYTES) &&
+            !memcmp(entry->level_2_password_validation_field, uh->level_2_password_validation_field, PASSWORD_VALIDATION_FIELD_BYTES))
+            break;
+    if (entry != NULL)
+    {
+        mef_mutex_unlock(&mef_globals_lock);
+        memset(password_data, 0, sizeof(PASSWORD_DATA));
+        free(password_data);
+        return entry->password_data;
+    }
     
-    if (buff == 0)
-        buff = (ui1 *) malloc(block_len * 8);
+    entry = (MEF_PASSWORD_CACHE_ENTRY *) calloc((size_t) 1, sizeof(MEF_PASSWORD_CACHE_ENTRY));
+    if (entry == NULL)
+    {
+        fprintf(stderr, "Insufficient memory for password cache\n");
+        exit(1);
+    }
+    entry->password_data = password_data;
+    memcpy(entry->level_1_password_validation_field, uh->level_1_password_validation_field, PASSWORD_VALIDATION_FIELD_BYTES);
+    memcpy(entry->level_2_password_validation_field, uh->level_2_password_validation_field, PASSWORD_VALIDATION_FIELD_BYTES);
+    entry->next = password_cache;
+    password_cache = entry;
+    mef_mutex_unlock(&mef_globals_lock);
+    
+    return password_data;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+void release_mef_password_cache(void)
+{
+    MEF_PASSWORD_CACHE_ENTRY *entry;
     
-    return buff;
+    mef_mutex_lock(&mef_globals_lock);
+    while (password_cache != NULL)
+    {
+        entry = password_cache;
+        password_cache = entry->next;
+        memset(entry->password_data, 0, sizeof(PASSWORD_DATA));  // the keys
+        free(entry->password_data);
+        memset(entry, 0, sizeof(MEF_PASSWORD_CACHE_ENTRY));
+        free(entry);
+    }
+    mef_mutex_unlock(&mef_globals_lock);
+}
+
+// Writes the channel's resume file, see resume_mef_channel_data().  Written whole each time; it's small, and only
+// changes when a segment is started.  It is written to <file>.tmp and renamed over the old one, so a crash or a
+// short write leaves the old file rather than a truncated one.
+static void write_resume_state(CHANNEL_STATE *channel_state)
+{
+    MEF_RESUME_STATE state;
+    si1 file_name[MEF_FULL_FILE_NAME_BYTES], temp_name[MEF_FULL_FILE_NAME_BYTES];
+    FILE *fp;
+    si4 failed;
+    
+    memset(&state, 0, sizeof(MEF_RESUME_STATE));
+    state.version = RESUME_STATE_VERSION;
+    state.next_segment_number = channel_state->ts_data_fps->universal_header->segment_number + 1;
+    state.CRC = mef_crc_calculate((ui1 *) &state + CRC_BYTES, (si8) sizeof(MEF_RESUME_STATE) - CRC_BYTES);
+    
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", channel_state->channel_path,
+                 channel_state->gen_fps->universal_header->channel_name, RESUME_STATE_FILE_TYPE_STRING);
+    if (MEF_snprintf(temp_name, MEF_FULL_FILE_NAME_BYTES, "%s.tmp", file_name) >= MEF_FULL_FILE_NAME_BYTES)
+        return;
+    fp = fopen(temp_name, "wb");
+    if (fp == NULL)
+        return;
+    failed = (fwrite(&state, sizeof(MEF_RESUME_STATE), (size_t) 1, fp) != 1);
+    failed |= (fflush(fp) != 0);
+    failed |= (fclose(fp) != 0);
+    if (!failed)
+#ifdef _WIN32
+        failed = !MoveFileExA(temp_name, file_name, MOVEFILE_REPLACE_EXISTING);
+#else
+        failed = (rename(temp_name, file_name) != 0);
+#endif
+    if (failed)
+    {
+        fprintf(stderr, "Could not write resume file %s\n", file_name);
+        remove(temp_name);
+    }
 }
 
 #ifdef _EXPORT_FOR_DLL
@@ -77,10 +927,8 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
                             )
 {
     extern MEF_GLOBALS	*MEF_globals;
-    ui4 max_samps;
-    SEGMENT     prev_segment;
-    si1			prev_segment_name[MEF_SEGMENT_BASE_FILE_NAME_BYTES];
-    si1         command[512];
+    FILE_PROCESSING_STRUCT *prev_metadata_fps;
+    si1			prev_metadata_name[MEF_FULL_FILE_NAME_BYTES];
     si1         extension[TYPE_BYTES];
     si1			mef3_session_path_extracted[MEF_FULL_FILE_NAME_BYTES];
     si1			mef3_session_path[MEF_FULL_FILE_NAME_BYTES], mef3_session_name[MEF_BASE_FILE_NAME_BYTES];
@@ -97,19 +945,26 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
     
     channel_state->if_appending = 1;
     
-    sprintf(prev_segment_name, "%s/%s.timd/%s-%06d.segd", mef3_session_directory, chan_map_name, chan_map_name, new_segment_number - 1);
-    
-    (void) read_MEF_segment(&prev_segment, prev_segment_name, TIME_SERIES_CHANNEL_TYPE, mef_3_level_2_password, NULL, MEF_FALSE, MEF_FALSE);
-    
-    
-    channel_state->raw_data_ptr_start = (si4 *) calloc((size_t) ((prev_segment.metadata_fps->metadata.time_series_section_2->block_interval / 1e6) *
-                                                                 prev_segment.metadata_fps->metadata.time_series_section_2->sampling_frequency
-                                                                 * 2), sizeof(si4));
-    if (channel_state->raw_data_ptr_start == NULL)
+    // Everything carried over comes from the previous segment's metadata file, so that is all that is read.
+    // (read_MEF_segment() would also read the index file, and the data file's header.)
+    MEF_snprintf(prev_metadata_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s/%s-%06d.%s/%s-%06d.%s", mef3_session_directory,
+                 chan_map_name, TIME_SERIES_CHANNEL_DIRECTORY_TYPE_STRING, chan_map_name, new_segment_number - 1, SEGMENT_DIRECTORY_TYPE_STRING,
+                 chan_map_name, new_segment_number - 1, TIME_SERIES_METADATA_FILE_TYPE_STRING);
+    prev_metadata_fps = read_MEF_file(NULL, prev_metadata_name, mef_3_level_2_password, NULL, NULL, USE_GLOBAL_BEHAVIOR);
+    if (prev_metadata_fps == NULL)
     {
-        fprintf(stderr, "Insufficient memory to allocate temporary channel buffer\n");
-        exit(1);
+        fprintf(stderr, "Could not read %s, not appending\n", prev_metadata_name);
+        channel_state->if_appending = 0;
+        return 0;
     }
+    
+    
+    channel_state->raw_data_buffer_samples = block_buffer_samples(prev_metadata_fps->metadata.time_series_section_2->block_interval, 0.0,
+                                                                  prev_metadata_fps->metadata.time_series_section_2->sampling_frequency);
+    // raw buffer, index batch (see write_index_batch()) and data staging buffer (see write_data_batch())
+    init_channel_defaults(channel_state);
+    claim_retained_buffers(channel_state);
+    allocate_channel_arena(channel_state);
     channel_state->raw_data_ptr_current        = channel_state->raw_data_ptr_start;
     channel_state->block_hdr_time              = 0;
     channel_state->block_boundary              = 0;
@@ -124,7 +979,7 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
     channel_state->bit_shift_flag              = bit_shift_flag;
     channel_state->block_len                   = 0;  // this will be overwritten when write_mef_channel_data() is called  // TBD this variable isn't used
     
-    channel_state->chan_num = prev_segment.metadata_fps->metadata.time_series_section_2->acquisition_channel_number;
+    channel_state->chan_num = prev_metadata_fps->metadata.time_series_section_2->acquisition_channel_number;
     
     // get mef3 session name and path from passed directory
     extract_path_parts(mef3_session_directory, mef3_session_path_extracted, mef3_session_name, extension);
@@ -140,8 +995,8 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
     initialize_universal_header(channel_state->gen_fps, MEF_FALSE, MEF_FALSE, MEF_FALSE);
     uh = channel_state->gen_fps->universal_header;
     uh->segment_number = new_segment_number;
-    MEF_strncpy(uh->session_name, prev_segment.metadata_fps->universal_header->session_name, MEF_BASE_FILE_NAME_BYTES);
-    MEF_strncpy(uh->anonymized_name, prev_segment.metadata_fps->universal_header->anonymized_name, UNIVERSAL_HEADER_ANONYMIZED_NAME_BYTES);
+    MEF_strncpy(uh->session_name, prev_metadata_fps->universal_header->session_name, MEF_BASE_FILE_NAME_BYTES);
+    MEF_strncpy(uh->anonymized_name, prev_metadata_fps->universal_header->anonymized_name, UNIVERSAL_HEADER_ANONYMIZED_NAME_BYTES);
     uh->start_time = UNIVERSAL_HEADER_START_TIME_NO_ENTRY;
     uh->end_time = UNIVERSAL_HEADER_END_TIME_NO_ENTRY;
     if (mef_3_level_2_password != NULL)
@@ -151,7 +1006,7 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
             fprintf(stderr, "If a level 2 password is specified, then a level 1 password must be specified also.  Exiting...\n");
             exit(0);
         }
-        channel_state->pwd = channel_state->gen_fps->password_data = process_password_data(NULL, mef_3_level_1_password, mef_3_level_2_password, uh);
+        channel_state->pwd = channel_state->gen_fps->password_data = cached_password_data(mef_3_level_1_password, mef_3_level_2_password, uh);
     }
     else
         channel_state->pwd = channel_state->gen_fps->password_data = NULL;
@@ -163,7 +1018,7 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
     //system(command);
     
     // copy channel name into generic universal header
-    MEF_strncpy(channel_state->gen_fps->universal_header->channel_name, prev_segment.metadata_fps->universal_header->channel_name, MEF_BASE_FILE_NAME_BYTES);
+    MEF_strncpy(channel_state->gen_fps->universal_header->channel_name, prev_metadata_fps->universal_header->channel_name, MEF_BASE_FILE_NAME_BYTES);
     
     // make mef3 segment name
     generate_segment_name(channel_state->gen_fps, segment_name);
@@ -173,17 +1028,16 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
     
     // make mef3 segment directory
     sprintf(segment_path, "%s/%s.%s", channel_path, segment_name, SEGMENT_DIRECTORY_TYPE_STRING);
-    sprintf(command, "mkdir %s", segment_path);
-    system(command);
+    make_directory(segment_path);
     
     // generate level UUID into generic universal_header
-    generate_UUID(channel_state->gen_fps->universal_header->level_UUID);
+    generate_UUID_thread_safe(channel_state->gen_fps->universal_header->level_UUID);
     
     // set up mef3 time series metadata file
     channel_state->metadata_fps = allocate_file_processing_struct(METADATA_FILE_BYTES, TIME_SERIES_METADATA_FILE_TYPE_CODE, NULL, channel_state->gen_fps, UNIVERSAL_HEADER_BYTES);
     MEF_snprintf(channel_state->metadata_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_METADATA_FILE_TYPE_STRING);
     uh = channel_state->metadata_fps->universal_header;
-    generate_UUID(uh->file_UUID);
+    generate_UUID_thread_safe(uh->file_UUID);
     uh->number_of_entries = 1;
     uh->maximum_entry_size = METADATA_FILE_BYTES;
     initialize_metadata(channel_state->metadata_fps);
@@ -198,46 +1052,48 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
         channel_state->metadata_fps->metadata.section_1->section_3_encryption = NO_ENCRYPTION;
     }
     md2 = channel_state->metadata_fps->metadata.time_series_section_2;
-    MEF_strncpy(md2->channel_description, prev_segment.metadata_fps->metadata.time_series_section_2->channel_description, METADATA_CHANNEL_DESCRIPTION_BYTES);
-    MEF_strncpy(md2->session_description, prev_segment.metadata_fps->metadata.time_series_section_2->session_description, METADATA_SESSION_DESCRIPTION_BYTES);
+    MEF_strncpy(md2->channel_description, prev_metadata_fps->metadata.time_series_section_2->channel_description, METADATA_CHANNEL_DESCRIPTION_BYTES);
+    MEF_strncpy(md2->session_description, prev_metadata_fps->metadata.time_series_section_2->session_description, METADATA_SESSION_DESCRIPTION_BYTES);
     md2->recording_duration = METADATA_RECORDING_DURATION_NO_ENTRY;
-    md2->sampling_frequency = prev_segment.metadata_fps->metadata.time_series_section_2->sampling_frequency;
-    md2->low_frequency_filter_setting = prev_segment.metadata_fps->metadata.time_series_section_2->low_frequency_filter_setting;
-    md2->high_frequency_filter_setting = prev_segment.metadata_fps->metadata.time_series_section_2->high_frequency_filter_setting;
-    md2->notch_filter_frequency_setting = prev_segment.metadata_fps->metadata.time_series_section_2->notch_filter_frequency_setting;
-    md2->AC_line_frequency = prev_segment.metadata_fps->metadata.time_series_section_2->AC_line_frequency;
-    md2->units_conversion_factor = prev_segment.metadata_fps->metadata.time_series_section_2->units_conversion_factor;
+    md2->sampling_frequency = prev_metadata_fps->metadata.time_series_section_2->sampling_frequency;
+    md2->low_frequency_filter_setting = prev_metadata_fps->metadata.time_series_section_2->low_frequency_filter_setting;
+    md2->high_frequency_filter_setting = prev_metadata_fps->metadata.time_series_section_2->high_frequency_filter_setting;
+    md2->notch_filter_frequency_setting = prev_metadata_fps->metadata.time_series_section_2->notch_filter_frequency_setting;
+    md2->AC_line_frequency = prev_metadata_fps->metadata.time_series_section_2->AC_line_frequency;
+    md2->units_conversion_factor = prev_metadata_fps->metadata.time_series_section_2->units_conversion_factor;
     MEF_strncpy(md2->units_description, "microvolts", TIME_SERIES_METADATA_UNITS_DESCRIPTION_BYTES);
     md2->maximum_native_sample_value = TIME_SERIES_METADATA_MAXIMUM_NATIVE_SAMPLE_VALUE_NO_ENTRY;  // must test against NaN later on
     md2->minimum_native_sample_value = TIME_SERIES_METADATA_MINIMUM_NATIVE_SAMPLE_VALUE_NO_ENTRY;
-    md2->start_sample = prev_segment.metadata_fps->metadata.time_series_section_2->start_sample + prev_segment.metadata_fps->metadata.time_series_section_2->number_of_samples;
+    md2->start_sample = prev_metadata_fps->metadata.time_series_section_2->start_sample + prev_metadata_fps->metadata.time_series_section_2->number_of_samples;
     md2->number_of_samples = 0;  // fill in when convert RED blocks
     md2->number_of_blocks = 0;  // fill in when convert RED blocks
     md2->maximum_block_bytes = 0;  // fill in when convert RED blocks
     md2->maximum_block_samples = 0;  // fill in when convert RED blocks
     md2->maximum_difference_bytes = 0;  // fill in when convert RED blocks
-    md2->block_interval = prev_segment.metadata_fps->metadata.time_series_section_2->block_interval;
+    md2->block_interval = prev_metadata_fps->metadata.time_series_section_2->block_interval;
     md2->number_of_discontinuities = 0;  // fill in when convert RED blocks
     md2->maximum_contiguous_blocks = 0;  // fill in when convert RED blocks
     md2->maximum_contiguous_block_bytes = 0;  // fill in when convert RED blocks;
     md2->maximum_contiguous_samples = 0;  // fill in when convert RED blocks;
-    md2->acquisition_channel_number = prev_segment.metadata_fps->metadata.time_series_section_2->acquisition_channel_number;  // for purposes of this program, these two will always be the same
+    md2->acquisition_channel_number = prev_metadata_fps->metadata.time_series_section_2->acquisition_channel_number;  // for purposes of this program, these two will always be the same
     md3 = channel_state->metadata_fps->metadata.section_3;
-    md3->recording_time_offset = prev_segment.metadata_fps->metadata.section_3->recording_time_offset;
-    MEF_globals->recording_time_offset = md3->recording_time_offset;  // TBD make this thread_safe?
-    md3->GMT_offset = prev_segment.metadata_fps->metadata.section_3->GMT_offset;
-    MEF_globals->GMT_offset = md3->GMT_offset;  // TBD make this thread safe?
+    md3->recording_time_offset = prev_metadata_fps->metadata.section_3->recording_time_offset;
+    md3->GMT_offset = prev_metadata_fps->metadata.section_3->GMT_offset;
+    mef_mutex_lock(&mef_globals_lock);
+    MEF_globals->recording_time_offset = md3->recording_time_offset;
+    MEF_globals->GMT_offset = md3->GMT_offset;
+    mef_mutex_unlock(&mef_globals_lock);
     //channel_state->gmt_offset_in_hours = gmt_offset;  // not used, since we already know offsets
-    MEF_strncpy(md3->subject_name_1, prev_segment.metadata_fps->metadata.section_3->subject_name_1, METADATA_SUBJECT_NAME_BYTES);
-    MEF_strncpy(md3->subject_name_2, prev_segment.metadata_fps->metadata.section_3->subject_name_2, METADATA_SUBJECT_NAME_BYTES);
-    MEF_strncpy(md3->subject_ID, prev_segment.metadata_fps->metadata.section_3->subject_ID, METADATA_SUBJECT_ID_BYTES);
-    MEF_strncpy(md3->recording_location, prev_segment.metadata_fps->metadata.section_3->recording_location, METADATA_RECORDING_LOCATION_BYTES);
+    MEF_strncpy(md3->subject_name_1, prev_metadata_fps->metadata.section_3->subject_name_1, METADATA_SUBJECT_NAME_BYTES);
+    MEF_strncpy(md3->subject_name_2, prev_metadata_fps->metadata.section_3->subject_name_2, METADATA_SUBJECT_NAME_BYTES);
+    MEF_strncpy(md3->subject_ID, prev_metadata_fps->metadata.section_3->subject_ID, METADATA_SUBJECT_ID_BYTES);
+    MEF_strncpy(md3->recording_location, prev_metadata_fps->metadata.section_3->recording_location, METADATA_RECORDING_LOCATION_BYTES);
     
     // set up mef3 time series indices file
     channel_state->ts_inds_fps = allocate_file_processing_struct(UNIVERSAL_HEADER_BYTES, TIME_SERIES_INDICES_FILE_TYPE_CODE, NULL, channel_state->metadata_fps, UNIVERSAL_HEADER_BYTES);
     MEF_snprintf(channel_state->ts_inds_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_INDICES_FILE_TYPE_STRING);
     uh = channel_state->ts_inds_fps->universal_header;
-    generate_UUID(uh->file_UUID);
+    generate_UUID_thread_safe(uh->file_UUID);
     uh->number_of_entries = 0;  // fill in when convert RED blocks
     uh->maximum_entry_size = TIME_SERIES_INDEX_BYTES;
     channel_state->ts_inds_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;  // write out the universal header, then the RED blocks piecemeal
@@ -250,7 +1106,7 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
     channel_state->ts_data_fps = allocate_file_processing_struct(UNIVERSAL_HEADER_BYTES, TIME_SERIES_DATA_FILE_TYPE_CODE, NULL, channel_state->metadata_fps, UNIVERSAL_HEADER_BYTES);
     MEF_snprintf(channel_state->ts_data_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_DATA_FILE_TYPE_STRING);
     uh = channel_state->ts_data_fps->universal_header;
-    generate_UUID(uh->file_UUID);
+    generate_UUID_thread_safe(uh->file_UUID);
     uh->number_of_entries = 0;  // fill in when convert RED blocks
     uh->maximum_entry_size = 0;  // fill in when converet RED blocks
     channel_state->ts_data_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;  // write out the universal header, then the RED blocks piecemeal
@@ -259,30 +1115,23 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
     channel_state->data_file_offset = UNIVERSAL_HEADER_BYTES;
     channel_state->ts_data_fps->universal_header->body_CRC = CRC_START_VALUE;
     
+    // a segment was started
+    write_resume_state(channel_state);
+    
     // allocate new memory for new RED blocks
-    max_samps = (prev_segment.metadata_fps->metadata.time_series_section_2->block_interval / 1e6) *
-    prev_segment.metadata_fps->metadata.time_series_section_2->sampling_frequency * 2;
-    channel_state->rps = RED_allocate_processing_struct(max_samps, RED_MAX_COMPRESSED_BYTES(max_samps, 1), 0, RED_MAX_DIFFERENCE_BYTES(max_samps), 0, 0, channel_state->pwd);
+    allocate_channel_rps(channel_state);
     //channel_state->rps->directives.return_block_extrema = MEF_TRUE;
-    // free original_data of rps, since we'll never use it anyway, and that pointer will be re-assigned before each RED compression
-    // TBD modify it so original_data is not allocated in the first place?
-    free(channel_state->rps->original_data);
     
     // set up discontinuity state information
     channel_state->discont_contiguous_blocks = 0;
     channel_state->discont_contiguous_samples = 0;
     channel_state->discont_contiguous_bytes = 0;
     
-    // make these part of the channel state to keep everything thread-safe
-    channel_state->out_data = (ui1 *) malloc(32000 * 8);  // This assumes 1 second blocks, sampled at 32000 Hz
-    channel_state->temp_time_series_index = (ui1*) calloc(sizeof(ui1), 8+8+8+4+4+4+4+4+1+RED_BLOCK_PROTECTED_REGION_BYTES+RED_BLOCK_DISCRETIONARY_REGION_BYTES);
-    
     channel_state->num_secs_per_segment = num_secs_per_segment;
     channel_state->next_segment_start_time = 0;
     channel_state->start_sample = 0;
     
-    // TBD fix this
-    //free_segment(&prev_segment, MEF_FALSE);
+    free_file_processing_struct(prev_metadata_fps);
     
     return(1);
     
@@ -292,27 +1141,379 @@ si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
 __declspec(dllexport)
 #endif
 
-si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
-                                 sf8 secs_per_block,
-                                 si1 *chan_map_name,
-                                 si4 bit_shift_flag,
-                                 sf8 low_frequency_filter_setting,
-                                 sf8 high_frequency_filter_setting,
-                                 sf8 notch_filter_frequency,
-                                 sf8 AC_line_frequency,
-                                 sf8 units_conversion_factor,
-                                 si1 *channel_description,
-                                 sf8 sampling_frequency,
-                                 si8 block_interval,
-                                 si4 chan_num,
-                                 si1 *mef3_session_directory,
-                                 sf4 gmt_offset,
-                                 si1 *session_description,
-                                 si1 *anonymized_subject_name,
-                                 si1 *subject_first_name,
-                                 si1 *subject_second_name,
-                                 si1 *subject_id,
-                                 si1 *institution,
+si4 resume_mef_channel_data(CHANNEL_STATE *channel_state,
+                            si1 *chan_map_name,
+                            si1 *mef_3_level_1_password,
+                            si1 *mef_3_level_2_password,
+                            si1 *mef3_session_directory,
+                            ui8 num_secs_per_segment,
+                            si4 bit_shift_flag)
+{
+    MEF_RESUME_STATE state;
+    si1 file_name[MEF_FULL_FILE_NAME_BYTES];
+    FILE *fp;
+    size_t n_read;
+    
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s/%s.%s", mef3_session_directory, chan_map_name,
+                 TIME_SERIES_CHANNEL_DIRECTORY_TYPE_STRING, chan_map_name, RESUME_STATE_FILE_TYPE_STRING);
+    fp = fopen(file_name, "rb");
+    if (fp == NULL)
+        return 0;
+    n_read = fread(&state, sizeof(MEF_RESUME_STATE), (size_t) 1, fp);
+    fclose(fp);
+    
+    if (n_read != 1 || state.version != RESUME_STATE_VERSION ||
+        state.CRC != mef_crc_calculate((ui1 *) &state + CRC_BYTES, (si8) sizeof(MEF_RESUME_STATE) - CRC_BYTES))
+    {
+        fprintf(stderr, "Resume file %s is not valid\n", file_name);
+        return 0;
+    }
+    
+    return append_mef_channel_data(channel_state, chan_map_name, state.next_segment_number, mef_3_level_1_password,
+                                   mef_3_level_2_password, mef3_session_directory, num_secs_per_segment, bit_shift_flag);
+}
+
+// The .mefd file of each session is read (if it exists) the first time a channel is added to it, and then kept
+// in memory.  Adding a channel is a hash lookup, and the file is only written when a channel writes its registry
+// (or by flush_mefd_files()), which adds the new entries and rewrites the header.  A channel does that at its
+// checkpoints until it is listed, and at close.  The registry is freed when the last of its channels closes.
+typedef struct MEFD_REGISTRY {
+    si1     file_name[MEF_FULL_FILE_NAME_BYTES];
+    UNIVERSAL_HEADER uh;
+    si1     *entries;                 // number_of_entries entries of MEFD_ENTRY_BYTES
+    si8     entries_allocated;
+    si8     entries_written;          // entries already in the file
+    si8     *slots;                   // hash set of entries, index + 1, 0 is empty
+    si8     number_of_slots;          // power of 2, at least twice the entries
+    si4     open_channels;            // channels holding on to the registry, see register_mefd_channel()
+    struct MEFD_REGISTRY *next;
+} MEFD_REGISTRY;
+
+static MEFD_REGISTRY *mefd_registries = NULL;
+
+// Returns the slot holding entry, or the empty slot it would go in
+static si8 mefd_registry_slot(MEFD_REGISTRY *registry, si1 *entry)
+{
+    si8 slot;
+    
+    slot = (si8) (string_hash(entry) & (ui4) (registry->number_of_slots - 1));
+    while (registry->slots[slot] != 0 &&
+           strncmp(registry->entries + (registry->slots[slot] - 1) * MEFD_ENTRY_BYTES, entry, MEFD_ENTRY_BYTES))
+        slot = (slot + 1) & (registry->number_of_slots - 1);
+    
+    return slot;
+}
+
+// entry is MEFD_ENTRY_BYTES, zero padded.  Returns 1 if it was added, 0 if it was already there.
+static si4 add_mefd_registry_entry(MEFD_REGISTRY *registry, si1 *entry)
+{
+    si8 slot, i, old_number_of_slots, *old_slots;
+    si1 *new_entries;
+    
+    if (registry->slots[mefd_registry_slot(registry, entry)] != 0)
+        return 0;
+    
+    if (registry->uh.number_of_entries == registry->entries_allocated)
+    {
+        registry->entries_allocated *= 2;
+        new_entries = (si1 *) realloc(registry->entries, (size_t) (registry->entries_allocated * MEFD_ENTRY_BYTES));
+        if (new_entries == NULL)
+        {
+            fprintf(stderr, "Insufficient memory to allocate .mefd entries\n");
+            exit(1);
+        }
+        registry->entries = new_entries;
+    }
+    if (2 * (registry->uh.number_of_entries + 1) > registry->number_of_slots)
+    {
+        old_slots = registry->slots;
+        old_number_of_slots = registry->number_of_slots;
+        registry->number_of_slots *= 2;
+        registry->slots = (si8 *) calloc((size_t) registry->number_of_slots, sizeof(si8));
+        if (registry->slots == NULL)
+        {
+            fprintf(stderr, "Insufficient memory to allocate .mefd entries\n");
+            exit(1);
+        }
+        for (i = 0; i < old_number_of_slots; i++)
+            if (old_slots[i] != 0)
+                registry->slots[mefd_registry_slot(registry, registry->entries + (old_slots[i] - 1) * MEFD_ENTRY_BYTES)] = old_slots[i];
+        free(old_slots);
+    }
+    
+    memcpy(registry->entries + registry->uh.number_of_entries * MEFD_ENTRY_BYTES, entry, (size_t) MEFD_ENTRY_BYTES);
+    registry->uh.number_of_entries++;
+    slot = mefd_registry_slot(registry, entry);
+    registry->slots[slot] = registry->uh.number_of_entries;
+    registry->uh.body_CRC = mef_crc_update((ui1*)entry, MEFD_ENTRY_BYTES, registry->uh.body_CRC);
+    
+    return 1;
+}
+
+// Finds the registry of a .mefd file, reading the file the first time.  Call with mefd_file_lock held.
+static MEFD_REGISTRY *get_mefd_registry(si1 *mefd_file_name, si1 *mef3_session_name, si1* anonymized_subject_name)
+{
+    MEFD_REGISTRY *registry;
+    FILE* mefd_fp;
+    UNIVERSAL_HEADER mefd_uh;
+    si1 *file_entries;
+    si8 i, number_of_entries;
+    
+    for (registry = mefd_registries; registry != NULL; registry = registry->next)
+        if (!strcmp(registry->file_name, mefd_file_name))
+            return registry;
+    
+    registry = (MEFD_REGISTRY *) calloc((size_t) 1, sizeof(MEFD_REGISTRY));
+    if (registry == NULL)
+    {
+        fprintf(stderr, "Insufficient memory to allocate .mefd entries\n");
+        exit(1);
+    }
+    MEF_strncpy(registry->file_name, mefd_file_name, MEF_FULL_FILE_NAME_BYTES);
+    registry->entries_allocated = 64;
+    registry->number_of_slots = 128;
+    registry->entries = (si1 *) malloc((size_t) (registry->entries_allocated * MEFD_ENTRY_BYTES));
+    registry->slots = (si8 *) calloc((size_t) registry->number_of_slots, sizeof(si8));
+    if (registry->entries == NULL || registry->slots == NULL)
+    {
+        fprintf(stderr, "Insufficient memory to allocate .mefd entries\n");
+        exit(1);
+    }
+    
+    // an existing file keeps its header, and its entries are read in one go
+    file_entries = NULL;
+    number_of_entries = 0;
+    mefd_fp = fopen(mefd_file_name, "rb");
+    if (mefd_fp != NULL && fread(&mefd_uh, UNIVERSAL_HEADER_BYTES, 1, mefd_fp) == 1 && mefd_uh.number_of_entries >= 0)
+    {
+        number_of_entries = mefd_uh.number_of_entries;
+        file_entries = (si1 *) malloc((size_t) ((number_of_entries + 1) * MEFD_ENTRY_BYTES));
+        if (file_entries == NULL)
+        {
+            fprintf(stderr, "Insufficient memory to allocate .mefd entries\n");
+            exit(1);
+        }
+        // a short file keeps the entries it really has
+        number_of_entries = (si8) fread(file_entries, MEFD_ENTRY_BYTES, (size_t) number_of_entries, mefd_fp);
+        registry->uh = mefd_uh;
+        registry->uh.number_of_entries = 0;
+        registry->uh.body_CRC = CRC_START_VALUE;
+        for (i = 0; i < number_of_entries; i++)
+            add_mefd_registry_entry(registry, file_entries + i * MEFD_ENTRY_BYTES);
+        registry->entries_written = registry->uh.number_of_entries;
+        free(file_entries);
+    }
+    else
+    {
+        // default universal header
+        memset(&registry->uh, 0, UNIVERSAL_HEADER_BYTES);
+        registry->uh.body_CRC = CRC_START_VALUE;
+        memset(registry->uh.channel_name, 0, MEF_BASE_FILE_NAME_BYTES);
+        sprintf(registry->uh.file_type_string, "%s", "mefd");
+        registry->uh.mef_version_major = MEF_VERSION_MAJOR;
+        registry->uh.mef_version_minor = MEF_VERSION_MINOR;
+        registry->uh.byte_order_code = MEF_LITTLE_ENDIAN;
+        registry->uh.start_time = UUTC_NO_ENTRY;
+        registry->uh.end_time = UUTC_NO_ENTRY;
+        if (anonymized_subject_name != NULL)
+            MEF_strncpy(registry->uh.anonymized_name, anonymized_subject_name, UNIVERSAL_HEADER_ANONYMIZED_NAME_BYTES);
+        else
+            MEF_strncpy(registry->uh.anonymized_name, "not_entered", UNIVERSAL_HEADER_ANONYMIZED_NAME_BYTES);
+        if (mef3_session_name != NULL)
+            MEF_strncpy(registry->uh.session_name, mef3_session_name, MEF_BASE_FILE_NAME_BYTES);
+        else
+            MEF_strncpy(registry->uh.session_name, "not_entered", MEF_BASE_FILE_NAME_BYTES);
+        // Set level UUIDs to zero - this should be coordinated with records files at this level, in order for a UUID here to really be valid
+        //generate_UUID(mefd_uh.level_UUID);  // already zero'd out
+        generate_UUID_thread_safe(registry->uh.file_UUID);
+        registry->uh.maximum_entry_size = MEFD_ENTRY_BYTES;
+        registry->uh.number_of_entries = 0;
+        registry->uh.segment_number = -3; // session level
+        memset(registry->uh.level_1_password_validation_field, 0, PASSWORD_VALIDATION_FIELD_BYTES);
+        memset(registry->uh.level_2_password_validation_field, 0, PASSWORD_VALIDATION_FIELD_BYTES);
+        registry->entries_written = -1;  // the file has to be created
+    }
+    if (mefd_fp != NULL)
+        fclose(mefd_fp);
+    
+    registry->next = mefd_registries;
+    mefd_registries = registry;
+    
+    return registry;
+}
+
+// Adds a channel to the registry of its session's .mefd file.  Call with mefd_file_lock held.
+static MEFD_REGISTRY *add_mefd_channel(si1 *mef3_session_path, si1 *mef3_session_name, si1* chan_name, si1* anonymized_subject_name)
+{
+    MEFD_REGISTRY *registry;
+    si1 mefd_file_name[MEF_FULL_FILE_NAME_BYTES];
+    si1 file_name_output[MEFD_ENTRY_BYTES];
+    
+    sprintf(mefd_file_name, "%s/%s.mefd", mef3_session_path, mef3_session_name);
+    memset(file_name_output, 0, MEFD_ENTRY_BYTES);
+    sprintf(file_name_output, "%s.%s", chan_name, TIME_SERIES_CHANNEL_DIRECTORY_TYPE_STRING);
+    
+    registry = get_mefd_registry(mefd_file_name, mef3_session_name, anonymized_subject_name);
+    add_mefd_registry_entry(registry, file_name_output);
+    
+    return registry;
+}
+
+// Unlinks and frees a registry.  Call with mefd_file_lock held.
+static void free_mefd_registry(MEFD_REGISTRY *registry)
+{
+    MEFD_REGISTRY **link;
+    
+    for (link = &mefd_registries; *link != registry; link = &((*link)->next))
+        ;
+    *link = registry->next;
+    free(registry->entries);
+    free(registry->slots);
+    free(registry);
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+void update_mefd_file(si1 *mef3_session_path, si1 *mef3_session_name, si1* chan_name, si1* anonymized_subject_name)
+{
+    // channels can be created from several threads, and they all share this one file
+    mef_mutex_lock(&mefd_file_lock);
+    (void) add_mefd_channel(mef3_session_path, mef3_session_name, chan_name, anonymized_subject_name);
+    mef_mutex_unlock(&mefd_file_lock);
+}
+
+// Writes the entries added since the last time, and the header.  Call with mefd_file_lock held.
+static void write_mefd_registry(MEFD_REGISTRY *registry)
+{
+    FILE* mefd_fp;
+    
+    if (registry->entries_written == registry->uh.number_of_entries)
+        return;
+    
+    // update MEFD file (used by Persyst)
+    mefd_fp = NULL;
+    if (registry->entries_written >= 0)
+        mefd_fp = fopen(registry->file_name, "rb+");
+    if (mefd_fp == NULL)
+    {
+        // new, or gone since it was read
+        mefd_fp = fopen(registry->file_name, "wb");
+        if (mefd_fp == NULL)
+        {
+            fprintf(stderr, "Could not write %s\n", registry->file_name);
+            return;
+        }
+        registry->entries_written = 0;
+    }
+    
+    e_fseek(mefd_fp, UNIVERSAL_HEADER_BYTES + registry->entries_written * MEFD_ENTRY_BYTES, SEEK_SET, registry->file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    (void)e_fwrite(registry->entries + registry->entries_written * MEFD_ENTRY_BYTES, MEFD_ENTRY_BYTES, (size_t) (registry->uh.number_of_entries - registry->entries_written), mefd_fp, registry->file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    
+    // then the header that counts them
+    registry->uh.header_CRC = mef_crc_calculate((ui1*)&registry->uh + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
+    e_fseek(mefd_fp, 0, SEEK_SET, registry->file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    (void)e_fwrite(&registry->uh, sizeof(UNIVERSAL_HEADER), (size_t)1, mefd_fp, registry->file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    fclose(mefd_fp);
+    
+    registry->entries_written = registry->uh.number_of_entries;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+void flush_mefd_files(void)
+{
+    MEFD_REGISTRY *registry, *next;
+    
+    // registries no open channel holds on to were only filled by update_mefd_file(), and can go once written
+    mef_mutex_lock(&mefd_file_lock);
+    for (registry = mefd_registries; registry != NULL; registry = next)
+    {
+        next = registry->next;
+        write_mefd_registry(registry);
+        if (registry->open_channels == 0)
+            free_mefd_registry(registry);
+    }
+    mef_mutex_unlock(&mefd_file_lock);
+}
+
+// Adds the channel to its session's .mefd registry, which the channel holds on to until it is finished
+static void register_mefd_channel(CHANNEL_STATE *channel_state, si1 *mef3_session_path, si1 *mef3_session_name, si1* chan_name, si1* anonymized_subject_name)
+{
+    MEFD_REGISTRY *registry;
+    
+    // channels can be created from several threads, and they all share this one file
+    mef_mutex_lock(&mefd_file_lock);
+    registry = add_mefd_channel(mef3_session_path, mef3_session_name, chan_name, anonymized_subject_name);
+    registry->open_channels++;
+    mef_mutex_unlock(&mefd_file_lock);
+    
+    channel_state->mefd_registry = registry;
+    channel_state->mefd_listed = 0;
+}
+
+// Called at checkpoints, so readers find the channel in the .mefd file.  Once it is listed there is nothing to
+// do, so only the first checkpoints of a channel take the lock.
+static void flush_channel_mefd_file(CHANNEL_STATE *channel_state)
+{
+    MEFD_REGISTRY *registry;
+    
+    registry = (MEFD_REGISTRY *) channel_state->mefd_registry;
+    if (registry == NULL || channel_state->mefd_listed)
+        return;
+    
+    mef_mutex_lock(&mefd_file_lock);
+    write_mefd_registry(registry);
+    channel_state->mefd_listed = (registry->entries_written == registry->uh.number_of_entries);
+    mef_mutex_unlock(&mefd_file_lock);
+}
+
+// Writes the channel's .mefd registry a last time and lets go of it; the last channel of a session frees it
+static void release_channel_mefd_file(CHANNEL_STATE *channel_state)
+{
+    MEFD_REGISTRY *registry;
+    
+    registry = (MEFD_REGISTRY *) channel_state->mefd_registry;
+    if (registry == NULL)
+        return;
+    
+    mef_mutex_lock(&mefd_file_lock);
+    write_mefd_registry(registry);
+    if (--registry->open_channels == 0)
+        free_mefd_registry(registry);
+    mef_mutex_unlock(&mefd_file_lock);
+    
+    channel_state->mefd_registry = NULL;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec(dllexport)
+#endif
+
+si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
+                                 sf8 secs_per_block,
+                                 si1 *chan_map_name,
+                                 si4 bit_shift_flag,
+                                 sf8 low_frequency_filter_setting,
+                                 sf8 high_frequency_filter_setting,
+                                 sf8 notch_filter_frequency,
+                                 sf8 AC_line_frequency,
+                                 sf8 units_conversion_factor,
+                                 si1 *channel_description,
+                                 sf8 sampling_frequency,
+                                 si8 block_interval,
+                                 si4 chan_num,
+                                 si1 *mef3_session_directory,
+                                 sf4 gmt_offset,
+                                 si1 *session_description,
+                                 si1 *anonymized_subject_name,
+                                 si1 *subject_first_name,
+                                 si1 *subject_second_name,
+                                 si1 *subject_id,
+                                 si1 *institution,
                                  si1 *mef_3_level_1_password,
                                  si1 *mef_3_level_2_password,
                                  si1 *study_comments,
@@ -322,8 +1523,6 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
 {
     extern int errno;
     extern MEF_GLOBALS	*MEF_globals;
-    ui4 max_samps;
-    si1	command[512];
     si1 extension[TYPE_BYTES];
     si1			mef3_session_path_extracted[MEF_FULL_FILE_NAME_BYTES];
     si1			mef3_session_path[MEF_FULL_FILE_NAME_BYTES], mef3_session_name[MEF_BASE_FILE_NAME_BYTES];
@@ -337,14 +1536,13 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
     
     //fprintf(stderr, "in initialize_mef_channel_data()\n");
     
-    // add 10% to buffer size to account for possible sample frequency drift
+    // the buffer has room for sample frequency drift
     //fprintf(stderr,"%f, %f\n", secs_per_block, sampling_frequency);
-    channel_state->raw_data_ptr_start = (si4 *) calloc((size_t) (secs_per_block * sampling_frequency * 2), sizeof(si4));
-    if (channel_state->raw_data_ptr_start == NULL)
-    {
-        fprintf(stderr, "Insufficient memory to allocate temporary channel buffer\n");
-        exit(1);
-    }
+    channel_state->raw_data_buffer_samples = block_buffer_samples(block_interval, secs_per_block, sampling_frequency);
+    // raw buffer, index batch (see write_index_batch()) and data staging buffer (see write_data_batch())
+    init_channel_defaults(channel_state);
+    claim_retained_buffers(channel_state);
+    allocate_channel_arena(channel_state);
     channel_state->raw_data_ptr_current        = channel_state->raw_data_ptr_start;
     channel_state->block_hdr_time              = 0;
     channel_state->block_boundary              = 0;
@@ -390,12 +1588,7 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
     
     //fprintf(stdout, "path: %s\n", mef3_session_path);
     // make mef3 session directory
-#ifndef _WIN32
-    sprintf(command, "mkdir \"%s\" 2> /dev/null", mef3_session_path);
-#else
-    sprintf(command, "mkdir \"%s\" > nul 2> nul", mef3_session_path);
-#endif
-    system(command);
+    make_directory(mef3_session_path);
     
     // set up a generic fps for universal header and password data
     channel_state->gen_fps = allocate_file_processing_struct(UNIVERSAL_HEADER_BYTES, NO_FILE_TYPE_CODE, NULL, NULL, 0);
@@ -413,19 +1606,14 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
             fprintf(stderr, "If a level 2 password is specified, then a level 1 password must be specified also.  Exiting...\n");
             exit(0);
         }
-        channel_state->pwd = channel_state->gen_fps->password_data = process_password_data(NULL, mef_3_level_1_password, mef_3_level_2_password, uh);
+        channel_state->pwd = channel_state->gen_fps->password_data = cached_password_data(mef_3_level_1_password, mef_3_level_2_password, uh);
     }
     else
         channel_state->pwd = channel_state->gen_fps->password_data = NULL;
     
     // make mef3 channel directory
     sprintf(channel_path, "%s/%s.%s", mef3_session_path, chan_map_name, TIME_SERIES_CHANNEL_DIRECTORY_TYPE_STRING);
-#ifndef _WIN32
-    sprintf(command, "mkdir %s", channel_path);
-#else
-    sprintf(command, "mkdir \"%s\" > nul 2> nul", channel_path);
-#endif
-    system(command);
+    make_directory(channel_path);
     
     // copy channel name into generic universal header
     MEF_strncpy(channel_state->gen_fps->universal_header->channel_name, chan_map_name, MEF_BASE_FILE_NAME_BYTES);
@@ -439,21 +1627,16 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
     //fprintf(stdout, "segment path: %s\n", segment_path);
     // make mef3 segment directory
     sprintf(segment_path, "%s/%s.%s", channel_path, segment_name, SEGMENT_DIRECTORY_TYPE_STRING);
-#ifndef _WIN32
-    sprintf(command, "mkdir %s", segment_path);
-#else
-    sprintf(command, "mkdir \"%s\" > nul 2> nul", segment_path);
-#endif
-    system(command);
+    make_directory(segment_path);
     
     // generate level UUID into generic universal_header
-    generate_UUID(channel_state->gen_fps->universal_header->level_UUID);
+    generate_UUID_thread_safe(channel_state->gen_fps->universal_header->level_UUID);
     
     // set up mef3 time series metadata file
     channel_state->metadata_fps = allocate_file_processing_struct(METADATA_FILE_BYTES, TIME_SERIES_METADATA_FILE_TYPE_CODE, NULL, channel_state->gen_fps, UNIVERSAL_HEADER_BYTES);
     MEF_snprintf(channel_state->metadata_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_METADATA_FILE_TYPE_STRING);
     uh = channel_state->metadata_fps->universal_header;
-    generate_UUID(uh->file_UUID);
+    generate_UUID_thread_safe(uh->file_UUID);
     uh->number_of_entries = 1;
     uh->maximum_entry_size = METADATA_FILE_BYTES;
     initialize_metadata(channel_state->metadata_fps);
@@ -523,7 +1706,7 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
     channel_state->ts_inds_fps = allocate_file_processing_struct(UNIVERSAL_HEADER_BYTES, TIME_SERIES_INDICES_FILE_TYPE_CODE, NULL, channel_state->metadata_fps, UNIVERSAL_HEADER_BYTES);
     MEF_snprintf(channel_state->ts_inds_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_INDICES_FILE_TYPE_STRING);
     uh = channel_state->ts_inds_fps->universal_header;
-    generate_UUID(uh->file_UUID);
+    generate_UUID_thread_safe(uh->file_UUID);
     uh->number_of_entries = 0;  // fill in when convert RED blocks
     uh->maximum_entry_size = TIME_SERIES_INDEX_BYTES;
     channel_state->ts_inds_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;  // write out the universal header, then the RED blocks piecemeal
@@ -536,7 +1719,7 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
     channel_state->ts_data_fps = allocate_file_processing_struct(UNIVERSAL_HEADER_BYTES, TIME_SERIES_DATA_FILE_TYPE_CODE, NULL, channel_state->metadata_fps, UNIVERSAL_HEADER_BYTES);
     MEF_snprintf(channel_state->ts_data_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_DATA_FILE_TYPE_STRING);
     uh = channel_state->ts_data_fps->universal_header;
-    generate_UUID(uh->file_UUID);
+    generate_UUID_thread_safe(uh->file_UUID);
     uh->number_of_entries = 0;  // fill in when convert RED blocks
     uh->maximum_entry_size = 0;  // fill in when converet RED blocks
     channel_state->ts_data_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;  // write out the universal header, then the RED blocks piecemeal
@@ -545,23 +1728,18 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
     channel_state->data_file_offset = UNIVERSAL_HEADER_BYTES;
     channel_state->ts_data_fps->universal_header->body_CRC = CRC_START_VALUE;
     
+    // a segment was started
+    write_resume_state(channel_state);
+    
     // allocate new memory for new RED blocks
-    max_samps = secs_per_block * sampling_frequency * 2;
-    channel_state->rps = RED_allocate_processing_struct(max_samps, RED_MAX_COMPRESSED_BYTES(max_samps, 1), 0, RED_MAX_DIFFERENCE_BYTES(max_samps), 0, 0, channel_state->pwd);
+    allocate_channel_rps(channel_state);
     //channel_state->rps->directives.return_block_extrema = MEF_TRUE;
-    // free original_data of rps, since we'll never use it anyway, and that pointer will be re-assigned before each RED compression
-    // TBD modify it so original_data is not allocated in the first place?
-    free(channel_state->rps->original_data);
     
     // set up discontinuity state information
     channel_state->discont_contiguous_blocks = 0;
     channel_state->discont_contiguous_samples = 0;
     channel_state->discont_contiguous_bytes = 0;
     
-    // make these part of the channel state to keep everything thread-safe
-    channel_state->out_data = (ui1 *) malloc(32000 * 8);  // This assumes 1 second blocks, sampled at 32000 Hz
-    channel_state->temp_time_series_index = (ui1*) calloc(sizeof(ui1), 8+8+8+4+4+4+4+4+1+RED_BLOCK_PROTECTED_REGION_BYTES+RED_BLOCK_DISCRETIONARY_REGION_BYTES);
-    
     channel_state->num_secs_per_segment = num_secs_per_segment;
     channel_state->next_segment_start_time = 0;
     channel_state->start_sample = 0;
@@ -570,645 +1748,2245 @@ si4 initialize_mef_channel_data ( CHANNEL_STATE *channel_state,
     if (mef_3_level_1_password != NULL || mef_3_level_2_password != NULL)
         return (0);
 
-    // TBD: a mutex should be used around this function call (or within it) if channel creation is done in a threaded way.
-    update_mefd_file(mef3_session_path, mef3_session_name, chan_map_name, anonymized_subject_name);
+    register_mefd_channel(channel_state, mef3_session_path, mef3_session_name, chan_map_name, anonymized_subject_name);
     
     return(0);
 }
 
-void update_mefd_file(si1 *mef3_session_path, si1 *mef3_session_name, si1* chan_name, si1* anonymized_subject_name)
+// Memory mapped segment files (see set_mef_channel_mapped_io()).  The stream is left alone while a file is mapped,
+// and put back at the end of the written bytes when it is unmapped, so stdio writes can carry on from there.
+static void release_mapped_file(CHANNEL_STATE *channel_state, FILE_PROCESSING_STRUCT *fps, MEF_MAPPED_FILE *map)
 {
-    FILE* mefd_fp;
-    si1 mefd_file_name[MEF_FULL_FILE_NAME_BYTES];
-    UNIVERSAL_HEADER mefd_uh;
-    si1 file_name_output[1024];   // TODO: Make this "1024" a constant in the .h file
-    si1 file_name_input[1024];
-    si4 i;
-
-    // TBD: this function might need to be protected by a mutex if channel creation is done in a threaded way.
-
-    // update MEFD file (used by Persyst)
-    sprintf(mefd_file_name, "%s/%s.mefd", mef3_session_path, mef3_session_name);
-    memset(file_name_output, 0, 1024);
-
-    // check for case where .mefd file doesn't exist yet, in which case we create
-    // it and add the currect channel as the first entry.
-    if (access(mefd_file_name, 0) == -1)
-    {
-        // write default universal header
-        memset(&mefd_uh, 0, UNIVERSAL_HEADER_BYTES);
-        mefd_fp = fopen(mefd_file_name, "wb");
-        fwrite(&mefd_uh, sizeof(UNIVERSAL_HEADER), (size_t)1, mefd_fp);
-        mefd_uh.body_CRC = CRC_START_VALUE;
-
-        // write channel name
-        memset(file_name_output, 0, 1024);
-        sprintf(file_name_output, "%s.%s", chan_name, TIME_SERIES_CHANNEL_DIRECTORY_TYPE_STRING);
-        fwrite(file_name_output, 1024, 1, mefd_fp);
-        mefd_uh.body_CRC = CRC_update((ui1*)file_name_output, 1024, mefd_uh.body_CRC);
-
-        // rewrite universal header of mefd file, this time with correct info
-        fseek(mefd_fp, 0, SEEK_SET);
-        memset(mefd_uh.channel_name, 0, MEF_BASE_FILE_NAME_BYTES);
-        sprintf(mefd_uh.file_type_string, "%s", "mefd");
-        mefd_uh.mef_version_major = MEF_VERSION_MAJOR;
-        mefd_uh.mef_version_minor = MEF_VERSION_MINOR;
-        mefd_uh.byte_order_code = MEF_LITTLE_ENDIAN;
-        mefd_uh.start_time = UUTC_NO_ENTRY;
-        mefd_uh.end_time = UUTC_NO_ENTRY;
-        if (anonymized_subject_name != NULL)
-            MEF_strncpy(mefd_uh.anonymized_name, anonymized_subject_name, UNIVERSAL_HEADER_ANONYMIZED_NAME_BYTES);
-        else
-            MEF_strncpy(mefd_uh.anonymized_name, "not_entered", UNIVERSAL_HEADER_ANONYMIZED_NAME_BYTES);
-        if (mef3_session_name != NULL)
-            MEF_strncpy(mefd_uh.session_name, mef3_session_name, MEF_BASE_FILE_NAME_BYTES);
-        else
-            MEF_strncpy(mefd_uh.session_name, "not_entered", MEF_BASE_FILE_NAME_BYTES);
-        // Set level UUIDs to zero - this should be coordinated with records files at this level, in order for a UUID here to really be valid
-        //generate_UUID(mefd_uh.level_UUID);  // already zero'd out
-        generate_UUID(mefd_uh.file_UUID);
-        mefd_uh.maximum_entry_size = 1024;
-        mefd_uh.number_of_entries = 1;
-        mefd_uh.segment_number = -3; // session level
-        memset(mefd_uh.level_1_password_validation_field, 0, PASSWORD_VALIDATION_FIELD_BYTES);
-        memset(mefd_uh.level_2_password_validation_field, 0, PASSWORD_VALIDATION_FIELD_BYTES);
-        mefd_uh.header_CRC = CRC_calculate(&mefd_uh + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
-        fwrite(&mefd_uh, sizeof(UNIVERSAL_HEADER), (size_t)1, mefd_fp);
-
-        // close .mefd file
-        fclose(mefd_fp);
+#ifndef _WIN32
+    if (map->base == NULL)
         return;
-    }
+    
+    if (channel_state->mapped_sync_mode == MAPPED_SYNC_WAIT)
+        msync(map->base, (size_t) map->length, MS_SYNC);
+    munmap(map->base, (size_t) map->mapped_bytes);
+    map->base = NULL;
+    map->mapped_bytes = 0;
+    
+    // drop the unused part of the last extent
+    if (ftruncate(fileno(fps->fp), (off_t) map->length) != 0)
+        fprintf(stderr, "Error truncating %s\n", fps->full_file_name);
+    e_fseek(fps->fp, (size_t) map->length, SEEK_SET, fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+#endif
+}
 
-    // file exists, so read it and see what's in it
-    mefd_fp = fopen(mefd_file_name, "rb+");
-    fread(&mefd_uh, UNIVERSAL_HEADER_BYTES, 1, mefd_fp);
-    sprintf(file_name_output, "%s.%s", chan_name, TIME_SERIES_CHANNEL_DIRECTORY_TYPE_STRING);
-    for (i = 0; i < mefd_uh.number_of_entries; i++)
+// Appends bytes to a mapped file, mapping it (or growing it by whole extents) first if necessary.  Returns -1 if the
+// channel doesn't use mapped files, or the mapping failed, in which case the caller writes to the stream instead.
+static si4 mapped_file_append(CHANNEL_STATE *channel_state, FILE_PROCESSING_STRUCT *fps, MEF_MAPPED_FILE *map, void *bytes, size_t num_bytes)
+{
+#ifndef _WIN32
+    ui8 new_size;
+    si4 fd;
+    void *base;
+    
+    if (!channel_state->mapped_io_enabled)
+        return -1;
+    
+    fd = fileno(fps->fp);
+    if (map->base == NULL)
+    {
+        // start where the stream left off, normally right after the universal header
+        fflush(fps->fp);
+        map->length = (ui8) ftell(fps->fp);
+    }
+    
+    if (map->base == NULL || map->length + num_bytes > map->mapped_bytes)
     {
-        fread(&file_name_input, 1024, 1, mefd_fp);
-        if (!strncmp(file_name_input, file_name_output, 1024))
+        new_size = ((map->length + num_bytes + channel_state->mapped_extent_bytes - 1) / channel_state->mapped_extent_bytes) * channel_state->mapped_extent_bytes;
+        if (map->base != NULL)
+            munmap(map->base, (size_t) map->mapped_bytes);
+        map->base = NULL;
+        base = MAP_FAILED;
+        if (ftruncate(fd, (off_t) new_size) == 0)
+            base = mmap(NULL, (size_t) new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
         {
-            // this channel is already listed in the .mefd file, so no need to continue
-            fclose(mefd_fp);
-            return;
+            fprintf(stderr, "Could not map %s, using regular writes\n", fps->full_file_name);
+            channel_state->mapped_io_enabled = 0;
+            if (ftruncate(fd, (off_t) map->length) != 0)
+                fprintf(stderr, "Error truncating %s\n", fps->full_file_name);
+            e_fseek(fps->fp, (size_t) map->length, SEEK_SET, fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+            return -1;
         }
+        map->base = (ui1 *) base;
+        map->mapped_bytes = new_size;
     }
+    
+    memcpy(map->base + map->length, bytes, num_bytes);
+    map->length += num_bytes;
+    
+    return 0;
+#else
+    return -1;
+#endif
+}
 
-    // at this point, we know we need to add the current channel to the .mefd file
-    // rewrite universal header
-    mefd_uh.number_of_entries++;
-    mefd_uh.body_CRC = CRC_update((ui1*)file_name_output, 1024, mefd_uh.body_CRC);
-    mefd_uh.header_CRC = CRC_calculate(&mefd_uh + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
-    e_fseek(mefd_fp, 0, SEEK_SET, mefd_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    (void)e_fwrite(&mefd_uh, sizeof(UNIVERSAL_HEADER), (size_t)1, mefd_fp, mefd_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    fclose(mefd_fp);
-    // reopen in append mode so we can append new file name
-    mefd_fp = fopen(mefd_file_name, "ab+");
-    (void)e_fwrite(&file_name_output, 1024, (size_t)1, mefd_fp, mefd_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    fclose(mefd_fp);
+// Starts (or waits for) write-back of the mapped files at a checkpoint, according to the channel's sync mode
+static void sync_mapped_file(CHANNEL_STATE *channel_state, MEF_MAPPED_FILE *map)
+{
+#ifndef _WIN32
+    if (map->base == NULL || channel_state->mapped_sync_mode == MAPPED_SYNC_NONE)
+        return;
+    
+    msync(map->base, (size_t) map->length, (channel_state->mapped_sync_mode == MAPPED_SYNC_WAIT) ? MS_SYNC : MS_ASYNC);
+#endif
 }
 
-si4 process_filled_block( CHANNEL_STATE *channel_state, si4* raw_data_ptr_start, ui4 num_entries,
-                         ui8 block_len, si4 discontinuity_flag, ui8 block_hdr_time)
+// Write the index entries collected since the last call to the .tidx file, in one write, and fold them into
+// the index file's body CRC.  Called from update_metadata(), so the index file is complete at every checkpoint,
+// segment roll and close, and from process_filled_block() when the batch is full.
+static void write_index_batch(CHANNEL_STATE *channel_state)
 {
-    ui1 *out_data;
-    si4 *ddp, bit_shift_flag;
-    ui8 i;
-    extern MEF_GLOBALS	*MEF_globals;
-    ui1 data_key[240];
-    FILE *ofp;
-    sf8 sampling_frequency;
-    int chan_num;
-    //static ui1 generated_offset = 0;
-    //TIME_SERIES_INDEX time_series_index;
-    ui1 *temp_time_series_index;
-    sf8			temp_sf8;
-    RED_PROCESSING_STRUCT	*rps;
     FILE_PROCESSING_STRUCT  *ts_inds_fps;
-    FILE_PROCESSING_STRUCT  *ts_data_fps;
-    FILE_PROCESSING_STRUCT  *metadata_fps;
-    TIME_SERIES_METADATA_SECTION_2	*md2;
-    UNIVERSAL_HEADER *uh_meta;
-    UNIVERSAL_HEADER *uh_data;
-    UNIVERSAL_HEADER *uh_inds;
-    TIME_SERIES_INDEX temp_struct;
+    size_t batch_bytes;
     
+    if (channel_state->index_batch_entries == 0)
+        return;
     
-    // fprintf(stderr, "in process_filled_block\n");
+    ts_inds_fps = channel_state->ts_inds_fps;
+    batch_bytes = (size_t) channel_state->index_batch_entries * TIME_SERIES_INDEX_BYTES;
     
-    chan_num     = channel_state->chan_num;
+    WRITER_STATS_TIME(channel_state, write_nsecs,
+        if (mapped_file_append(channel_state, ts_inds_fps, &channel_state->inds_map, channel_state->temp_time_series_index, batch_bytes))
+            (void) e_fwrite(channel_state->temp_time_series_index, sizeof(ui1), batch_bytes, ts_inds_fps->fp, ts_inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR));
+    WRITER_STATS_ADD(channel_state, writes, 1);
+    WRITER_STATS_ADD(channel_state, bytes_written, batch_bytes);
     
-    // bring in data from channel_state struct
-    ofp                             = channel_state->out_file;
-    bit_shift_flag                  = channel_state->bit_shift_flag;
-    ts_data_fps                     = channel_state->ts_data_fps;
-    ts_inds_fps                     = channel_state->ts_inds_fps;
-    metadata_fps                    = channel_state->metadata_fps;
-    temp_time_series_index          = channel_state->temp_time_series_index;
-    rps                             = channel_state->rps;
-    sampling_frequency              = channel_state->metadata_fps->metadata.time_series_section_2->sampling_frequency;
+    // update CRC
+    WRITER_STATS_TIME(channel_state, crc_nsecs,
+        ts_inds_fps->universal_header->body_CRC = mef_crc_update(channel_state->temp_time_series_index, (si8) batch_bytes, ts_inds_fps->universal_header->body_CRC));
     
-    // do nothing if there is nothing to be done
-    if (num_entries == 0)
-        return (0);
-    if (block_len == 0)
-        return (0);  // this should never happen, but check for it anyway
+    // update index file offset
+    channel_state->inds_file_offset += batch_bytes;
+    channel_state->index_batch_entries = 0;
+    channel_state->journal_pending = 1;
+}
+
+// Write the compressed blocks staged since the last call to the .tdat file, in one write, and fold them into
+// the data file's body CRC.  Called from update_metadata() and from process_filled_block() when the next
+// block doesn't fit.
+static void write_data_batch(CHANNEL_STATE *channel_state)
+{
+    FILE_PROCESSING_STRUCT  *ts_data_fps;
     
-    //pthread_mutex_lock(&lock1);
+    if (channel_state->data_batch_bytes == 0)
+        return;
     
-    // only care about generating offset times if this is a brand-new session.
-    // if we are appending to existing session, we alrady have offset times
-    if ((channel_state->if_appending == 0) && (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT)))
-    {
-        // this only be done for one channel, assumes all channels have same offset
-        if (MEF_globals->recording_time_offset == MEF_GLOBALS_RECORDING_TIME_OFFSET_DEFAULT) {
-            // generate recording time offset & GMT offset
-            //TBD bring in GMT offset
-            generate_recording_time_offset(block_hdr_time, (si4) (channel_state->gmt_offset_in_hours * 3600.0));
-            //generated_offset = 1;
-        }
-    }
-    
-    //pthread_mutex_unlock(&lock1);
+    ts_data_fps = channel_state->ts_data_fps;
     
-    memset(data_key, 0, 240);  // for now, assume no data encryption
+    WRITER_STATS_TIME(channel_state, write_nsecs,
+        if (mapped_file_append(channel_state, ts_data_fps, &channel_state->data_map, channel_state->data_batch, (size_t) channel_state->data_batch_bytes))
+            (void) e_fwrite(channel_state->data_batch, sizeof(ui1), (size_t) channel_state->data_batch_bytes, ts_data_fps->fp, ts_data_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR));
+    WRITER_STATS_ADD(channel_state, writes, 1);
+    WRITER_STATS_ADD(channel_state, bytes_written, channel_state->data_batch_bytes);
     
-    // use a static out_data buffer, this buffer is shared across channels, so this will only
-    // work if the block_len of all channels is the same.  If different channels need different
-    // block_lens (ie, different sampling rates), then this block buffer will need to be part
-    // of the channel struct.
-    //out_data = GetDataBlockBuffer(block_len);
+    // update data body CRC
+    WRITER_STATS_TIME(channel_state, crc_nsecs,
+        ts_data_fps->universal_header->body_CRC = mef_crc_update(channel_state->data_batch, (si8) channel_state->data_batch_bytes, ts_data_fps->universal_header->body_CRC));
     
-    // previous method (GetDataBlockBuffer) is not thread-safe, so use this method.
-    // TBD clean this up, so it will works with any block_len, rather than hard-coding
-    // 1 second blocks.
-    out_data = channel_state->out_data;
+    channel_state->data_batch_bytes = 0;
+    channel_state->journal_pending = 1;
+}
+
+// Rewrite the universal header at the start of a file that is open for writing at file_offset.
+// On POSIX systems this is a pwrite(), so the stream position isn't moved; the stream is flushed first
+// so buffered bytes can't land on top of the header later.
+static void rewrite_universal_header(FILE_PROCESSING_STRUCT *fps, si8 file_offset)
+{
+#ifndef _WIN32
+    fflush(fps->fp);
+    if (pwrite(fileno(fps->fp), fps->universal_header, (size_t) UNIVERSAL_HEADER_BYTES, 0) == (ssize_t) UNIVERSAL_HEADER_BYTES)
+        return;
+    // fall through and do it the old way, which also reports the error
+#endif
+    e_fseek(fps->fp, 0, SEEK_SET, fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    (void)e_fwrite(fps->universal_header, sizeof(UNIVERSAL_HEADER), (size_t)1, fps->fp, fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    e_fseek(fps->fp, file_offset, SEEK_SET, fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+}
+
+// Checkpoint journal, see set_mef_channel_journal().  The journal sits next to the data file, as <segment>.wjnl.
+static void journal_file_name(si1 *file_name, si1 *data_file_name)
+{
+    si1 *extension;
     
+    MEF_strncpy(file_name, data_file_name, MEF_FULL_FILE_NAME_BYTES);
+    extension = strrchr(file_name, '.');
+    if (extension != NULL && strlen(extension + 1) == strlen(JOURNAL_FILE_TYPE_STRING))
+        strcpy(extension + 1, JOURNAL_FILE_TYPE_STRING);
+}
+
+static void open_journal(CHANNEL_STATE *channel_state)
+{
+    si1 file_name[MEF_FULL_FILE_NAME_BYTES];
     
-    if (bit_shift_flag)
-    {
-        //shift 2 bits to 18 bit resolution
-        ddp = raw_data_ptr_start;
-        for(i = num_entries; i--;)
-        {
-            if (*ddp >= 0)
-                *ddp++ = (si4) (((sf8) *ddp / (sf8) 4.0) + 0.5);
-            else
-                *ddp++ = (si4) (((sf8) *ddp / (sf8) 4.0) - 0.5);
-        }
-    }
+    if (!channel_state->journal_enabled || channel_state->journal_fp != NULL)
+        return;
     
-    // set up RED compression
-    rps->original_data = rps->original_ptr = raw_data_ptr_start;
-    rps->directives.discontinuity = (discontinuity_flag== 1) ? MEF_TRUE : MEF_FALSE;
-    rps->block_header->number_of_samples = num_entries;
-    rps->block_header->start_time = block_hdr_time;
+    journal_file_name(file_name, channel_state->ts_data_fps->full_file_name);
+    channel_state->journal_fp = fopen(file_name, "wb");
+    if (channel_state->journal_fp == NULL)
+        fprintf(stderr, "Could not create journal %s\n", file_name);
+    channel_state->journal_pending = 0;
+}
+
+// Called once the segment's headers and metadata are complete, so the journal isn't needed any more
+static void remove_journal(CHANNEL_STATE *channel_state)
+{
+    si1 file_name[MEF_FULL_FILE_NAME_BYTES];
     
-    // RED compress data block
-    (void) RED_encode(rps);
+    if (channel_state->journal_fp == NULL)
+        return;
     
-    if (channel_state->num_secs_per_segment > 0 )
-        check_for_new_segment(channel_state, rps->block_header->start_time);
+    fclose(channel_state->journal_fp);
+    channel_state->journal_fp = NULL;
+    channel_state->journal_pending = 0;
+    journal_file_name(file_name, channel_state->ts_data_fps->full_file_name);
+    remove(file_name);
+}
+
+// Puts all blocks so far in the data and index files, and then appends a journal entry describing them
+static void commit_journal(CHANNEL_STATE *channel_state)
+{
+    MEF_JOURNAL_ENTRY entry;
+    TIME_SERIES_METADATA_SECTION_2 *md2;
+    UNIVERSAL_HEADER *uh_data;
+    ui1 *key;
+    si4 i;
     
-    // write block to output file
-    //fwrite(out_data, sizeof(si1), RED_block_size, ofp);
-    (void) e_fwrite(rps->compressed_data, sizeof(ui1), (size_t) channel_state->rps->block_header->block_bytes, ts_data_fps->fp, ts_data_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    if (channel_state->journal_fp == NULL)
+        return;
     
-    // update data body CRC
-    ts_data_fps->universal_header->body_CRC = CRC_update(rps->compressed_data, rps->block_header->block_bytes, ts_data_fps->universal_header->body_CRC);
+    write_data_batch(channel_state);
+    write_index_batch(channel_state);
+    // the blocks have to reach the operating system before the entry that covers them (mapped files already have)
+    fflush(channel_state->ts_data_fps->fp);
+    fflush(channel_state->ts_inds_fps->fp);
     
-    // set recording_start_time on first pass
-    uh_meta = channel_state->metadata_fps->universal_header;
     uh_data = channel_state->ts_data_fps->universal_header;
-    uh_inds = channel_state->ts_inds_fps->universal_header;
-    if (uh_meta->start_time == UNIVERSAL_HEADER_START_TIME_NO_ENTRY)
+    md2 = channel_state->metadata_fps->metadata.time_series_section_2;
+    memset(&entry, 0, sizeof(MEF_JOURNAL_ENTRY));
+    entry.data_file_bytes = (si8) channel_state->data_file_offset;
+    entry.index_file_bytes = (si8) channel_state->inds_file_offset;
+    entry.data_body_CRC = uh_data->body_CRC;
+    entry.index_body_CRC = channel_state->ts_inds_fps->universal_header->body_CRC;
+    entry.number_of_entries = uh_data->number_of_entries;
+    entry.maximum_entry_size = uh_data->maximum_entry_size;
+    entry.start_time = uh_data->start_time;
+    entry.end_time = uh_data->end_time;
+    entry.metadata.recording_duration = md2->recording_duration;
+    entry.metadata.number_of_samples = md2->number_of_samples;
+    entry.metadata.number_of_blocks = md2->number_of_blocks;
+    entry.metadata.maximum_block_bytes = md2->maximum_block_bytes;
+    entry.metadata.number_of_discontinuities = md2->number_of_discontinuities;
+    entry.metadata.maximum_contiguous_blocks = md2->maximum_contiguous_blocks;
+    entry.metadata.maximum_contiguous_block_bytes = md2->maximum_contiguous_block_bytes;
+    entry.metadata.maximum_contiguous_samples = md2->maximum_contiguous_samples;
+    entry.metadata.maximum_native_sample_value = md2->maximum_native_sample_value;
+    entry.metadata.minimum_native_sample_value = md2->minimum_native_sample_value;
+    entry.metadata.maximum_block_samples = md2->maximum_block_samples;
+    entry.metadata.maximum_difference_bytes = md2->maximum_difference_bytes;
+    
+    // the metadata part is section 2 data, so it gets section 2's encryption
+    entry.encryption = abs(channel_state->metadata_fps->metadata.section_1->section_2_encryption);
+    if (entry.encryption != NO_ENCRYPTION && channel_state->pwd != NULL)
     {
-        // needs to be offset, since universal header will always be written unencrypted
-        // these timestamps are already offset, because the offsetting occurs in the RED compression routine
-        uh_meta->start_time = rps->block_header->start_time;
-        uh_data->start_time = rps->block_header->start_time;
-        uh_inds->start_time = rps->block_header->start_time;
-        
-        // set start time for next segment
-        if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
-            channel_state->next_segment_start_time = rps->block_header->start_time - (channel_state->num_secs_per_segment * 1e6);  // subtract, since times are offset
-        else
-            channel_state->next_segment_start_time = rps->block_header->start_time + (channel_state->num_secs_per_segment * 1e6);
+        key = (entry.encryption == LEVEL_1_ENCRYPTION) ? channel_state->pwd->level_1_encryption_key : channel_state->pwd->level_2_encryption_key;
+        for (i = 0; i < (si4) sizeof(MEF_JOURNAL_METADATA); i += 16)
+            AES_encrypt((ui1 *) &entry.metadata + i, (ui1 *) &entry.metadata + i, NULL, key);
     }
-    
-    md2 = metadata_fps->metadata.time_series_section_2;
-    
-    RED_find_extrema(rps->original_data, rps->block_header->number_of_samples, &temp_struct);
-    
-    // update segment  metadata files
-    // maximum_native_sample_value
-    if (md2->units_conversion_factor >= 0)
-        temp_sf8 = (sf8) temp_struct.maximum_sample_value * md2->units_conversion_factor;
-    else
-        temp_sf8 = (sf8) temp_struct.minimum_sample_value * md2->units_conversion_factor;  // units_conversion_factor is negative, so use min value instead
-    if (isnan(md2->maximum_native_sample_value))
-        md2->maximum_native_sample_value = temp_sf8;
-    if (temp_sf8 > md2->maximum_native_sample_value)
-        md2->maximum_native_sample_value = temp_sf8;
-    // minimum_native_sample_value
-    if (md2->units_conversion_factor >= 0)
-        temp_sf8 = (sf8) temp_struct.minimum_sample_value * md2->units_conversion_factor;
     else
-        temp_sf8 = (sf8) temp_struct.maximum_sample_value * md2->units_conversion_factor;  // units_conversion_factor is negative, so use max value instead
-    if (isnan(md2->minimum_native_sample_value))
-        md2->minimum_native_sample_value = temp_sf8;
-    if (temp_sf8 < md2->minimum_native_sample_value)
-        md2->minimum_native_sample_value = temp_sf8;
-    // maximum_block_bytes
-    if (rps->block_header->block_bytes > md2->maximum_block_bytes)
-        md2->maximum_block_bytes = rps->block_header->block_bytes;
-    // maximum_difference_bytes
-    if (rps->block_header->difference_bytes > md2->maximum_difference_bytes)
-        md2->maximum_difference_bytes = rps->block_header->difference_bytes;
-    // maximum_block_samples
-    if (rps->block_header->number_of_samples > md2->maximum_block_samples)
-        md2->maximum_block_samples = rps->block_header->number_of_samples;
-    // number_of_samples
-    md2->number_of_samples = md2->number_of_samples + num_entries;
-    // number_of_blocks
-    md2->number_of_blocks = md2->number_of_blocks + 1;
-    // number_of_discontinuities
-    if (discontinuity_flag == 1)
-        md2->number_of_discontinuities = md2->number_of_discontinuities + 1;
-    // in theory the next two only need to be set once, but we need to wait until this function, when we have real data,
-    // in order to know what the offset and GMT times are.
-    // recording_time_offset
-    metadata_fps->metadata.section_3->recording_time_offset = MEF_globals->recording_time_offset;
-    // GMT offset
-    metadata_fps->metadata.section_3->GMT_offset = MEF_globals->GMT_offset;
-    
-    // update metadata recording_duration and end_time for all files
-    uh_meta->end_time = block_hdr_time + (si8) (((((sf8) channel_state->rps->block_header->number_of_samples) / md2->sampling_frequency) * (sf8) 1e6) + (sf8) 0.5);
-    // needs to be offset, since universal header will always be written unencrypted
-    if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
-        apply_recording_time_offset(&uh_meta->end_time);
-    uh_data->end_time = uh_meta->end_time;
-    uh_inds->end_time = uh_meta->end_time;
-    
-    md2->recording_duration = uh_meta->end_time - uh_meta->start_time;
-	// offset time values could be negative, so reverse sign if negative
-	if (md2->recording_duration < 0)
-		md2->recording_duration = 0 - md2->recording_duration;
-    
-    // update number_of_entries
-    uh_data->number_of_entries = uh_data->number_of_entries + 1;
-    uh_inds->number_of_entries = uh_inds->number_of_entries + 1;
+        entry.encryption = NO_ENCRYPTION;
+    entry.CRC = mef_crc_calculate((ui1 *) &entry + CRC_BYTES, (si8) sizeof(MEF_JOURNAL_ENTRY) - CRC_BYTES);
     
-    // update maximum_entry_size, this only applies to data, which is the largest number of samples in a RED block
-    if (num_entries > uh_data->maximum_entry_size)
-        uh_data->maximum_entry_size = num_entries;
+    fwrite(&entry, sizeof(MEF_JOURNAL_ENTRY), (size_t) 1, channel_state->journal_fp);
+    fflush(channel_state->journal_fp);
+    channel_state->journal_pending = 0;
+}
+
+// Bit shift kernels: divide samples by 4 in place, rounding half away from zero, which is what
+// (si4) ((sf8) x / 4.0 +/- 0.5) does.  In integers that is |x| / 4, plus one if the remainder is 2 or 3, with the
+// sign put back.  |x| is taken as unsigned so -2^31 works too.
+static void bit_shift_samples_scalar(si4 *samples, ui4 num_samples)
+{
+    ui4 i, sign, mag;
     
-    // set up block entry, TBD test to see if this works
-    //time_series_index.file_offset = channel_state->data_file_offset;
-    //time_series_index.start_time = channel_state->rps->block_header->start_time;
-    //time_series_index.start_sample = start_sample;
-    //time_series_index.number_of_samples = channel_state->rps->block_header->number_of_samples;
-    //time_series_index.block_bytes = channel_state->rps->block_header->block_bytes;
-    //time_series_index.maximum_sample_value = channel_state->rps->compression.maximum_sample_value;
-    //time_series_index.minimum_sample_value = channel_state->rps->compression.minimum_sample_value;
-    //time_series_index.flags =channel_state->rps->block_header->flags
+    for (i = 0; i < num_samples; i++)
+    {
+        sign = (ui4) -(samples[i] < 0);
+        mag = ((ui4) samples[i] ^ sign) - sign;
+        mag = (mag >> 2) + ((mag >> 1) & 1);
+        samples[i] = (si4) ((mag ^ sign) - sign);
+    }
+}
+
+#ifdef MEF_HAVE_SSE2
+static void bit_shift_samples_sse2(si4 *samples, ui4 num_samples)
+{
+    __m128i x, sign, mag, one;
+    ui4 i;
     
-    // write index entry to output mtf file, TBD, this might not be necessary
-    memcpy(temp_time_series_index,    &(channel_state->data_file_offset),                          sizeof(ui8));
-    memcpy(temp_time_series_index+8,  &(channel_state->rps->block_header->start_time),             sizeof(ui8));
-    memcpy(temp_time_series_index+16, &(channel_state->start_sample),                                             sizeof(ui8));
-    memcpy(temp_time_series_index+24, &(channel_state->rps->block_header->number_of_samples),      sizeof(ui4));
-    memcpy(temp_time_series_index+28, &(channel_state->rps->block_header->block_bytes),            sizeof(ui4));
-    memcpy(temp_time_series_index+32, &(temp_struct.maximum_sample_value),     sizeof(si4));
-    memcpy(temp_time_series_index+36, &(temp_struct.minimum_sample_value),     sizeof(si4));
-    memset(temp_time_series_index+40, 0, 4);
-    memcpy(temp_time_series_index+44, &(channel_state->rps->block_header->flags),                  sizeof(ui1));
+    one = _mm_set1_epi32(1);
+    for (i = 0; i + 4 <= num_samples; i += 4)
+    {
+        x = _mm_loadu_si128((__m128i *) (samples + i));
+        sign = _mm_srai_epi32(x, 31);
+        mag = _mm_sub_epi32(_mm_xor_si128(x, sign), sign);
+        mag = _mm_add_epi32(_mm_srli_epi32(mag, 2), _mm_and_si128(_mm_srli_epi32(mag, 1), one));
+        _mm_storeu_si128((__m128i *) (samples + i), _mm_sub_epi32(_mm_xor_si128(mag, sign), sign));
+    }
+    bit_shift_samples_scalar(samples + i, num_samples - i);
+}
+#endif
+
+#ifdef MEF_HAVE_AVX2
+MEF_AVX2_FUNCTION static void bit_shift_samples_avx2(si4 *samples, ui4 num_samples)
+{
+    __m256i x, sign, mag, one;
+    ui4 i;
     
-    // write block index entry
-    //(void) e_fwrite(&block_index, sizeof(BLOCK_INDEX), (size_t) 1, block_inds_fps->fp, block_inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    (void) e_fwrite(temp_time_series_index, sizeof(ui1), (size_t) (45+RED_BLOCK_PROTECTED_REGION_BYTES+RED_BLOCK_DISCRETIONARY_REGION_BYTES), ts_inds_fps->fp, ts_inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    one = _mm256_set1_epi32(1);
+    for (i = 0; i + 8 <= num_samples; i += 8)
+    {
+        x = _mm256_loadu_si256((__m256i *) (samples + i));
+        sign = _mm256_srai_epi32(x, 31);
+        mag = _mm256_sub_epi32(_mm256_xor_si256(x, sign), sign);
+        mag = _mm256_add_epi32(_mm256_srli_epi32(mag, 2), _mm256_and_si256(_mm256_srli_epi32(mag, 1), one));
+        _mm256_storeu_si256((__m256i *) (samples + i), _mm256_sub_epi32(_mm256_xor_si256(mag, sign), sign));
+    }
+    bit_shift_samples_scalar(samples + i, num_samples - i);
+}
+
+static si4 cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+    int info[4];
     
-    // update CRC
-    ts_inds_fps->universal_header->body_CRC = CRC_update(temp_time_series_index, 45+RED_BLOCK_PROTECTED_REGION_BYTES+RED_BLOCK_DISCRETIONARY_REGION_BYTES, ts_inds_fps->universal_header->body_CRC);
+    // AVX2 needs the OS to save the ymm registers (OSXSAVE, and XCR0 bits 1 and 2) as well as the CPU flag
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return 0;
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+        return 0;
+    if ((_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return ((info[1] & (1 << 5)) != 0);
+#else
+    return (__builtin_cpu_supports("avx2") != 0);
+#endif
+}
+#endif
+
+#ifdef MEF_HAVE_NEON
+static void bit_shift_samples_neon(si4 *samples, ui4 num_samples)
+{
+    int32x4_t x, sign;
+    uint32x4_t mag, one;
+    ui4 i;
     
-    // update index file offset
-    channel_state->inds_file_offset += (45+RED_BLOCK_PROTECTED_REGION_BYTES+RED_BLOCK_DISCRETIONARY_REGION_BYTES);
+    one = vdupq_n_u32(1);
+    for (i = 0; i + 4 <= num_samples; i += 4)
+    {
+        x = vld1q_s32(samples + i);
+        sign = vshrq_n_s32(x, 31);
+        mag = vreinterpretq_u32_s32(vsubq_s32(veorq_s32(x, sign), sign));
+        mag = vaddq_u32(vshrq_n_u32(mag, 2), vandq_u32(vshrq_n_u32(mag, 1), one));
+        vst1q_s32(samples + i, vsubq_s32(veorq_s32(vreinterpretq_s32_u32(mag), sign), sign));
+    }
+    bit_shift_samples_scalar(samples + i, num_samples - i);
+}
+#endif
+
+// Copy kernels: copy samples into a block buffer, and widen *minimum / *maximum to include them, in the same pass.
+// This gives process_filled_block() the block extrema without reading the block again.
+static void copy_samples_with_extrema_scalar(si4 *dst, si4 *src, ui8 num_samples, si4 *minimum, si4 *maximum)
+{
+    si4 x, lo, hi;
+    ui8 i;
     
-    // update discontinuity index
-    if (discontinuity_flag == 1)
+    lo = *minimum;
+    hi = *maximum;
+    for (i = 0; i < num_samples; i++)
     {
-        //channel_state->discont_block_number = number_of_index_entries;
-        channel_state->discont_contiguous_blocks = 1;
-        channel_state->discont_contiguous_samples = channel_state->rps->block_header->number_of_samples;
-        channel_state->discont_contiguous_bytes = channel_state->rps->block_header->block_bytes;
-        //channel_state->discont_contiguous_duration_start = block_hdr_time;
+        x = src[i];
+        dst[i] = x;
+        lo = (x < lo) ? x : lo;
+        hi = (x > hi) ? x : hi;
     }
-    else
+    *minimum = lo;
+    *maximum = hi;
+}
+
+// Same, from every stride'th sample of src, for interleaved frames (see write_mef_channels_interleaved()).
+static void copy_strided_samples_with_extrema(si4 *dst, si4 *src, si8 stride, ui8 num_samples, si4 *minimum, si4 *maximum)
+{
+    si4 x, lo, hi;
+    ui8 i;
+    
+    lo = *minimum;
+    hi = *maximum;
+    for (i = 0; i < num_samples; i++)
     {
-        //channel_state->discont_block_number = doesn't change
-        channel_state->discont_contiguous_blocks++;
-        channel_state->discont_contiguous_samples += channel_state->rps->block_header->number_of_samples;
-        channel_state->discont_contiguous_bytes += channel_state->rps->block_header->block_bytes;
+        x = *src;
+        src += stride;
+        dst[i] = x;
+        lo = (x < lo) ? x : lo;
+        hi = (x > hi) ? x : hi;
     }
+    *minimum = lo;
+    *maximum = hi;
+}
+
+#ifdef MEF_HAVE_SSE2
+static void copy_samples_with_extrema_sse2(si4 *dst, si4 *src, ui8 num_samples, si4 *minimum, si4 *maximum)
+{
+    __m128i x, lo, hi, mask;
+    si4 lanes[4];
+    ui8 i;
+    si4 j;
     
-    // update metadata file
-    // maximum_contiguous_blocks
-    if (channel_state->discont_contiguous_blocks > md2->maximum_contiguous_blocks)
-        md2->maximum_contiguous_blocks = channel_state->discont_contiguous_blocks;
-    // maximum_contiguous_samples
-    if (channel_state->discont_contiguous_samples > md2->maximum_contiguous_samples)
-        md2->maximum_contiguous_samples = channel_state->discont_contiguous_samples;
-    // maximum_contiguous_block_bytes
-    if (channel_state->discont_contiguous_bytes > md2->maximum_contiguous_block_bytes)
-        md2->maximum_contiguous_block_bytes = channel_state->discont_contiguous_bytes;
+    // SSE2 has no 32 bit min / max, so select with a compare mask
+    lo = _mm_set1_epi32(*minimum);
+    hi = _mm_set1_epi32(*maximum);
+    for (i = 0; i + 4 <= num_samples; i += 4)
+    {
+        x = _mm_loadu_si128((__m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), x);
+        mask = _mm_cmplt_epi32(x, lo);
+        lo = _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, lo));
+        mask = _mm_cmpgt_epi32(x, hi);
+        hi = _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, hi));
+    }
+    _mm_storeu_si128((__m128i *) lanes, lo);
+    for (j = 0; j < 4; j++)
+        *minimum = (lanes[j] < *minimum) ? lanes[j] : *minimum;
+    _mm_storeu_si128((__m128i *) lanes, hi);
+    for (j = 0; j < 4; j++)
+        *maximum = (lanes[j] > *maximum) ? lanes[j] : *maximum;
+    copy_samples_with_extrema_scalar(dst + i, src + i, num_samples - i, minimum, maximum);
+}
+#endif
+
+#ifdef MEF_HAVE_AVX2
+MEF_AVX2_FUNCTION static void copy_samples_with_extrema_avx2(si4 *dst, si4 *src, ui8 num_samples, si4 *minimum, si4 *maximum)
+{
+    __m256i x, lo, hi;
+    si4 lanes[8];
+    ui8 i;
+    si4 j;
     
-    // update fields for next time
-    channel_state->data_file_offset += channel_state->rps->block_header->block_bytes;
-    channel_state->start_sample += channel_state->rps->block_header->number_of_samples;
+    lo = _mm256_set1_epi32(*minimum);
+    hi = _mm256_set1_epi32(*maximum);
+    for (i = 0; i + 8 <= num_samples; i += 8)
+    {
+        x = _mm256_loadu_si256((__m256i *) (src + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), x);
+        lo = _mm256_min_epi32(lo, x);
+        hi = _mm256_max_epi32(hi, x);
+    }
+    _mm256_storeu_si256((__m256i *) lanes, lo);
+    for (j = 0; j < 8; j++)
+        *minimum = (lanes[j] < *minimum) ? lanes[j] : *minimum;
+    _mm256_storeu_si256((__m256i *) lanes, hi);
+    for (j = 0; j < 8; j++)
+        *maximum = (lanes[j] > *maximum) ? lanes[j] : *maximum;
+    copy_samples_with_extrema_scalar(dst + i, src + i, num_samples - i, minimum, maximum);
+}
+#endif
+
+#ifdef MEF_HAVE_NEON
+static void copy_samples_with_extrema_neon(si4 *dst, si4 *src, ui8 num_samples, si4 *minimum, si4 *maximum)
+{
+    int32x4_t x, lo, hi;
+    int32x2_t pair;
+    ui8 i;
     
-    // update mef header fields relating to block index
-    channel_state->number_of_index_entries++;
-    channel_state->number_of_samples += num_entries;
+    lo = vdupq_n_s32(*minimum);
+    hi = vdupq_n_s32(*maximum);
+    for (i = 0; i + 4 <= num_samples; i += 4)
+    {
+        x = vld1q_s32(src + i);
+        vst1q_s32(dst + i, x);
+        lo = vminq_s32(lo, x);
+        hi = vmaxq_s32(hi, x);
+    }
+    pair = vpmin_s32(vget_low_s32(lo), vget_high_s32(lo));
+    *minimum = vget_lane_s32(vpmin_s32(pair, pair), 0);
+    pair = vpmax_s32(vget_low_s32(hi), vget_high_s32(hi));
+    *maximum = vget_lane_s32(vpmax_s32(pair, pair), 0);
+    copy_samples_with_extrema_scalar(dst + i, src + i, num_samples - i, minimum, maximum);
+}
+#endif
+
+// Timestamp scan kernels: return the index of the first packet at or after j that starts a new block, or n_packets
+// if there is none.  A packet starts a new block if it is DISCONTINUITY_TIME_THRESHOLD or more away from the packet
+// before it (in either direction), or if it is block_interval or more past block_boundary; this is the test
+// write_mef_channel_data() makes on every packet.  packet_times[j - 1] must be the last packet already placed.
+// The gap test is done as one unsigned compare: |d| < T exactly when d + (T - 1), as unsigned, is below 2T - 1.
+#define GAP_BIAS        ((ui8) DISCONTINUITY_TIME_THRESHOLD - 1)
+#define GAP_LIMIT       (((ui8) DISCONTINUITY_TIME_THRESHOLD * 2) - 1)
+
+static si4 is_block_break(ui8 *packet_times, si8 j, ui8 block_boundary, si8 block_interval)
+{
+    return ((((ui8) packet_times[j] - packet_times[j - 1]) + GAP_BIAS) >= GAP_LIMIT) |
+           (((si8) (packet_times[j] - block_boundary)) >= block_interval);
+}
+
+static si8 find_block_break_scalar(ui8 *packet_times, si8 j, si8 n_packets, ui8 block_boundary, si8 block_interval)
+{
+    // four at a time, with one branch per four
+    for (; j + 4 <= n_packets; j += 4)
+    {
+        if (is_block_break(packet_times, j, block_boundary, block_interval) |
+            is_block_break(packet_times, j + 1, block_boundary, block_interval) |
+            is_block_break(packet_times, j + 2, block_boundary, block_interval) |
+            is_block_break(packet_times, j + 3, block_boundary, block_interval))
+            break;
+    }
+    for (; j < n_packets; j++)
+    {
+        if (is_block_break(packet_times, j, block_boundary, block_interval))
+            return j;
+    }
     
-    // fprintf(stderr, "done with process_filled_block()");
+    return n_packets;
+}
+
+#ifdef MEF_HAVE_AVX2
+MEF_AVX2_FUNCTION static si8 find_block_break_avx2(ui8 *packet_times, si8 j, si8 n_packets, ui8 block_boundary, si8 block_interval)
+{
+    __m256i cur, prev, sign, gap_bias, gap_limit, boundary, interval_limit, is_gap, is_past;
+    
+    // AVX2 only has a signed 64 bit compare, so the unsigned gap compare flips the sign bits first
+    sign = _mm256_set1_epi64x((si8) 0x8000000000000000ULL);
+    gap_bias = _mm256_set1_epi64x((si8) GAP_BIAS);
+    gap_limit = _mm256_set1_epi64x((si8) ((GAP_LIMIT - 1) ^ 0x8000000000000000ULL));
+    boundary = _mm256_set1_epi64x((si8) block_boundary);
+    interval_limit = _mm256_set1_epi64x(block_interval - 1);
+    for (; j + 4 <= n_packets; j += 4)
+    {
+        cur = _mm256_loadu_si256((__m256i *) (packet_times + j));
+        prev = _mm256_loadu_si256((__m256i *) (packet_times + j - 1));
+        is_gap = _mm256_cmpgt_epi64(_mm256_xor_si256(_mm256_add_epi64(_mm256_sub_epi64(cur, prev), gap_bias), sign), gap_limit);
+        is_past = _mm256_cmpgt_epi64(_mm256_sub_epi64(cur, boundary), interval_limit);
+        if (!_mm256_testz_si256(_mm256_or_si256(is_gap, is_past), _mm256_or_si256(is_gap, is_past)))
+            break;
+    }
     
-    update_metadata(channel_state);  // necessary for real-time applications, otherwise, comment out this line.
+    // the compiler's vzeroupper is skipped when the scalar tail is a tail call; without it the SSE code that runs
+    // after this (in libm, say) pays for a dirty upper half on every instruction
+    _mm256_zeroupper();
     
-    return(0);
+    // find exactly where in the last four the break is
+    return find_block_break_scalar(packet_times, j, n_packets, block_boundary, block_interval);
 }
-
-#ifdef _EXPORT_FOR_DLL
-__declspec (dllexport)
 #endif
 
-si4 initialize_meflib_dll()
+#if defined(MEF_HAVE_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+static si8 find_block_break_neon(ui8 *packet_times, si8 j, si8 n_packets, ui8 block_boundary, si8 block_interval)
 {
-    extern MEF_GLOBALS	*MEF_globals;
-    
-    (void)initialize_meflib();
- 
-    MEF_globals->recording_time_offset_mode = RTO_IGNORE;  // turn off timestamp offsetting by default
+    uint64x2_t cur, prev, gap_bias, gap_limit, is_gap, is_past;
+    int64x2_t boundary, interval_limit;
+    
+    gap_bias = vdupq_n_u64(GAP_BIAS);
+    gap_limit = vdupq_n_u64(GAP_LIMIT);
+    boundary = vdupq_n_s64((si8) block_boundary);
+    interval_limit = vdupq_n_s64(block_interval - 1);
+    for (; j + 2 <= n_packets; j += 2)
+    {
+        cur = vld1q_u64(packet_times + j);
+        prev = vld1q_u64(packet_times + j - 1);
+        is_gap = vcgeq_u64(vaddq_u64(vsubq_u64(cur, prev), gap_bias), gap_limit);
+        is_past = vcgtq_s64(vsubq_s64(vreinterpretq_s64_u64(cur), boundary), interval_limit);
+        if (vmaxvq_u32(vreinterpretq_u32_u64(vorrq_u64(is_gap, is_past))) != 0)
+            break;
+    }
     
-    return 0;
+    return find_block_break_scalar(packet_times, j, n_packets, block_boundary, block_interval);
 }
-
-#ifdef _EXPORT_FOR_DLL
-__declspec (dllexport)
 #endif
 
-si4 write_mef_channel_data( CHANNEL_STATE *channel_state,
-                           ui8 *packet_times,
-                           si4 *samps,
-                           ui8 n_packets_to_process,
-                           sf8 secs_per_block,
-                           sf8 sampling_frequency)
+// The fastest version of each sample kernel this CPU supports, picked the first time one is needed.
+typedef struct {
+    void    (*bit_shift)(si4 *, ui4);
+    void    (*copy_with_extrema)(si4 *, si4 *, ui8, si4 *, si4 *);
+    si8     (*find_block_break)(ui8 *, si8, si8, ui8, si8);
+} SAMPLE_KERNELS;
+
+static SAMPLE_KERNELS sample_kernels;
+static MEF_ONCE sample_kernels_once = MEF_ONCE_INITIALIZER;
+
+static MEF_ONCE_FUNCTION(pick_sample_kernels)
 {
-    si4 *raw_data_ptr_start, *raw_data_ptr_current;
-    ui8 block_len, block_hdr_time, block_boundary;
-    ui8 last_chan_timestamp;
-    si4 discontinuity_flag;
-    si8 j;
-    si8 block_interval;
-    int chan_num;
-    
-    // fprintf(stderr, "in write_mef_channel_data()\n");
+    sample_kernels.bit_shift = bit_shift_samples_scalar;
+    sample_kernels.copy_with_extrema = copy_samples_with_extrema_scalar;
+    sample_kernels.find_block_break = find_block_break_scalar;
+#if defined(MEF_HAVE_NEON)
+    sample_kernels.bit_shift = bit_shift_samples_neon;
+    sample_kernels.copy_with_extrema = copy_samples_with_extrema_neon;
+#if defined(__aarch64__) || defined(_M_ARM64)
+    sample_kernels.find_block_break = find_block_break_neon;
+#endif
+#elif defined(MEF_HAVE_SSE2)
+    sample_kernels.bit_shift = bit_shift_samples_sse2;
+    sample_kernels.copy_with_extrema = copy_samples_with_extrema_sse2;
+#ifdef MEF_HAVE_AVX2
+    if (cpu_has_avx2())
+    {
+        sample_kernels.bit_shift = bit_shift_samples_avx2;
+        sample_kernels.copy_with_extrema = copy_samples_with_extrema_avx2;
+        sample_kernels.find_block_break = find_block_break_avx2;
+    }
+#endif
+#endif
     
-    chan_num          = channel_state->chan_num;
+    return MEF_ONCE_RETURN;
+}
+
+static const SAMPLE_KERNELS *get_sample_kernels(void)
+{
+    mef_once(&sample_kernels_once, pick_sample_kernels);
     
-    // bring in data from channel_state struct
-    raw_data_ptr_start   = channel_state->raw_data_ptr_start;
-    raw_data_ptr_current = channel_state->raw_data_ptr_current;
-    block_hdr_time       = channel_state->block_hdr_time;
-    block_boundary       = channel_state->block_boundary;
-    last_chan_timestamp  = channel_state->last_chan_timestamp;
-    discontinuity_flag   = channel_state->discontinuity_flag;
-    block_interval       = channel_state->metadata_fps->metadata.time_series_section_2->block_interval;
+    return &sample_kernels;
+}
+
+// Shift a block of samples from 20 to 18 bit resolution.
+static void bit_shift_samples(si4 *samples, ui4 num_samples)
+{
+    get_sample_kernels()->bit_shift(samples, num_samples);
+}
+
+// Start the extrema of an empty block, so the first sample copied replaces both.
+static void reset_block_extrema(CHANNEL_STATE *channel_state)
+{
+    channel_state->raw_data_minimum = (si4) 0x7FFFFFFF;
+    channel_state->raw_data_maximum = (si4) 0x80000000;
+}
+
+// Add samples to the block being filled, keeping its extrema and the optional running statistics up to date.
+// samps is read every sample_stride samples (1 for the usual contiguous samples).
+static si4 *append_block_samples(CHANNEL_STATE *channel_state, si4 *raw_data_ptr_current, si4 *samps, si8 sample_stride, ui8 num_samples)
+{
+    si8 sum;
+    sf8 sum_of_squares;
+    ui8 i;
     
-    // this is updated everytime, although it should never change between calls.
-    // TBD add test to make sure it doesn't change?  This needs to be a parameter call because sometimes you don't
-    // know the correct sampling frequency until data acutally arrives
-    channel_state->metadata_fps->metadata.time_series_section_2->sampling_frequency = sampling_frequency;
+    if (num_samples == 0)
+        return raw_data_ptr_current;
     
-    // set local constants
-    block_len = (ui8) ceil(secs_per_block * sampling_frequency); //user-defined block size (s), convert to # of samples
-    channel_state->block_len = block_len;
+    if (sample_stride == 1)
+        WRITER_STATS_TIME(channel_state, extrema_nsecs,
+            get_sample_kernels()->copy_with_extrema(raw_data_ptr_current, samps, num_samples,
+                                                    &(channel_state->raw_data_minimum), &(channel_state->raw_data_maximum)));
+    else
+        WRITER_STATS_TIME(channel_state, extrema_nsecs,
+            copy_strided_samples_with_extrema(raw_data_ptr_current, samps, sample_stride, num_samples,
+                                              &(channel_state->raw_data_minimum), &(channel_state->raw_data_maximum)));
     
-    for (j = 0; j < n_packets_to_process; ++j)
+    if (channel_state->statistics_enabled)
     {
-        // set timestamp for the first block processed
-        if (block_hdr_time == 0)
-        {
-            // block_hdr_time is the actual time put into the block header (timestamp of the first
-            // block sample), while block_boundary is used only for calculation of which samples go
-            // into which blocks.  block_boundary is never written to the mef file.
-            block_hdr_time = packet_times[j];
-            block_boundary = packet_times[j];
-        }
-        
-        if ((abs((((si8)(packet_times[j]) - (si8)last_chan_timestamp))) >= DISCONTINUITY_TIME_THRESHOLD) ||
-            (((si8)(packet_times[j]) - (si8)block_boundary) >= (si8)block_interval))
+        // the samples were just copied, so this pass runs from cache
+        sum = 0;
+        sum_of_squares = 0.0;
+        for (i = 0; i < num_samples; i++)
         {
-            // Block needs to be compressed and written
-            
-            // See if data exists in the buffer before processing it.  Data might not exist if
-            // this is the first sample we've processed so far.
-            if ((raw_data_ptr_current - raw_data_ptr_start) > 0)
-            {
-                // process block of previously collected data
-                process_filled_block(channel_state, raw_data_ptr_start, (raw_data_ptr_current - raw_data_ptr_start),
-                                     block_len, discontinuity_flag, block_hdr_time);
-            }
-            
-            // mark next block as being discontinuous if discontinuity is found
-            if (abs((((si8)(packet_times[j]) - (si8)last_chan_timestamp))) >= DISCONTINUITY_TIME_THRESHOLD)
-            {
-                discontinuity_flag = 1;
-                block_boundary = packet_times[j];
-            }
-            else
-            {
-                discontinuity_flag = 0;
-                block_boundary += block_interval;
-            }
-            
-            // set next block's timestamp
-            block_hdr_time = packet_times[j];
-            
-            // move back to the beginning of the raw block
-            raw_data_ptr_current = raw_data_ptr_start;
+            sum += raw_data_ptr_current[i];
+            sum_of_squares += (sf8) raw_data_ptr_current[i] * (sf8) raw_data_ptr_current[i];
         }
-        
-        *raw_data_ptr_current++ = *samps++;
-        
-        last_chan_timestamp = packet_times[j];
+        channel_state->statistics_number_of_samples += num_samples;
+        channel_state->statistics_sum += (sf8) sum;
+        channel_state->statistics_sum_of_squares += sum_of_squares;
     }
     
-    // save state of channel for next time
-    channel_state->raw_data_ptr_current = raw_data_ptr_current;
-    channel_state->last_chan_timestamp  = last_chan_timestamp;
-    channel_state->block_hdr_time       = block_hdr_time;
-    channel_state->block_boundary       = block_boundary;
-    channel_state->discontinuity_flag   = discontinuity_flag;
-    
-    return(0);
+    return raw_data_ptr_current + num_samples;
 }
 
-#ifdef _EXPORT_FOR_DLL
-__declspec (dllexport)
-#endif
+// Name and directory of the segment after the current one; segment_path has MEF_FULL_FILE_NAME_BYTES
+static void next_segment_path(CHANNEL_STATE *channel_state, si1 *segment_name, si1 *segment_path)
+{
+    UNIVERSAL_HEADER *uh;
+    
+    uh = channel_state->ts_data_fps->universal_header;
+    uh->segment_number++;
+    generate_segment_name(channel_state->ts_data_fps, segment_name);
+    uh->segment_number--;
+    MEF_snprintf(segment_path, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", channel_state->channel_path, segment_name, SEGMENT_DIRECTORY_TYPE_STRING);
+}
 
-si4 flush_mef_channel(CHANNEL_STATE *channel_state)
+static FILE *open_segment_file(si1 *segment_path, si1 *segment_name, const si1 *type_string)
 {
-    si4 *raw_data_ptr_start, *raw_data_ptr_current;
-    ui8 block_len, block_hdr_time, block_boundary;
-    ui8 last_chan_timestamp;
-    si4 discontinuity_flag;
-    si8 block_interval;
+    si1 file_name[MEF_FULL_FILE_NAME_BYTES];
     
-    // bring in data from channel_state struct
-    raw_data_ptr_start = channel_state->raw_data_ptr_start;
-    raw_data_ptr_current = channel_state->raw_data_ptr_current;
-    block_hdr_time = channel_state->block_hdr_time;
-    block_boundary = channel_state->block_boundary;
-    last_chan_timestamp = channel_state->last_chan_timestamp;
-    discontinuity_flag = channel_state->discontinuity_flag;
-    block_interval = channel_state->metadata_fps->metadata.time_series_section_2->block_interval;
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, type_string);
     
-    // this tests for the case where no data has yet been given to this channel.
-    if (channel_state->block_len == 0)
-        return 0;
+    return fopen(file_name, "w+b");
+}
+
+// Does the slow part of check_for_new_segment() ahead of time, once the block being written is in the second half
+// of its segment.  If anything fails, the segment roll simply does it all itself.
+static void prepare_next_segment(CHANNEL_STATE *channel_state, ui8 start_time)
+{
+    si1 segment_name[MEF_SEGMENT_BASE_FILE_NAME_BYTES];
+    si1 segment_path[MEF_FULL_FILE_NAME_BYTES];
+    si8 usecs_to_next_segment;
+    si4 i;
+    extern MEF_GLOBALS *MEF_globals;
     
-    // See if data exists in the buffer before processing it.
-    if ((raw_data_ptr_current - raw_data_ptr_start) > 0)
-    {
-        // process block of previously collected data
-        process_filled_block(channel_state, raw_data_ptr_start, (raw_data_ptr_current - raw_data_ptr_start),
-                             channel_state->block_len, discontinuity_flag, block_hdr_time);
-    }
+    if (channel_state->next_segment_prepared || channel_state->next_segment_start_time == 0)
+        return;
     
-    // mark next block as being discontinuous
-    discontinuity_flag = 1;
+    if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
+        usecs_to_next_segment = (si8) (start_time - channel_state->next_segment_start_time);
+    else
+        usecs_to_next_segment = (si8) (channel_state->next_segment_start_time - start_time);
+    if (usecs_to_next_segment > (si8) (channel_state->num_secs_per_segment * 1e6 / 2))
+        return;
     
-    // set to zero so it will be reset next packet
-    block_boundary = 0;
-    block_hdr_time = 0;
+    next_segment_path(channel_state, segment_name, segment_path);
+    if (make_directory(segment_path))
+        return;
     
-    // move back to the beginning of the raw block
-    raw_data_ptr_current = raw_data_ptr_start;
+    channel_state->next_segment_data_fp = open_segment_file(segment_path, segment_name, TIME_SERIES_DATA_FILE_TYPE_STRING);
+    channel_state->next_segment_inds_fp = open_segment_file(segment_path, segment_name, TIME_SERIES_INDICES_FILE_TYPE_STRING);
+    channel_state->next_segment_metadata_fp = open_segment_file(segment_path, segment_name, TIME_SERIES_METADATA_FILE_TYPE_STRING);
     
-    // save state of channel for next time
-    channel_state->raw_data_ptr_current = raw_data_ptr_current;
-    channel_state->last_chan_timestamp = last_chan_timestamp;
-    channel_state->block_hdr_time = block_hdr_time;
-    channel_state->block_boundary = block_boundary;
-    channel_state->discontinuity_flag = discontinuity_flag;
+    generate_UUID_thread_safe(channel_state->next_segment_level_UUID);
+    for (i = 0; i < 3; i++)
+        generate_UUID_thread_safe(channel_state->next_segment_file_UUIDs[i]);
     
-    return (0);
+    // files that did open are used, the others are opened at the segment roll
+    channel_state->next_segment_prepared = 1;
 }
 
-si4 check_for_new_segment(CHANNEL_STATE *channel_state, ui8 start_time)
+// Closes and removes the files and directory of a prepared segment that won't be used
+static void discard_next_segment(CHANNEL_STATE *channel_state)
 {
-    
-    FILE_PROCESSING_STRUCT  *ts_inds_fps;
-    FILE_PROCESSING_STRUCT  *ts_data_fps;
-    FILE_PROCESSING_STRUCT  *metadata_fps;
-    UNIVERSAL_HEADER *uh;
     si1 segment_name[MEF_SEGMENT_BASE_FILE_NAME_BYTES];
     si1 segment_path[MEF_FULL_FILE_NAME_BYTES];
-    si1	command[512];
-    TIME_SERIES_METADATA_SECTION_2	*md2;
-	extern MEF_GLOBALS	*MEF_globals;
-    
-    // ignore this function if we're still writing the first block to the first segment
-    if (channel_state->next_segment_start_time == 0)
-        return(0);
+    si1 file_name[MEF_FULL_FILE_NAME_BYTES];
     
-	if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
-	{
-		if (start_time > channel_state->next_segment_start_time)
-			return(0);
-	}
-	else
-	{
-		if (start_time < channel_state->next_segment_start_time)
-			return(0);
-	}
+    if (!channel_state->next_segment_prepared)
+        return;
     
-    ts_inds_fps = channel_state->ts_inds_fps;
-    ts_data_fps = channel_state->ts_data_fps;
-    metadata_fps = channel_state->metadata_fps;
+    if (channel_state->next_segment_data_fp != NULL)
+        fclose(channel_state->next_segment_data_fp);
+    if (channel_state->next_segment_inds_fp != NULL)
+        fclose(channel_state->next_segment_inds_fp);
+    if (channel_state->next_segment_metadata_fp != NULL)
+        fclose(channel_state->next_segment_metadata_fp);
+    channel_state->next_segment_data_fp = channel_state->next_segment_inds_fp = channel_state->next_segment_metadata_fp = NULL;
+    channel_state->next_segment_prepared = 0;
+    
+    next_segment_path(channel_state, segment_name, segment_path);
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_DATA_FILE_TYPE_STRING);
+    remove(file_name);
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_INDICES_FILE_TYPE_STRING);
+    remove(file_name);
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_METADATA_FILE_TYPE_STRING);
+    remove(file_name);
+#ifdef _WIN32
+    RemoveDirectoryA(segment_path);
+#else
+    rmdir(segment_path);
+#endif
+    forget_directory(segment_path);
+}
+
+// Adaptive block length, see set_mef_channel_adaptive_blocks().  Called for each encoded block, on the thread
+// encoding it, and only changes adaptive_interval_next.
+static void adapt_block_interval(CHANNEL_STATE *channel_state, ui4 num_entries, ui4 block_bytes)
+{
+    sf8 header_share, sampling_frequency;
+    si8 interval;
     
-    // update and write segment metadata files as well as universal headers
-    update_metadata(channel_state);
+    // blocks cut short by a gap or a flush say nothing about the interval
+    sampling_frequency = channel_state->metadata_fps->metadata.time_series_section_2->sampling_frequency;
+    interval = channel_state->adaptive_interval_next;
+    if ((sf8) num_entries * 2e6 < (sf8) interval * sampling_frequency)
+        return;
     
-    // close old segment files
-    fclose(ts_data_fps->fp);
-    fclose(ts_inds_fps->fp);
-    fclose(metadata_fps->fp);
+    channel_state->adaptive_window_blocks++;
+    channel_state->adaptive_window_samples += num_entries;
+    channel_state->adaptive_window_bytes += block_bytes;
+    if (channel_state->adaptive_window_blocks < ADAPTIVE_BLOCK_WINDOW)
+        return;
     
-    // set fp's to NULL, to force write_MEF_file() to do a new fopen()
-    ts_data_fps->fp = NULL;
-    ts_inds_fps->fp = NULL;
-    metadata_fps->fp = NULL;
+    header_share = (sf8) (channel_state->adaptive_window_blocks * RED_BLOCK_HEADER_BYTES) / (sf8) channel_state->adaptive_window_bytes;
+    if (header_share > ADAPTIVE_MAX_HEADER_SHARE)
+        interval = (interval * 3) / 2;
+    else if (header_share < ADAPTIVE_MIN_HEADER_SHARE &&
+             channel_state->adaptive_window_samples > ADAPTIVE_MAX_BLOCK_SAMPLES * channel_state->adaptive_window_blocks)
+        interval = (interval * 2) / 3;
+    if (interval > channel_state->adaptive_max_interval)
+        interval = channel_state->adaptive_max_interval;
+    if (interval < channel_state->adaptive_min_interval)
+        interval = channel_state->adaptive_min_interval;
+    channel_state->adaptive_interval_next = interval;
+    
+    channel_state->adaptive_window_blocks = 0;
+    channel_state->adaptive_window_samples = 0;
+    channel_state->adaptive_window_bytes = 0;
+}
+
+// Generates the session's recording time offset from the first block to be encoded, if it isn't known yet.
+static void generate_session_time_offset(CHANNEL_STATE *channel_state, ui8 block_hdr_time)
+{
+    extern MEF_GLOBALS	*MEF_globals;
     
-    // deal with data file
-    uh = channel_state->ts_data_fps->universal_header;
-    uh->segment_number++;
-    generate_segment_name(ts_data_fps, segment_name);
-    // make mef3 segment directory
-    sprintf(segment_path, "%s/%s.%s", channel_state->channel_path, segment_name, SEGMENT_DIRECTORY_TYPE_STRING);
-    sprintf(command, "mkdir %s", segment_path);
-    //fprintf(stderr, "...%s...\n", command);
-    system(command);
-    // open new data file
-    MEF_snprintf(ts_data_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_DATA_FILE_TYPE_STRING);
-    // update headers
-    uh->start_time = start_time;
-    uh->end_time = start_time;  // this will get overwritten very quickly
-    uh->number_of_entries = 0;
-    uh->maximum_entry_size = 0;
-    generate_UUID(uh->level_UUID);
-    generate_UUID(uh->file_UUID);
-    ts_data_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;
-    ts_data_fps->directives.close_file = MEF_FALSE;
-    write_MEF_file(channel_state->ts_data_fps);
-    channel_state->data_file_offset = UNIVERSAL_HEADER_BYTES;
-    ts_data_fps->universal_header->body_CRC = CRC_START_VALUE;
+    // only care about generating offset times if this is a brand-new session.
+    // if we are appending to existing session, we alrady have offset times
+    if ((channel_state->if_appending == 0) && (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT)))
+    {
+        // this only be done for one channel, assumes all channels have same offset.
+        // The lock makes sure only one channel generates it, when blocks are being encoded in parallel.
+        mef_mutex_lock(&mef_globals_lock);
+        if (MEF_globals->recording_time_offset == MEF_GLOBALS_RECORDING_TIME_OFFSET_DEFAULT) {
+            // generate recording time offset & GMT offset
+            //TBD bring in GMT offset
+            generate_recording_time_offset(block_hdr_time, (si4) (channel_state->gmt_offset_in_hours * 3600.0));
+            //generated_offset = 1;
+        }
+        mef_mutex_unlock(&mef_globals_lock);
+    }
+}
+
+// Bit shifts a filled block (in place, with its extrema) and RED-encodes it into rps.  This only reads
+// channel_state, so blocks of a channel in offline mode can be encoded by several workers at once, each into
+// an rps of its own.
+static void encode_filled_block(CHANNEL_STATE *channel_state, RED_PROCESSING_STRUCT *rps, si4 *raw_data_ptr_start, ui4 num_entries,
+                                si4 discontinuity_flag, ui8 block_hdr_time, si4 *block_minimum, si4 *block_maximum)
+{
+    // RED compresses into rps->compressed_data, which is sized for the channel's raw buffer (see block_buffer_samples())
     
+    if (channel_state->bit_shift_flag)
+    {
+        //shift 2 bits to 18 bit resolution
+        bit_shift_samples(raw_data_ptr_start, num_entries);
+        
+        // the shift never changes the order of two samples, so the shifted extrema are the extrema of the shifted block
+        bit_shift_samples_scalar(block_minimum, 1);
+        bit_shift_samples_scalar(block_maximum, 1);
+    }
     
-    //deal with index file
-    uh = channel_state->ts_inds_fps->universal_header;
-    uh->segment_number++;
-    // open new inds file
-    MEF_snprintf(ts_inds_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_INDICES_FILE_TYPE_STRING);
-    // update headers
-    uh->start_time = start_time;
-    uh->end_time = start_time;  // this will get overwritten very quickly
-    uh->number_of_entries = 0;
-    uh->maximum_entry_size = TIME_SERIES_INDEX_BYTES;
-    memcpy(uh->level_UUID, ts_data_fps->universal_header->level_UUID, 16);
-    generate_UUID(uh->file_UUID);
-    ts_inds_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;
-    ts_inds_fps->directives.close_file = MEF_FALSE;
-    write_MEF_file(channel_state->ts_inds_fps);
-    channel_state->inds_file_offset = UNIVERSAL_HEADER_BYTES;
-    ts_inds_fps->universal_header->body_CRC =  CRC_START_VALUE;
+    // set up RED compression
+    rps->original_data = rps->original_ptr = raw_data_ptr_start;
+    rps->directives.discontinuity = (discontinuity_flag== 1) ? MEF_TRUE : MEF_FALSE;
+    rps->block_header->number_of_samples = num_entries;
+    rps->block_header->start_time = block_hdr_time;
     
-    //deal with metadata file
-    uh = channel_state->metadata_fps->universal_header;
-    uh->segment_number++;
-    // open new inds file
-    MEF_snprintf(metadata_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_METADATA_FILE_TYPE_STRING);
-    fps_open(metadata_fps, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    // update headers
-    uh->body_CRC = CRC_START_VALUE;
+    // RED compress data block
+    (void) RED_encode(rps);
+}
+
+// Everything after encoding: stages the block encoded in rps for the data file, adds its index entry, updates the segment's
+// metadata and headers, and checkpoints if the policy says so.  Blocks of a channel must be given to this in order.
+static si4 commit_encoded_block(CHANNEL_STATE *channel_state, RED_PROCESSING_STRUCT *rps, ui4 num_entries,
+                                si4 discontinuity_flag, ui8 block_hdr_time, si4 block_minimum, si4 block_maximum)
+{
+    extern MEF_GLOBALS	*MEF_globals;
+    ui1 *temp_time_series_index;
+    sf8			temp_sf8;
+    FILE_PROCESSING_STRUCT  *ts_data_fps;
+    FILE_PROCESSING_STRUCT  *metadata_fps;
+    TIME_SERIES_METADATA_SECTION_2	*md2;
+    UNIVERSAL_HEADER *uh_meta;
+    UNIVERSAL_HEADER *uh_data;
+    UNIVERSAL_HEADER *uh_inds;
+    TIME_SERIES_INDEX temp_struct;
+    si4 checkpoint_due;
+    
+    checkpoint_due = 0;
+    
+    ts_data_fps                     = channel_state->ts_data_fps;
+    metadata_fps                    = channel_state->metadata_fps;
+    
+    WRITER_STATS_ADD(channel_state, blocks_encoded, 1);
+    WRITER_STATS_ADD(channel_state, samples_encoded, num_entries);
+    if (channel_state->adaptive_blocks_enabled)
+        adapt_block_interval(channel_state, num_entries, rps->block_header->block_bytes);
+    
+    if (channel_state->num_secs_per_segment > 0 )
+    {
+        check_for_new_segment(channel_state, rps->block_header->start_time);
+        if (channel_state->segment_preopen_enabled)
+            prepare_next_segment(channel_state, rps->block_header->start_time);
+    }
+    
+    // stage block for the output file, writing the staged blocks first if it doesn't fit
+    //fwrite(out_data, sizeof(si1), RED_block_size, ofp);
+    if (channel_state->data_batch_bytes + rps->block_header->block_bytes > channel_state->data_batch_max_bytes)
+        write_data_batch(channel_state);
+    if (rps->block_header->block_bytes <= channel_state->data_batch_max_bytes)
+    {
+        memcpy(channel_state->data_batch + channel_state->data_batch_bytes, rps->compressed_data, (size_t) rps->block_header->block_bytes);
+        channel_state->data_batch_bytes += rps->block_header->block_bytes;
+    }
+    else
+    {
+        // bigger than the whole batch, write it directly
+        WRITER_STATS_TIME(channel_state, write_nsecs,
+            if (mapped_file_append(channel_state, ts_data_fps, &channel_state->data_map, rps->compressed_data, (size_t) rps->block_header->block_bytes))
+                (void) e_fwrite(rps->compressed_data, sizeof(ui1), (size_t) rps->block_header->block_bytes, ts_data_fps->fp, ts_data_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR));
+        WRITER_STATS_ADD(channel_state, writes, 1);
+        WRITER_STATS_ADD(channel_state, bytes_written, rps->block_header->block_bytes);
+        
+        // update data body CRC
+        WRITER_STATS_TIME(channel_state, crc_nsecs,
+            ts_data_fps->universal_header->body_CRC = mef_crc_update(rps->compressed_data, rps->block_header->block_bytes, ts_data_fps->universal_header->body_CRC));
+    }
+    
+    // set recording_start_time on first pass
+    uh_meta = channel_state->metadata_fps->universal_header;
+    uh_data = channel_state->ts_data_fps->universal_header;
+    uh_inds = channel_state->ts_inds_fps->universal_header;
+    if (uh_meta->start_time == UNIVERSAL_HEADER_START_TIME_NO_ENTRY)
+    {
+        // needs to be offset, since universal header will always be written unencrypted
+        // these timestamps are already offset, because the offsetting occurs in the RED compression routine
+        uh_meta->start_time = rps->block_header->start_time;
+        uh_data->start_time = rps->block_header->start_time;
+        uh_inds->start_time = rps->block_header->start_time;
+        
+        // set start time for next segment
+        if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
+            channel_state->next_segment_start_time = rps->block_header->start_time - (channel_state->num_secs_per_segment * 1e6);  // subtract, since times are offset
+        else
+            channel_state->next_segment_start_time = rps->block_header->start_time + (channel_state->num_secs_per_segment * 1e6);
+    }
+    
+    md2 = metadata_fps->metadata.time_series_section_2;
+    
+    temp_struct.minimum_sample_value = block_minimum;
+    temp_struct.maximum_sample_value = block_maximum;
+    
+    // update segment  metadata files
+    // maximum_native_sample_value
+    if (md2->units_conversion_factor >= 0)
+        temp_sf8 = (sf8) temp_struct.maximum_sample_value * md2->units_conversion_factor;
+    else
+        temp_sf8 = (sf8) temp_struct.minimum_sample_value * md2->units_conversion_factor;  // units_conversion_factor is negative, so use min value instead
+    if (isnan(md2->maximum_native_sample_value))
+        md2->maximum_native_sample_value = temp_sf8;
+    if (temp_sf8 > md2->maximum_native_sample_value)
+        md2->maximum_native_sample_value = temp_sf8;
+    // minimum_native_sample_value
+    if (md2->units_conversion_factor >= 0)
+        temp_sf8 = (sf8) temp_struct.minimum_sample_value * md2->units_conversion_factor;
+    else
+        temp_sf8 = (sf8) temp_struct.maximum_sample_value * md2->units_conversion_factor;  // units_conversion_factor is negative, so use max value instead
+    if (isnan(md2->minimum_native_sample_value))
+        md2->minimum_native_sample_value = temp_sf8;
+    if (temp_sf8 < md2->minimum_native_sample_value)
+        md2->minimum_native_sample_value = temp_sf8;
+    // maximum_block_bytes
+    if (rps->block_header->block_bytes > md2->maximum_block_bytes)
+        md2->maximum_block_bytes = rps->block_header->block_bytes;
+    // maximum_difference_bytes
+    if (rps->block_header->difference_bytes > md2->maximum_difference_bytes)
+        md2->maximum_difference_bytes = rps->block_header->difference_bytes;
+    // maximum_block_samples
+    if (rps->block_header->number_of_samples > md2->maximum_block_samples)
+        md2->maximum_block_samples = rps->block_header->number_of_samples;
+    // number_of_samples
+    md2->number_of_samples = md2->number_of_samples + num_entries;
+    // number_of_blocks
+    md2->number_of_blocks = md2->number_of_blocks + 1;
+    // number_of_discontinuities
+    if (discontinuity_flag == 1)
+        md2->number_of_discontinuities = md2->number_of_discontinuities + 1;
+    // in theory the next two only need to be set once, but we need to wait until this function, when we have real data,
+    // in order to know what the offset and GMT times are.
+    // recording_time_offset
+    metadata_fps->metadata.section_3->recording_time_offset = MEF_globals->recording_time_offset;
+    // GMT offset
+    metadata_fps->metadata.section_3->GMT_offset = MEF_globals->GMT_offset;
+    
+    // update metadata recording_duration and end_time for all files
+    uh_meta->end_time = block_hdr_time + (si8) (((((sf8) rps->block_header->number_of_samples) / md2->sampling_frequency) * (sf8) 1e6) + (sf8) 0.5);
+    // needs to be offset, since universal header will always be written unencrypted
+    if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
+        apply_recording_time_offset(&uh_meta->end_time);
+    uh_data->end_time = uh_meta->end_time;
+    uh_inds->end_time = uh_meta->end_time;
+    
+    md2->recording_duration = uh_meta->end_time - uh_meta->start_time;
+	// offset time values could be negative, so reverse sign if negative
+	if (md2->recording_duration < 0)
+		md2->recording_duration = 0 - md2->recording_duration;
+    
+    // update number_of_entries
+    uh_data->number_of_entries = uh_data->number_of_entries + 1;
+    uh_inds->number_of_entries = uh_inds->number_of_entries + 1;
+    
+    // update maximum_entry_size, this only applies to data, which is the largest number of samples in a RED block
+    if (num_entries > uh_data->maximum_entry_size)
+        uh_data->maximum_entry_size = num_entries;
+    
+    // set up block entry, TBD test to see if this works
+    //time_series_index.file_offset = channel_state->data_file_offset;
+    //time_series_index.start_time = rps->block_header->start_time;
+    //time_series_index.start_sample = start_sample;
+    //time_series_index.number_of_samples = rps->block_header->number_of_samples;
+    //time_series_index.block_bytes = rps->block_header->block_bytes;
+    //time_series_index.maximum_sample_value = rps->compression.maximum_sample_value;
+    //time_series_index.minimum_sample_value = rps->compression.minimum_sample_value;
+    //time_series_index.flags =rps->block_header->flags
+    
+    // add index entry to the batch, making room first if the batch is full
+    if (channel_state->index_batch_entries >= channel_state->index_batch_max_entries)
+        write_index_batch(channel_state);
+    temp_time_series_index = channel_state->temp_time_series_index + ((size_t) channel_state->index_batch_entries * TIME_SERIES_INDEX_BYTES);
+    memcpy(temp_time_series_index,    &(channel_state->data_file_offset),                          sizeof(ui8));
+    memcpy(temp_time_series_index+8,  &(rps->block_header->start_time),             sizeof(ui8));
+    memcpy(temp_time_series_index+16, &(channel_state->start_sample),                                             sizeof(ui8));
+    memcpy(temp_time_series_index+24, &(rps->block_header->number_of_samples),      sizeof(ui4));
+    memcpy(temp_time_series_index+28, &(rps->block_header->block_bytes),            sizeof(ui4));
+    memcpy(temp_time_series_index+32, &(temp_struct.maximum_sample_value),     sizeof(si4));
+    memcpy(temp_time_series_index+36, &(temp_struct.minimum_sample_value),     sizeof(si4));
+    memset(temp_time_series_index+40, 0, 4);
+    memcpy(temp_time_series_index+44, &(rps->block_header->flags),                  sizeof(ui1));
+    
+    // the entry is written to the index file, and added to its CRC, by write_index_batch()
+    channel_state->index_batch_entries++;
+    
+    // update discontinuity index
+    if (discontinuity_flag == 1)
+    {
+        //channel_state->discont_block_number = number_of_index_entries;
+        channel_state->discont_contiguous_blocks = 1;
+        channel_state->discont_contiguous_samples = rps->block_header->number_of_samples;
+        channel_state->discont_contiguous_bytes = rps->block_header->block_bytes;
+        //channel_state->discont_contiguous_duration_start = block_hdr_time;
+    }
+    else
+    {
+        //channel_state->discont_block_number = doesn't change
+        channel_state->discont_contiguous_blocks++;
+        channel_state->discont_contiguous_samples += rps->block_header->number_of_samples;
+        channel_state->discont_contiguous_bytes += rps->block_header->block_bytes;
+    }
+    
+    // update metadata file
+    // maximum_contiguous_blocks
+    if (channel_state->discont_contiguous_blocks > md2->maximum_contiguous_blocks)
+        md2->maximum_contiguous_blocks = channel_state->discont_contiguous_blocks;
+    // maximum_contiguous_samples
+    if (channel_state->discont_contiguous_samples > md2->maximum_contiguous_samples)
+        md2->maximum_contiguous_samples = channel_state->discont_contiguous_samples;
+    // maximum_contiguous_block_bytes
+    if (channel_state->discont_contiguous_bytes > md2->maximum_contiguous_block_bytes)
+        md2->maximum_contiguous_block_bytes = channel_state->discont_contiguous_bytes;
+    
+    // update fields for next time
+    channel_state->data_file_offset += rps->block_header->block_bytes;
+    channel_state->start_sample += rps->block_header->number_of_samples;
+    
+    // update mef header fields relating to block index
+    channel_state->number_of_index_entries++;
+    channel_state->number_of_samples += num_entries;
+    
+    // fprintf(stderr, "done with process_filled_block()");
+    
+    // Rewrite the metadata file and universal headers at each checkpoint, so real-time readers following the files
+    // see consistent headers.  Segment rolls and close_mef_channel() always do this regardless of the policy.
+    channel_state->blocks_since_checkpoint++;
+    if (channel_state->last_checkpoint_time == 0)
+        channel_state->last_checkpoint_time = block_hdr_time;
+    switch (channel_state->checkpoint_mode)
+    {
+        case CHECKPOINT_EVERY_N_BLOCKS:
+            if (channel_state->blocks_since_checkpoint >= channel_state->checkpoint_interval_blocks)
+                checkpoint_due = 1;
+            break;
+        case CHECKPOINT_EVERY_T_SECONDS:
+            // measured in recording time, so it doesn't depend on how fast data arrives
+            if (((si8) block_hdr_time - (si8) channel_state->last_checkpoint_time) >= channel_state->checkpoint_interval_usecs)
+                checkpoint_due = 1;
+            break;
+        case CHECKPOINT_ON_CLOSE:
+        default:
+            break;
+    }
+    // section 3 (the time offsets) is only complete after the first block, and recovery can't fill it in
+    if (channel_state->journal_fp != NULL && uh_data->number_of_entries == 1)
+        checkpoint_due = 1;
+    if (checkpoint_due)
+    {
+        update_metadata(channel_state);
+        channel_state->blocks_since_checkpoint = 0;
+        channel_state->last_checkpoint_time = block_hdr_time;
+        
+        flush_channel_mefd_file(channel_state);
+    }
+    
+    // journal the blocks whenever some of them reached the files, so batching still decides how often that is
+    if (channel_state->journal_pending)
+        commit_journal(channel_state);
+    
+    return(0);
+}
+
+// block_minimum and block_maximum are the extrema of the raw samples, as found while they were copied in.
+si4 process_filled_block( CHANNEL_STATE *channel_state, si4* raw_data_ptr_start, ui4 num_entries,
+                         ui8 block_len, si4 discontinuity_flag, ui8 block_hdr_time,
+                         si4 block_minimum, si4 block_maximum)
+{
+    // do nothing if there is nothing to be done
+    if (num_entries == 0)
+        return (0);
+    if (block_len == 0)
+        return (0);  // this should never happen, but check for it anyway
+    
+    generate_session_time_offset(channel_state, block_hdr_time);
+    
+    WRITER_STATS_TIME(channel_state, encode_nsecs,
+        encode_filled_block(channel_state, channel_state->rps, raw_data_ptr_start, num_entries, discontinuity_flag, block_hdr_time,
+                            &block_minimum, &block_maximum));
+    
+    return commit_encoded_block(channel_state, channel_state->rps, num_entries, discontinuity_flag, block_hdr_time, block_minimum, block_maximum);
+}
+
+/***************************************  SESSION WRITER  ***************************************/
+
+// Worker step for a channel with parallel_encode, called (and returning) with the session lock held.  Takes the
+// channel's next block that no worker has taken yet, leaving the channel in the ready list for other workers if
+// there are more, and encodes it.  Then, unless another worker is already doing it, commits encoded blocks from
+// the head of the queue, which keeps the files in order whichever block was encoded first.
+static void process_parallel_block(SESSION_STATE *session, MEF_BLOCK_PIPELINE *pipeline)
+{
+    CHANNEL_STATE *channel_state;
+    FILLED_BLOCK *block;
+    
+    channel_state = pipeline->channel_state;
+    block = &(pipeline->blocks[(pipeline->head + pipeline->started) % pipeline->num_buffers]);
+    pipeline->started++;
+    if (pipeline->started < pipeline->count)
+    {
+        if (session->ready_tail == NULL)
+            session->ready_head = pipeline;
+        else
+            session->ready_tail->next_ready = pipeline;
+        session->ready_tail = pipeline;
+        mef_cond_signal(&session->work_available);
+    }
+    else
+        pipeline->scheduled = 0;
+    mef_mutex_unlock(&session->lock);
+    
+    // directives (such as the encryption level) only change while the channel has no queued blocks
+    block->encode_nsecs = 0;
+    if (block->num_entries > 0 && block->block_len > 0)
+    {
+        block->rps->directives = channel_state->rps->directives;
+        WRITER_STATS_MEASURE(block->encode_nsecs,
+            encode_filled_block(channel_state, block->rps, (block->external_samples != NULL) ? block->external_samples : block->samples,
+                                block->num_entries, block->discontinuity_flag, block->block_hdr_time,
+                                &(block->minimum_sample_value), &(block->maximum_sample_value)));
+    }
+    if (block->external_samples != NULL)
+    {
+        if (block->release != NULL)
+            block->release(block->external_samples, block->release_context);
+        block->external_samples = NULL;
+    }
+    
+    mef_mutex_lock(&session->lock);
+    block->encoded = 1;
+    if (pipeline->committing)
+        return;  // the committing worker gets to this block when the blocks before it are done
+    
+    pipeline->committing = 1;
+    while (pipeline->count > 0 && pipeline->blocks[pipeline->head].encoded)
+    {
+        block = &(pipeline->blocks[pipeline->head]);
+        mef_mutex_unlock(&session->lock);
+        
+        if (block->num_entries > 0 && block->block_len > 0)
+        {
+            WRITER_STATS_ADD(channel_state, encode_nsecs, block->encode_nsecs);
+            commit_encoded_block(channel_state, block->rps, block->num_entries, block->discontinuity_flag, block->block_hdr_time,
+                                 block->minimum_sample_value, block->maximum_sample_value);
+        }
+        
+        mef_mutex_lock(&session->lock);
+        block->encoded = 0;
+        channel_state->adaptive_interval_ready = channel_state->adaptive_interval_next;
+        pipeline->head = (pipeline->head + 1) % pipeline->num_buffers;
+        pipeline->count--;
+        pipeline->started--;
+        
+        // wake up the producer waiting for a free buffer, and anyone waiting for the channel to drain
+        mef_cond_broadcast(&session->work_done);
+    }
+    pipeline->committing = 0;
+}
+
+// Worker thread for a session.  Takes the channel at the head of the ready list, encodes and writes its oldest
+// filled block, and then puts the channel back at the tail of the ready list if it has more blocks waiting.
+// A channel is never in the ready list while a worker is processing it, so blocks of one channel are always
+// written in order, while different channels are encoded in parallel.  Channels with parallel_encode are the
+// exception, see process_parallel_block().
+static MEF_THREAD_FUNCTION(mef_session_worker, arg)
+{
+    SESSION_STATE *session;
+    MEF_BLOCK_PIPELINE *pipeline;
+    FILLED_BLOCK *block;
+    
+    session = (SESSION_STATE *) arg;
+    
+    mef_mutex_lock(&session->lock);
+    for (;;)
+    {
+        while (session->ready_head == NULL && !session->shutting_down)
+            mef_cond_wait(&session->work_available, &session->lock);
+        
+        // only exit once all queued work is done
+        if (session->ready_head == NULL)
+            break;
+        
+        pipeline = session->ready_head;
+        session->ready_head = pipeline->next_ready;
+        if (session->ready_head == NULL)
+            session->ready_tail = NULL;
+        pipeline->next_ready = NULL;
+        if (pipeline->parallel_encode)
+        {
+            process_parallel_block(session, pipeline);
+            continue;
+        }
+        block = &(pipeline->blocks[pipeline->head]);
+        mef_mutex_unlock(&session->lock);
+        
+        if (block->external_samples != NULL)
+        {
+            process_filled_block(pipeline->channel_state, block->external_samples, block->num_entries,
+                                 block->block_len, block->discontinuity_flag, block->block_hdr_time,
+                                 block->minimum_sample_value, block->maximum_sample_value);
+            if (block->release != NULL)
+                block->release(block->external_samples, block->release_context);
+            block->external_samples = NULL;
+        }
+        else
+            process_filled_block(pipeline->channel_state, block->samples, block->num_entries,
+                                 block->block_len, block->discontinuity_flag, block->block_hdr_time,
+                                 block->minimum_sample_value, block->maximum_sample_value);
+        
+        mef_mutex_lock(&session->lock);
+        pipeline->channel_state->adaptive_interval_ready = pipeline->channel_state->adaptive_interval_next;
+        pipeline->head = (pipeline->head + 1) % pipeline->num_buffers;
+        pipeline->count--;
+        if (pipeline->count > 0)
+        {
+            // more blocks for this channel, go to the back of the line
+            if (session->ready_tail == NULL)
+                session->ready_head = pipeline;
+            else
+                session->ready_tail->next_ready = pipeline;
+            session->ready_tail = pipeline;
+            mef_cond_signal(&session->work_available);
+        }
+        else
+            pipeline->scheduled = 0;
+        
+        // wake up producers waiting for a free buffer, and anyone waiting for the channel to drain
+        mef_cond_broadcast(&session->work_done);
+    }
+    mef_mutex_unlock(&session->lock);
+    
+    return MEF_THREAD_RETURN;
+}
+
+// Called by write_mef_channel_data() when a block is full.  Without a session, the block is processed
+// immediately, and the same buffer is returned.  With a session, the block is queued for the workers and
+// the next free buffer of the channel is returned.  If all buffers are in use, this waits for a worker to
+// finish one, so a producer can never get more than buffers_per_channel blocks ahead of the disk.
+// If external_samples isn't NULL, the block is encoded from there instead of raw_data_ptr_start, and release
+// is called once it has been.  The block's extrema are always taken from channel_state.
+static si4 *submit_filled_block(CHANNEL_STATE *channel_state, si4 *raw_data_ptr_start, ui4 num_entries,
+                                ui8 block_len, si4 discontinuity_flag, ui8 block_hdr_time,
+                                si4 *external_samples, MEF_BLOCK_RELEASE release, void *release_context)
+{
+    MEF_BLOCK_PIPELINE *pipeline;
+    SESSION_STATE *session;
+    FILLED_BLOCK *block;
+    si4 *next_buffer;
+    
+    pipeline = (MEF_BLOCK_PIPELINE *) channel_state->pipeline;
+    if (pipeline == NULL)
+    {
+        process_filled_block(channel_state, (external_samples != NULL) ? external_samples : raw_data_ptr_start,
+                             num_entries, block_len, discontinuity_flag, block_hdr_time,
+                             channel_state->raw_data_minimum, channel_state->raw_data_maximum);
+        reset_block_extrema(channel_state);
+        if (external_samples != NULL && release != NULL)
+            release(external_samples, release_context);
+        channel_state->adaptive_interval_in_use = channel_state->adaptive_interval_next;
+        return raw_data_ptr_start;
+    }
+    session = pipeline->session;
+    
+    // blocks encoded in parallel may be encoded in any order, so the time offset has to come from the first one here
+    if (pipeline->parallel_encode)
+        generate_session_time_offset(channel_state, block_hdr_time);
+    
+    mef_mutex_lock(&session->lock);
+    channel_state->adaptive_interval_in_use = channel_state->adaptive_interval_ready;
+    
+    // the buffer being filled is always the one just past the queued blocks
+    block = &(pipeline->blocks[(pipeline->head + pipeline->count) % pipeline->num_buffers]);
+    block->num_entries = num_entries;
+    block->block_len = block_len;
+    block->discontinuity_flag = discontinuity_flag;
+    block->block_hdr_time = block_hdr_time;
+    block->minimum_sample_value = channel_state->raw_data_minimum;
+    block->maximum_sample_value = channel_state->raw_data_maximum;
+    block->external_samples = external_samples;
+    block->release = release;
+    block->release_context = release_context;
+    pipeline->count++;
+    reset_block_extrema(channel_state);
+    
+    if (!pipeline->scheduled)
+    {
+        pipeline->scheduled = 1;
+        if (session->ready_tail == NULL)
+            session->ready_head = pipeline;
+        else
+            session->ready_tail->next_ready = pipeline;
+        session->ready_tail = pipeline;
+        mef_cond_signal(&session->work_available);
+    }
+    
+    // wait for a free buffer
+    while (pipeline->count >= pipeline->num_buffers)
+        mef_cond_wait(&session->work_done, &session->lock);
+    
+    next_buffer = pipeline->blocks[(pipeline->head + pipeline->count) % pipeline->num_buffers].samples;
+    
+    mef_mutex_unlock(&session->lock);
+    
+    return next_buffer;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+SESSION_STATE *create_mef_session(si4 num_worker_threads, si4 buffers_per_channel)
+{
+    SESSION_STATE *session;
+    si4 i;
+    
+    // default to one worker per processor
+    if (num_worker_threads <= 0)
+    {
+#ifdef _WIN32
+        SYSTEM_INFO system_info;
+        GetSystemInfo(&system_info);
+        num_worker_threads = (si4) system_info.dwNumberOfProcessors;
+#else
+        num_worker_threads = (si4) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (num_worker_threads <= 0)
+            num_worker_threads = 1;
+    }
+    
+    // one buffer being filled, and at least one being encoded
+    if (buffers_per_channel < 2)
+        buffers_per_channel = 2;
+    
+    session = (SESSION_STATE *) calloc((size_t) 1, sizeof(SESSION_STATE));
+    if (session == NULL)
+    {
+        fprintf(stderr, "Insufficient memory to allocate session\n");
+        exit(1);
+    }
+    mef_mutex_init(&session->lock);
+    mef_cond_init(&session->work_available);
+    mef_cond_init(&session->work_done);
+    session->buffers_per_channel = buffers_per_channel;
+    session->shutting_down = 0;
+    session->ready_head = NULL;
+    session->ready_tail = NULL;
+    session->channels = NULL;
+    session->num_channels = 0;
+    session->max_channels = 0;
+    session->ingest_queues = NULL;
+    session->num_ingest_queues = 0;
+    session->next_ingest_queue = 0;
+    
+    session->workers = (MEF_THREAD *) calloc((size_t) num_worker_threads, sizeof(MEF_THREAD));
+    if (session->workers == NULL)
+    {
+        fprintf(stderr, "Insufficient memory to allocate session\n");
+        exit(1);
+    }
+    for (i = 0; i < num_worker_threads; i++)
+    {
+        if (mef_thread_create(&(session->workers[i]), mef_session_worker, session) != 0)
+        {
+            fprintf(stderr, "Unable to start session worker thread\n");
+            exit(1);
+        }
+    }
+    session->num_workers = num_worker_threads;
+    
+    return session;
+}
+
+// Turns parallel encoding of a pipeline's blocks on or off, giving each slot its own RED processing struct the
+// first time.  The pipeline must have no queued blocks.  A session with one worker (such as the background
+// thread of an asynchronous channel) couldn't encode in parallel anyway, so it is left alone.
+static void set_pipeline_parallel_encode(MEF_BLOCK_PIPELINE *pipeline, si4 enabled)
+{
+    CHANNEL_STATE *channel_state;
+    ui4 max_samps;
+    si4 i;
+    
+    if (enabled && pipeline->session->num_workers < 2)
+        enabled = 0;
+    
+    channel_state = pipeline->channel_state;
+    if (enabled && pipeline->blocks[0].rps == NULL)
+    {
+        // same as the channel's own, see initialize_mef_channel_data()
+        max_samps = (ui4) channel_state->raw_data_buffer_samples;
+        for (i = 0; i < pipeline->num_buffers; i++)
+        {
+            pipeline->blocks[i].rps = RED_allocate_processing_struct(0, RED_MAX_COMPRESSED_BYTES(max_samps, 1), 0, RED_MAX_DIFFERENCE_BYTES(max_samps), 0, 0, channel_state->pwd);
+            pipeline->blocks[i].encoded = 0;
+        }
+    }
+    pipeline->parallel_encode = enabled;
+    pipeline->started = 0;
+    pipeline->committing = 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 add_mef_session_channel(SESSION_STATE *session, CHANNEL_STATE *channel_state)
+{
+    MEF_BLOCK_PIPELINE *pipeline;
+    CHANNEL_STATE **new_channels;
+    size_t pipeline_bytes, slot_bytes, buffer_bytes;
+    si4 i;
+    
+    if (session == NULL || channel_state == NULL)
+        return -1;
+    
+    // already part of a session
+    if (channel_state->pipeline != NULL)
+        return -1;
+    
+    // the pipeline, its slots and its extra raw buffers are one allocation
+    pipeline_bytes = ARENA_ROUND(sizeof(MEF_BLOCK_PIPELINE));
+    slot_bytes = ARENA_ROUND((size_t) session->buffers_per_channel * sizeof(FILLED_BLOCK));
+    buffer_bytes = ARENA_ROUND(channel_state->raw_data_buffer_samples * sizeof(si4));
+    pipeline = (MEF_BLOCK_PIPELINE *) calloc((size_t) 1, pipeline_bytes + slot_bytes + ((size_t) (session->buffers_per_channel - 1) * buffer_bytes));
+    if (pipeline == NULL)
+    {
+        fprintf(stderr, "Insufficient memory to allocate channel block pipeline\n");
+        exit(1);
+    }
+    pipeline->blocks = (FILLED_BLOCK *) ((ui1 *) pipeline + pipeline_bytes);
+    
+    // the channel's existing buffer (which may already hold samples) is the first one, and is the one being filled
+    pipeline->blocks[0].samples = channel_state->raw_data_ptr_start;
+    for (i = 1; i < session->buffers_per_channel; i++)
+        pipeline->blocks[i].samples = (si4 *) ((ui1 *) pipeline + pipeline_bytes + slot_bytes + ((size_t) (i - 1) * buffer_bytes));
+    pipeline->session = session;
+    pipeline->channel_state = channel_state;
+    pipeline->original_buffer = channel_state->raw_data_ptr_start;
+    pipeline->num_buffers = session->buffers_per_channel;
+    pipeline->head = 0;
+    pipeline->count = 0;
+    pipeline->scheduled = 0;
+    pipeline->private_session = 0;
+    pipeline->next_ready = NULL;
+    set_pipeline_parallel_encode(pipeline, channel_state->offline_mode);
+    
+    mef_mutex_lock(&session->lock);
+    if (session->num_channels == session->max_channels)
+    {
+        new_channels = (CHANNEL_STATE **) realloc(session->channels, (size_t) (session->max_channels + 64) * sizeof(CHANNEL_STATE *));
+        if (new_channels == NULL)
+        {
+            fprintf(stderr, "Insufficient memory to add channel to session\n");
+            exit(1);
+        }
+        session->channels = new_channels;
+        session->max_channels += 64;
+    }
+    session->channels[session->num_channels++] = channel_state;
+    mef_mutex_unlock(&session->lock);
+    
+    channel_state->session = session;
+    channel_state->pipeline = pipeline;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 wait_for_mef_channel(CHANNEL_STATE *channel_state)
+{
+    MEF_BLOCK_PIPELINE *pipeline;
+    SESSION_STATE *session;
+    
+    pipeline = (MEF_BLOCK_PIPELINE *) channel_state->pipeline;
+    if (pipeline == NULL)
+        return 0;
+    session = pipeline->session;
+    
+    mef_mutex_lock(&session->lock);
+    while (pipeline->count > 0)
+        mef_cond_wait(&session->work_done, &session->lock);
+    mef_mutex_unlock(&session->lock);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 wait_for_mef_session(SESSION_STATE *session)
+{
+    si4 i;
+    
+    // channels can't be added or removed while this is running, so the list can be walked without the lock
+    for (i = 0; i < session->num_channels; i++)
+        wait_for_mef_channel(session->channels[i]);
+    
+    return 0;
+}
+
+// Waits until the ingest queue feeding a channel has written all of the channel's batches, and lets the channel go,
+// so it can be removed from the session.  Must not be called from an ingest writer.
+static void drain_mef_channel_ingest(CHANNEL_STATE *channel_state)
+{
+    MEF_INGEST_QUEUE *queue;
+    
+    queue = (MEF_INGEST_QUEUE *) channel_state->ingest_queue;
+    if (queue == NULL)
+        return;
+    
+    mef_mutex_lock(&queue->lock);
+    while (channel_state->ingest_pending > 0)
+        mef_cond_wait(&queue->batch_done, &queue->lock);
+    mef_mutex_unlock(&queue->lock);
+    
+    channel_state->ingest_queue = NULL;
+}
+
+// stops the ingest writers (after they write any queued batches) and frees their queues
+static void stop_mef_session_ingest(SESSION_STATE *session)
+{
+    MEF_INGEST_QUEUE *queue;
+    ui4 j;
+    si4 i;
+    
+    for (i = 0; i < session->num_ingest_queues; i++)
+    {
+        queue = &(session->ingest_queues[i]);
+        mef_mutex_lock(&queue->lock);
+        queue->shutting_down = 1;
+        mef_cond_broadcast(&queue->batch_ready);
+        mef_mutex_unlock(&queue->lock);
+        mef_thread_join(queue->writer);
+        
+        for (j = 0; j < queue->num_batches; j++)
+        {
+            free(queue->batches[j].packet_times);
+            free(queue->batches[j].samps);
+        }
+        free(queue->batches);
+        mef_cond_destroy(&queue->batch_ready);
+        mef_cond_destroy(&queue->batch_done);
+        mef_mutex_destroy(&queue->lock);
+    }
+    free(session->ingest_queues);
+    session->ingest_queues = NULL;
+    session->num_ingest_queues = 0;
+}
+
+// stops the worker threads (after they finish any queued blocks) and frees the session
+static void free_mef_session(SESSION_STATE *session)
+{
+    si4 i;
+    
+    // ingest writers feed the workers, so they go first
+    stop_mef_session_ingest(session);
+    
+    mef_mutex_lock(&session->lock);
+    session->shutting_down = 1;
+    mef_cond_broadcast(&session->work_available);
+    mef_mutex_unlock(&session->lock);
+    for (i = 0; i < session->num_workers; i++)
+        mef_thread_join(session->workers[i]);
+    
+    mef_cond_destroy(&session->work_available);
+    mef_cond_destroy(&session->work_done);
+    mef_mutex_destroy(&session->lock);
+    free(session->workers);
+    free(session->channels);
+    free(session);
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 remove_mef_session_channel(CHANNEL_STATE *channel_state)
+{
+    MEF_BLOCK_PIPELINE *pipeline;
+    SESSION_STATE *session;
+    si4 i, *current_buffer;
+    si8 samples_in_buffer;
+    
+    pipeline = (MEF_BLOCK_PIPELINE *) channel_state->pipeline;
+    if (pipeline == NULL)
+        return 0;
+    session = pipeline->session;
+    
+    drain_mef_channel_ingest(channel_state);
+    wait_for_mef_channel(channel_state);
+    
+    mef_mutex_lock(&session->lock);
+    for (i = 0; i < session->num_channels; i++)
+    {
+        if (session->channels[i] == channel_state)
+        {
+            session->channels[i] = session->channels[--session->num_channels];
+            break;
+        }
+    }
+    mef_mutex_unlock(&session->lock);
+    
+    // give the channel back its own buffer, keeping any samples not yet written
+    current_buffer = channel_state->raw_data_ptr_start;
+    samples_in_buffer = channel_state->raw_data_ptr_current - current_buffer;
+    if (current_buffer != pipeline->original_buffer)
+        memcpy(pipeline->original_buffer, current_buffer, (size_t) samples_in_buffer * sizeof(si4));
+    channel_state->raw_data_ptr_start = pipeline->original_buffer;
+    channel_state->raw_data_ptr_current = pipeline->original_buffer + samples_in_buffer;
+    
+    channel_state->session = NULL;
+    channel_state->pipeline = NULL;
+    
+    // the background thread of an asynchronous channel goes away with it
+    if (pipeline->private_session)
+        free_mef_session(session);
+    
+    for (i = 0; i < pipeline->num_buffers; i++)
+    {
+        if (pipeline->blocks[i].rps == NULL)
+            continue;
+        pipeline->blocks[i].rps->original_data = NULL;  // points into a raw buffer
+        RED_free_processing_struct(pipeline->blocks[i].rps);
+    }
+    free(pipeline);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_async_mode(CHANNEL_STATE *channel_state, si4 num_buffers)
+{
+    SESSION_STATE *session;
+    
+    // switching off asynchronous mode, or switching it on again with a different number of buffers
+    if (channel_state->pipeline != NULL)
+    {
+        if (!((MEF_BLOCK_PIPELINE *) channel_state->pipeline)->private_session)
+            return -1;  // channel belongs to a multi-channel session, which already encodes in the background
+        remove_mef_session_channel(channel_state);
+    }
+    
+    if (num_buffers < 2)
+        return 0;
+    
+    // an asynchronous channel is a session of its own, with one background thread
+    session = create_mef_session(1, num_buffers);
+    add_mef_session_channel(session, channel_state);
+    ((MEF_BLOCK_PIPELINE *) channel_state->pipeline)->private_session = 1;
+    
+    return 0;
+}
+
+/*************************************  END SESSION WRITER  *************************************/
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 initialize_meflib_dll()
+{
+    extern MEF_GLOBALS	*MEF_globals;
+    
+    (void)initialize_meflib();
+ 
+    MEF_globals->recording_time_offset_mode = RTO_IGNORE;  // turn off timestamp offsetting by default
+    
+    return 0;
+}
+
+// write_mef_channel_data(), for samples that are sample_stride apart in samps
+static si4 write_channel_samples(CHANNEL_STATE *channel_state,
+                                 ui8 *packet_times,
+                                 si4 *samps,
+                                 si8 sample_stride,
+                                 ui8 n_packets_to_process,
+                                 sf8 secs_per_block,
+                                 sf8 sampling_frequency)
+{
+    si4 *raw_data_ptr_start, *raw_data_ptr_current;
+    ui8 block_len, block_hdr_time, block_boundary;
+    ui8 last_chan_timestamp;
+    si4 discontinuity_flag;
+    si8 j, run_start, run_end, buffer_room;
+    si8 (*find_block_break)(ui8 *, si8, si8, ui8, si8);
+    si8 block_interval;
+    si4 buffer_full;
+    int chan_num;
+    
+    // fprintf(stderr, "in write_mef_channel_data()\n");
+    
+    chan_num          = channel_state->chan_num;
+    
+    // bring in data from channel_state struct
+    raw_data_ptr_start   = channel_state->raw_data_ptr_start;
+    raw_data_ptr_current = channel_state->raw_data_ptr_current;
+    block_hdr_time       = channel_state->block_hdr_time;
+    block_boundary       = channel_state->block_boundary;
+    last_chan_timestamp  = channel_state->last_chan_timestamp;
+    discontinuity_flag   = channel_state->discontinuity_flag;
+    block_interval       = channel_state->metadata_fps->metadata.time_series_section_2->block_interval;
+    if (channel_state->adaptive_blocks_enabled)
+        block_interval = channel_state->adaptive_interval_in_use;
+    
+    // this is updated everytime, although it should never change between calls.
+    // TBD add test to make sure it doesn't change?  This needs to be a parameter call because sometimes you don't
+    // know the correct sampling frequency until data acutally arrives
+    if (channel_state->metadata_fps->metadata.time_series_section_2->sampling_frequency != sampling_frequency)
+    {
+        // session workers use the metadata while blocks are queued, so let them finish first
+        wait_for_mef_channel(channel_state);
+        channel_state->metadata_fps->metadata.time_series_section_2->sampling_frequency = sampling_frequency;
+    }
+    
+    // set local constants
+    block_len = (ui8) ceil(secs_per_block * sampling_frequency); //user-defined block size (s), convert to # of samples
+    channel_state->block_len = block_len;
+    
+    // samples are copied in runs, one per block, so the copy can also find the block extrema.
+    // run_start is the first sample of this call that belongs to the block being filled.
+    find_block_break = get_sample_kernels()->find_block_break;
+    run_start = 0;
+    j = 0;
+    while (j < (si8) n_packets_to_process)
+    {
+        // set timestamp for the first block processed
+        if (block_hdr_time == 0)
+        {
+            // block_hdr_time is the actual time put into the block header (timestamp of the first
+            // block sample), while block_boundary is used only for calculation of which samples go
+            // into which blocks.  block_boundary is never written to the mef file.
+            block_hdr_time = packet_times[j];
+            block_boundary = packet_times[j];
+        }
+        
+        // samples left in the raw buffer, counting those of this call not copied yet
+        buffer_room = (si8) channel_state->raw_data_buffer_samples - (raw_data_ptr_current - raw_data_ptr_start) - (j - run_start);
+        buffer_full = (buffer_room <= 0);
+        
+        if ((llabs((((si8)(packet_times[j]) - (si8)last_chan_timestamp))) >= DISCONTINUITY_TIME_THRESHOLD) ||
+            (((si8)(packet_times[j]) - (si8)block_boundary) >= (si8)block_interval) || buffer_full)
+        {
+            // Block needs to be compressed and written
+            
+            // copy this call's part of the block
+            raw_data_ptr_current = append_block_samples(channel_state, raw_data_ptr_current, samps + (run_start * sample_stride), sample_stride, (ui8) (j - run_start));
+            run_start = j;
+            
+            // See if data exists in the buffer before processing it.  Data might not exist if
+            // this is the first sample we've processed so far.
+            if ((raw_data_ptr_current - raw_data_ptr_start) > 0)
+            {
+                // process block of previously collected data.  If the channel belongs to a session, the block is
+                // handed to a worker thread, and we continue in a different buffer.
+                raw_data_ptr_start = submit_filled_block(channel_state, raw_data_ptr_start, (raw_data_ptr_current - raw_data_ptr_start),
+                                                         block_len, discontinuity_flag, block_hdr_time, NULL, NULL, NULL);
+            }
+            
+            // mark next block as being discontinuous if discontinuity is found
+            if (llabs((((si8)(packet_times[j]) - (si8)last_chan_timestamp))) >= DISCONTINUITY_TIME_THRESHOLD)
+            {
+                discontinuity_flag = 1;
+                block_boundary = packet_times[j];
+            }
+            else if (buffer_full && ((si8)(packet_times[j]) - (si8)block_boundary) < (si8)block_interval)
+            {
+                // more samples than the buffer holds before the boundary (the sampling frequency is higher than the
+                // channel was set up for), so the rest of this block_interval goes in another block
+                discontinuity_flag = 0;
+            }
+            else
+            {
+                discontinuity_flag = 0;
+                block_boundary += block_interval;
+            }
+            
+            // set next block's timestamp
+            block_hdr_time = packet_times[j];
+            
+            // the next block is cut at the latest adaptive interval
+            if (channel_state->adaptive_blocks_enabled)
+                block_interval = channel_state->adaptive_interval_in_use;
+            
+            // move back to the beginning of the raw block
+            raw_data_ptr_current = raw_data_ptr_start;
+        }
+        
+        last_chan_timestamp = packet_times[j];
+        ++j;
+        
+        // skip over the packets that stay in this block, they only need to be copied.  The test above is only
+        // needed again at the next gap or block boundary.
+        if (block_hdr_time != 0 && j < (si8) n_packets_to_process)
+        {
+            // never past a full buffer
+            buffer_room = (si8) channel_state->raw_data_buffer_samples - (raw_data_ptr_current - raw_data_ptr_start) - (j - run_start);
+            run_end = (si8) n_packets_to_process;
+            if (j + buffer_room < run_end)
+                run_end = (buffer_room > 0) ? j + buffer_room : j;
+            run_end = find_block_break(packet_times, j, run_end, block_boundary, block_interval);
+            if (run_end > j)
+            {
+                last_chan_timestamp = packet_times[run_end - 1];
+                j = run_end;
+            }
+        }
+    }
+    
+    // the rest of the samples start the next block
+    raw_data_ptr_current = append_block_samples(channel_state, raw_data_ptr_current, samps + (run_start * sample_stride), sample_stride, (ui8) (n_packets_to_process - run_start));
+    
+    // save state of channel for next time
+    channel_state->raw_data_ptr_start   = raw_data_ptr_start;
+    channel_state->raw_data_ptr_current = raw_data_ptr_current;
+    channel_state->last_chan_timestamp  = last_chan_timestamp;
+    channel_state->block_hdr_time       = block_hdr_time;
+    channel_state->block_boundary       = block_boundary;
+    channel_state->discontinuity_flag   = discontinuity_flag;
+    
+    return(0);
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 write_mef_channel_data( CHANNEL_STATE *channel_state,
+                           ui8 *packet_times,
+                           si4 *samps,
+                           ui8 n_packets_to_process,
+                           sf8 secs_per_block,
+                           sf8 sampling_frequency)
+{
+    return write_channel_samples(channel_state, packet_times, samps, 1, n_packets_to_process, secs_per_block, sampling_frequency);
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 write_mef_channels_interleaved(CHANNEL_STATE **channel_states,
+                                   si4 num_channels,
+                                   ui8 *packet_times,
+                                   si4 *frames,
+                                   ui8 n_frames,
+                                   si8 frame_stride,
+                                   sf8 secs_per_block,
+                                   sf8 sampling_frequency)
+{
+    ui8 first_frame, chunk;
+    si4 i;
+    
+    if (num_channels < 1 || frame_stride < num_channels)
+        return -1;
+    
+    // the frames are scattered a chunk at a time, so the chunk (and its timestamps) stays in cache while each
+    // channel takes its column, rather than every channel streaming the whole buffer through the cache
+    for (first_frame = 0; first_frame < n_frames; first_frame += chunk)
+    {
+        chunk = n_frames - first_frame;
+        if (chunk > INTERLEAVED_FRAME_CHUNK)
+            chunk = INTERLEAVED_FRAME_CHUNK;
+        for (i = 0; i < num_channels; i++)
+            write_channel_samples(channel_states[i], packet_times + first_frame, frames + (first_frame * frame_stride) + i,
+                                  frame_stride, chunk, secs_per_block, sampling_frequency);
+    }
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 write_mef_channel_gap(CHANNEL_STATE *channel_state, ui8 next_sample_time)
+{
+    channel_state->regular_anchor_time = next_sample_time;
+    channel_state->regular_samples_since_anchor = 0;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 write_mef_channel_data_regular(CHANNEL_STATE *channel_state,
+                                   ui8 start_time,
+                                   si4 *samps,
+                                   ui8 n_samples,
+                                   sf8 secs_per_block,
+                                   sf8 sampling_frequency)
+{
+    ui8 packet_times[REGULAR_TIMESTAMP_CHUNK];
+    ui8 chunk, i, k;
+    sf8 usecs_per_sample;
+    
+    if (sampling_frequency <= 0.0)
+        return -1;
+    
+    // a new start time, or a new rate, starts a new clock; otherwise continue the previous one
+    if (start_time != 0)
+        write_mef_channel_gap(channel_state, start_time);
+    else if (channel_state->regular_sampling_frequency != sampling_frequency && channel_state->regular_anchor_time != 0)
+    {
+        // the next sample is due one old sample period after the last one
+        k = channel_state->regular_samples_since_anchor;
+        write_mef_channel_gap(channel_state, channel_state->regular_anchor_time +
+                              (ui8) ((((sf8) k * 1e6) / channel_state->regular_sampling_frequency) + 0.5));
+    }
+    if (channel_state->regular_anchor_time == 0)
+        return -1;  // no start time yet
+    channel_state->regular_sampling_frequency = sampling_frequency;
+    usecs_per_sample = 1e6 / sampling_frequency;
+    
+    // times are made a chunk at a time, in a buffer that stays in cache, from the sample count since the
+    // start of the clock, so rounding never accumulates
+    while (n_samples > 0)
+    {
+        chunk = (n_samples < REGULAR_TIMESTAMP_CHUNK) ? n_samples : REGULAR_TIMESTAMP_CHUNK;
+        k = channel_state->regular_samples_since_anchor;
+        for (i = 0; i < chunk; i++)
+            packet_times[i] = channel_state->regular_anchor_time + (ui8) (((sf8) (k + i) * usecs_per_sample) + 0.5);
+        
+        write_mef_channel_data(channel_state, packet_times, samps, chunk, secs_per_block, sampling_frequency);
+        
+        channel_state->regular_samples_since_anchor += chunk;
+        samps += chunk;
+        n_samples -= chunk;
+    }
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 write_mef_channel_block(CHANNEL_STATE *channel_state,
+                            ui8 block_start_time,
+                            si4 *samples,
+                            ui4 num_samples,
+                            sf8 sampling_frequency,
+                            si4 discontinuity,
+                            MEF_BLOCK_RELEASE release,
+                            void *release_context)
+{
+    TIME_SERIES_INDEX extrema;
+    si4 *raw_data_ptr_start;
+    si4 *external_samples;
+    
+    if (num_samples == 0 || num_samples > channel_state->raw_data_buffer_samples || sampling_frequency <= 0.0)
+        return -1;
+    
+    if (channel_state->metadata_fps->metadata.time_series_section_2->sampling_frequency != sampling_frequency)
+    {
+        // session workers use the metadata while blocks are queued, so let them finish first
+        wait_for_mef_channel(channel_state);
+        channel_state->metadata_fps->metadata.time_series_section_2->sampling_frequency = sampling_frequency;
+    }
+    
+    raw_data_ptr_start = channel_state->raw_data_ptr_start;
+    
+    // samples already given to write_mef_channel_data() go out first, as a block of their own
+    if ((channel_state->raw_data_ptr_current - raw_data_ptr_start) > 0)
+    {
+        raw_data_ptr_start = submit_filled_block(channel_state, raw_data_ptr_start, (channel_state->raw_data_ptr_current - raw_data_ptr_start),
+                                                 channel_state->block_len, channel_state->discontinuity_flag, channel_state->block_hdr_time,
+                                                 NULL, NULL, NULL);
+        channel_state->block_hdr_time = 0;
+        channel_state->discontinuity_flag = 0;
+    }
+    
+    // same rule as write_mef_channel_data(): the first block, the first block after a flush, and a block that starts
+    // DISCONTINUITY_TIME_THRESHOLD or more away from the last sample are discontinuous
+    if (channel_state->block_hdr_time == 0 && channel_state->discontinuity_flag == 1)
+        discontinuity = 1;
+    if (llabs((si8) block_start_time - (si8) channel_state->last_chan_timestamp) >= DISCONTINUITY_TIME_THRESHOLD)
+        discontinuity = 1;
+    discontinuity = (discontinuity != 0);
+    
+    if (channel_state->bit_shift_flag)
+    {
+        // the shift is done in place, so work on a copy in the channel's own buffer, and give the caller's memory back now
+        WRITER_STATS_TIME(channel_state, extrema_nsecs,
+            get_sample_kernels()->copy_with_extrema(raw_data_ptr_start, samples, (ui8) num_samples,
+                                                    &(channel_state->raw_data_minimum), &(channel_state->raw_data_maximum)));
+        if (release != NULL)
+            release(samples, release_context);
+        external_samples = NULL;
+        release = NULL;
+    }
+    else
+    {
+        WRITER_STATS_TIME(channel_state, extrema_nsecs, RED_find_extrema(samples, (si8) num_samples, &extrema));
+        channel_state->raw_data_minimum = extrema.minimum_sample_value;
+        channel_state->raw_data_maximum = extrema.maximum_sample_value;
+        external_samples = samples;
+    }
+    
+    raw_data_ptr_start = submit_filled_block(channel_state, raw_data_ptr_start, num_samples, (ui8) num_samples, discontinuity,
+                                             block_start_time, external_samples, release, release_context);
+    
+    // the next sample given to write_mef_channel_data() starts a new block, continuous with this one unless there is a gap
+    channel_state->raw_data_ptr_start   = raw_data_ptr_start;
+    channel_state->raw_data_ptr_current = raw_data_ptr_start;
+    channel_state->last_chan_timestamp  = block_start_time + (ui8) ((((sf8) (num_samples - 1) * 1e6) / sampling_frequency) + 0.5);
+    channel_state->block_hdr_time       = 0;
+    channel_state->block_boundary       = 0;
+    channel_state->discontinuity_flag   = 0;
+    if (channel_state->block_len == 0)
+        channel_state->block_len = num_samples;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 flush_mef_channel(CHANNEL_STATE *channel_state)
+{
+    si4 *raw_data_ptr_start, *raw_data_ptr_current;
+    ui8 block_len, block_hdr_time, block_boundary;
+    ui8 last_chan_timestamp;
+    si4 discontinuity_flag;
+    si8 block_interval;
+    
+    // blocks already handed to session workers must be written before this one
+    wait_for_mef_channel(channel_state);
+    
+    // bring in data from channel_state struct
+    raw_data_ptr_start = channel_state->raw_data_ptr_start;
+    raw_data_ptr_current = channel_state->raw_data_ptr_current;
+    block_hdr_time = channel_state->block_hdr_time;
+    block_boundary = channel_state->block_boundary;
+    last_chan_timestamp = channel_state->last_chan_timestamp;
+    discontinuity_flag = channel_state->discontinuity_flag;
+    block_interval = channel_state->metadata_fps->metadata.time_series_section_2->block_interval;
+    
+    // this tests for the case where no data has yet been given to this channel.
+    if (channel_state->block_len == 0)
+        return 0;
+    
+    // See if data exists in the buffer before processing it.
+    if ((raw_data_ptr_current - raw_data_ptr_start) > 0)
+    {
+        // process block of previously collected data
+        process_filled_block(channel_state, raw_data_ptr_start, (raw_data_ptr_current - raw_data_ptr_start),
+                             channel_state->block_len, discontinuity_flag, block_hdr_time,
+                             channel_state->raw_data_minimum, channel_state->raw_data_maximum);
+        reset_block_extrema(channel_state);
+    }
+    
+    // mark next block as being discontinuous
+    discontinuity_flag = 1;
+    
+    // set to zero so it will be reset next packet
+    block_boundary = 0;
+    block_hdr_time = 0;
+    
+    // move back to the beginning of the raw block
+    raw_data_ptr_current = raw_data_ptr_start;
+    
+    // save state of channel for next time
+    channel_state->raw_data_ptr_current = raw_data_ptr_current;
+    channel_state->last_chan_timestamp = last_chan_timestamp;
+    channel_state->block_hdr_time = block_hdr_time;
+    channel_state->block_boundary = block_boundary;
+    channel_state->discontinuity_flag = discontinuity_flag;
+    
+    return (0);
+}
+
+si4 check_for_new_segment(CHANNEL_STATE *channel_state, ui8 start_time)
+{
+    
+    FILE_PROCESSING_STRUCT  *ts_inds_fps;
+    FILE_PROCESSING_STRUCT  *ts_data_fps;
+    FILE_PROCESSING_STRUCT  *metadata_fps;
+    UNIVERSAL_HEADER *uh;
+    si1 segment_name[MEF_SEGMENT_BASE_FILE_NAME_BYTES];
+    si1 segment_path[MEF_FULL_FILE_NAME_BYTES];
+    TIME_SERIES_METADATA_SECTION_2	*md2;
+    si4 prepared;
+	extern MEF_GLOBALS	*MEF_globals;
+    WRITER_STATS_CLOCK(roll_start);
+    
+    // ignore this function if we're still writing the first block to the first segment
+    if (channel_state->next_segment_start_time == 0)
+        return(0);
+    
+	if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
+	{
+		if (start_time > channel_state->next_segment_start_time)
+			return(0);
+	}
+	else
+	{
+		if (start_time < channel_state->next_segment_start_time)
+			return(0);
+	}
+    
+    WRITER_STATS_START(roll_start);
+    
+    ts_inds_fps = channel_state->ts_inds_fps;
+    ts_data_fps = channel_state->ts_data_fps;
+    metadata_fps = channel_state->metadata_fps;
+    
+    // update and write segment metadata files as well as universal headers
+    update_metadata(channel_state);
+    
+    // close old segment files
+    remove_journal(channel_state);
+    release_mapped_file(channel_state, ts_data_fps, &channel_state->data_map);
+    release_mapped_file(channel_state, ts_inds_fps, &channel_state->inds_map);
+    fclose(ts_data_fps->fp);
+    fclose(ts_inds_fps->fp);
+    fclose(metadata_fps->fp);
+    
+    // take the files of a prepared segment (see prepare_next_segment()), otherwise set fp's to NULL, to force
+    // write_MEF_file() to do a new fopen()
+    prepared = channel_state->next_segment_prepared;
+    ts_data_fps->fp = channel_state->next_segment_data_fp;
+    ts_inds_fps->fp = channel_state->next_segment_inds_fp;
+    metadata_fps->fp = channel_state->next_segment_metadata_fp;
+#ifndef _WIN32
+    if (ts_data_fps->fp != NULL)
+        ts_data_fps->fd = fileno(ts_data_fps->fp);
+    if (ts_inds_fps->fp != NULL)
+        ts_inds_fps->fd = fileno(ts_inds_fps->fp);
+    if (metadata_fps->fp != NULL)
+        metadata_fps->fd = fileno(metadata_fps->fp);
+#else
+    if (ts_data_fps->fp != NULL)
+        ts_data_fps->fd = _fileno(ts_data_fps->fp);
+    if (ts_inds_fps->fp != NULL)
+        ts_inds_fps->fd = _fileno(ts_inds_fps->fp);
+    if (metadata_fps->fp != NULL)
+        metadata_fps->fd = _fileno(metadata_fps->fp);
+#endif
+    channel_state->next_segment_data_fp = channel_state->next_segment_inds_fp = channel_state->next_segment_metadata_fp = NULL;
+    channel_state->next_segment_prepared = 0;
+    
+    // deal with data file
+    uh = channel_state->ts_data_fps->universal_header;
+    uh->segment_number++;
+    generate_segment_name(ts_data_fps, segment_name);
+    // make mef3 segment directory
+    sprintf(segment_path, "%s/%s.%s", channel_state->channel_path, segment_name, SEGMENT_DIRECTORY_TYPE_STRING);
+    make_directory(segment_path);
+    // open new data file
+    MEF_snprintf(ts_data_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_DATA_FILE_TYPE_STRING);
+    // update headers
+    uh->start_time = start_time;
+    uh->end_time = start_time;  // this will get overwritten very quickly
+    uh->number_of_entries = 0;
+    uh->maximum_entry_size = 0;
+    if (prepared)
+    {
+        memcpy(uh->level_UUID, channel_state->next_segment_level_UUID, 16);
+        memcpy(uh->file_UUID, channel_state->next_segment_file_UUIDs[0], 16);
+    }
+    else
+    {
+        generate_UUID_thread_safe(uh->level_UUID);
+        generate_UUID_thread_safe(uh->file_UUID);
+    }
+    ts_data_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;
+    ts_data_fps->directives.close_file = MEF_FALSE;
+    write_MEF_file(channel_state->ts_data_fps);
+    channel_state->data_file_offset = UNIVERSAL_HEADER_BYTES;
+    ts_data_fps->universal_header->body_CRC = CRC_START_VALUE;
+    
+    
+    //deal with index file
+    uh = channel_state->ts_inds_fps->universal_header;
+    uh->segment_number++;
+    // open new inds file
+    MEF_snprintf(ts_inds_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_INDICES_FILE_TYPE_STRING);
+    // update headers
+    uh->start_time = start_time;
+    uh->end_time = start_time;  // this will get overwritten very quickly
+    uh->number_of_entries = 0;
+    uh->maximum_entry_size = TIME_SERIES_INDEX_BYTES;
+    memcpy(uh->level_UUID, ts_data_fps->universal_header->level_UUID, 16);
+    if (prepared)
+        memcpy(uh->file_UUID, channel_state->next_segment_file_UUIDs[1], 16);
+    else
+        generate_UUID_thread_safe(uh->file_UUID);
+    ts_inds_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;
+    ts_inds_fps->directives.close_file = MEF_FALSE;
+    write_MEF_file(channel_state->ts_inds_fps);
+    channel_state->inds_file_offset = UNIVERSAL_HEADER_BYTES;
+    ts_inds_fps->universal_header->body_CRC =  CRC_START_VALUE;
+    
+    //deal with metadata file
+    uh = channel_state->metadata_fps->universal_header;
+    uh->segment_number++;
+    // open new inds file
+    MEF_snprintf(metadata_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s", segment_path, segment_name, TIME_SERIES_METADATA_FILE_TYPE_STRING);
+    if (metadata_fps->fp == NULL)
+        fps_open(metadata_fps, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    // update headers
+    uh->body_CRC = CRC_START_VALUE;
     uh->start_time = start_time;
     uh->end_time = start_time;  // this will get overwritten very quickly
     uh->number_of_entries = 1;
     uh->maximum_entry_size = METADATA_FILE_BYTES;
     memcpy(uh->level_UUID, ts_data_fps->universal_header->level_UUID, 16);
-    generate_UUID(uh->file_UUID);
+    if (prepared)
+        memcpy(uh->file_UUID, channel_state->next_segment_file_UUIDs[2], 16);
+    else
+        generate_UUID_thread_safe(uh->file_UUID);
     md2 = channel_state->metadata_fps->metadata.time_series_section_2;
     md2->recording_duration = METADATA_RECORDING_DURATION_NO_ENTRY;
     md2->maximum_native_sample_value = TIME_SERIES_METADATA_MAXIMUM_NATIVE_SAMPLE_VALUE_NO_ENTRY;  // must test against NaN later on
@@ -1233,69 +4011,758 @@ si4 check_for_new_segment(CHANNEL_STATE *channel_state, ui8 start_time)
     channel_state->discont_contiguous_blocks = 0;
     channel_state->discont_contiguous_samples = 0;
     channel_state->discont_contiguous_bytes = 0;
+    write_resume_state(channel_state);
+    open_journal(channel_state);
+    // the metadata was just rewritten, so start counting towards the next checkpoint
+    channel_state->blocks_since_checkpoint = 0;
+    channel_state->last_checkpoint_time = 0;
     // TBD are these fields still necessary?
     channel_state->number_of_index_entries = 0;
     channel_state->number_of_samples = 0;
     channel_state->start_sample = 0;
     
+    WRITER_STATS_STOP(channel_state, segment_roll_nsecs, roll_start);
+    WRITER_STATS_ADD(channel_state, segment_rolls, 1);
+    
+    return(0);
+}
+
+
+#ifdef _EXPORT_FOR_DLL
+// just a wrapper for update_metadata, since it needs to be called locally as
+// well as exported to dll interface.
+__declspec (dllexport) si4 update_metadata_dll(CHANNEL_STATE *channel_state)
+{
+    return update_metadata(channel_state);
+}
+#endif
+
+// Encrypt a section of a metadata image that is marked decrypted (flag negative), and mark it encrypted
+static void encrypt_metadata_section(CHANNEL_STATE *channel_state, ui1 *section, si8 section_bytes, si1 *encryption_flag)
+{
+    ui1 *key;
+    si8 i;
+    
+    if (*encryption_flag >= NO_ENCRYPTION)
+        return;
+    
+    key = (*encryption_flag == LEVEL_1_ENCRYPTION_DECRYPTED) ? channel_state->pwd->level_1_encryption_key : channel_state->pwd->level_2_encryption_key;
+    for (i = 0; i < section_bytes; i += ENCRYPTION_BLOCK_BYTES)
+        AES_encrypt(section + i, section + i, NULL, key);
+    *encryption_flag = -*encryption_flag;
+}
+
+// Writes the metadata file of a channel with encrypted metadata.  write_MEF_file() encrypts sections 2 and 3 of
+// metadata_fps in place, so each checkpoint used to encrypt and then decrypt both sections.  Here the file is made
+// in metadata_image and metadata_fps stays decrypted.  Section 3 only changes with the first block, so its
+// encryption is kept and only redone if its plaintext (kept after the image) differs.  Returns -1, having done
+// nothing, if the metadata isn't encrypted or the file isn't open yet, which is left to write_MEF_file().
+static si4 write_encrypted_metadata(CHANNEL_STATE *channel_state)
+{
+    FILE_PROCESSING_STRUCT *metadata_fps;
+    METADATA_SECTION_1 *section_1, *image_section_1;
+    UNIVERSAL_HEADER *image_uh;
+    ui1 *image, *section_3_plaintext;
+    
+    metadata_fps = channel_state->metadata_fps;
+    section_1 = metadata_fps->metadata.section_1;
+    if (channel_state->pwd == NULL || metadata_fps->fp == NULL ||
+        section_1->section_2_encryption > NO_ENCRYPTION || section_1->section_3_encryption > NO_ENCRYPTION ||
+        (section_1->section_2_encryption == NO_ENCRYPTION && section_1->section_3_encryption == NO_ENCRYPTION))
+        return -1;
+    
+    if (channel_state->metadata_image == NULL)
+    {
+        channel_state->metadata_image = (ui1 *) malloc((size_t) (METADATA_FILE_BYTES + METADATA_SECTION_3_BYTES));
+        if (channel_state->metadata_image == NULL)
+        {
+            fprintf(stderr, "Insufficient memory for metadata\n");
+            exit(1);
+        }
+        channel_state->metadata_section_3_cached = 0;
+    }
+    image = channel_state->metadata_image;
+    section_3_plaintext = image + METADATA_FILE_BYTES;
+    image_uh = (UNIVERSAL_HEADER *) image;
+    image_section_1 = (METADATA_SECTION_1 *) (image + ((ui1 *) section_1 - metadata_fps->raw_data));
+    
+    // universal header, section 1 and section 2
+    memcpy(image, metadata_fps->raw_data, (size_t) METADATA_SECTION_3_OFFSET);
+    encrypt_metadata_section(channel_state, image + METADATA_SECTION_2_OFFSET, METADATA_SECTION_2_BYTES, &image_section_1->section_2_encryption);
+    
+    // section 3
+    if (section_1->section_3_encryption == NO_ENCRYPTION)
+        memcpy(image + METADATA_SECTION_3_OFFSET, metadata_fps->raw_data + METADATA_SECTION_3_OFFSET, (size_t) METADATA_SECTION_3_BYTES);
+    else if (!channel_state->metadata_section_3_cached ||
+             memcmp(section_3_plaintext, metadata_fps->raw_data + METADATA_SECTION_3_OFFSET, (size_t) METADATA_SECTION_3_BYTES))
+    {
+        memcpy(section_3_plaintext, metadata_fps->raw_data + METADATA_SECTION_3_OFFSET, (size_t) METADATA_SECTION_3_BYTES);
+        memcpy(image + METADATA_SECTION_3_OFFSET, section_3_plaintext, (size_t) METADATA_SECTION_3_BYTES);
+        encrypt_metadata_section(channel_state, image + METADATA_SECTION_3_OFFSET, METADATA_SECTION_3_BYTES, &image_section_1->section_3_encryption);
+        channel_state->metadata_section_3_cached = 1;
+    }
+    image_section_1->section_3_encryption = (si1) abs(section_1->section_3_encryption);
+    
+    // CRCs of the file as written; the universal header of metadata_fps gets them too, as write_MEF_file() leaves it
+    image_uh->body_CRC = mef_crc_calculate(image + UNIVERSAL_HEADER_BYTES, METADATA_FILE_BYTES - UNIVERSAL_HEADER_BYTES);
+    image_uh->header_CRC = mef_crc_calculate(image + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
+    memcpy(metadata_fps->raw_data, image, (size_t) UNIVERSAL_HEADER_BYTES);
+    
+    e_fseek(metadata_fps->fp, 0, SEEK_SET, metadata_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    (void) e_fwrite(image, sizeof(ui1), (size_t) METADATA_FILE_BYTES, metadata_fps->fp, metadata_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    
+    return 0;
+}
+
+si4 update_metadata(CHANNEL_STATE *channel_state)
+{
+    
+    extern MEF_GLOBALS	*MEF_globals;
+    int rewriting_metadata = 1;
+    si1 *mode;
+    struct stat	sb;
+    WRITER_STATS_CLOCK(metadata_start);
+    
+    WRITER_STATS_START(metadata_start);
+    
+    // write staged blocks and buffered index entries, so the headers below match the data and index files
+    write_data_batch(channel_state);
+    write_index_batch(channel_state);
+    
+    // rewrite metadata file
+    channel_state->metadata_fps->directives.close_file = MEF_FALSE;
+    if (write_encrypted_metadata(channel_state) != 0)
+    {
+        // this fseek might not be necessary, but it shouldn't hurt anything
+        if (channel_state->metadata_fps->fp != NULL)
+            e_fseek(channel_state->metadata_fps->fp, 0, SEEK_SET, channel_state->metadata_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+        write_MEF_file(channel_state->metadata_fps);
+        // decrypt if necessary, because write_MEF_file() encrypts if necessary
+        // the "necessary" part is automatic in both cases
+        decrypt_metadata(channel_state->metadata_fps);
+    }
+    
+    
+    // re-calculate header CRC for index and data files.  Body CRCs for both files should already be up-to-date.
+    channel_state->ts_inds_fps->universal_header->header_CRC = mef_crc_calculate(channel_state->ts_inds_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
+    channel_state->ts_data_fps->universal_header->header_CRC = mef_crc_calculate(channel_state->ts_data_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
+    
+    // re-write data and index universal headers, without losing our place in either file.  Mapped files just get
+    // the new header stored at the start of the mapping.
+    if (channel_state->data_map.base != NULL)
+    {
+        memcpy(channel_state->data_map.base, channel_state->ts_data_fps->universal_header, (size_t) UNIVERSAL_HEADER_BYTES);
+        sync_mapped_file(channel_state, &channel_state->data_map);
+    }
+    else
+        rewrite_universal_header(channel_state->ts_data_fps, channel_state->data_file_offset);
+    if (channel_state->inds_map.base != NULL)
+    {
+        memcpy(channel_state->inds_map.base, channel_state->ts_inds_fps->universal_header, (size_t) UNIVERSAL_HEADER_BYTES);
+        sync_mapped_file(channel_state, &channel_state->inds_map);
+    }
+    else
+        rewrite_universal_header(channel_state->ts_inds_fps, channel_state->inds_file_offset);
+    
+    WRITER_STATS_STOP(channel_state, metadata_nsecs, metadata_start);
+    WRITER_STATS_ADD(channel_state, metadata_updates, 1);
+    WRITER_STATS_REPORT(channel_state);
+    
+    // fprintf(stderr, "done update_metadata()\n");
+    
     return(0);
 }
 
-
 #ifdef _EXPORT_FOR_DLL
-// just a wrapper for update_metadata, since it needs to be called locally as
-// well as exported to dll interface.
-__declspec (dllexport) si4 update_metadata_dll(CHANNEL_STATE *channel_state)
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_checkpoint_policy(CHANNEL_STATE *channel_state, si4 checkpoint_mode, ui8 every_n_blocks, sf8 every_t_seconds)
+{
+    switch (checkpoint_mode)
+    {
+        case CHECKPOINT_EVERY_N_BLOCKS:
+            if (every_n_blocks == 0)
+                return -1;
+            break;
+        case CHECKPOINT_EVERY_T_SECONDS:
+            if (every_t_seconds <= 0.0)
+                return -1;
+            break;
+        case CHECKPOINT_ON_CLOSE:
+            break;
+        default:
+            return -1;
+    }
+    
+    // blocks queued for a session worker use the policy that is current when they are processed
+    wait_for_mef_channel(channel_state);
+    
+    channel_state->checkpoint_mode = checkpoint_mode;
+    channel_state->checkpoint_interval_blocks = every_n_blocks;
+    channel_state->checkpoint_interval_usecs = (si8) ((every_t_seconds * 1e6) + 0.5);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 checkpoint_mef_channel(CHANNEL_STATE *channel_state)
+{
+    // this doesn't write the partially filled block, use flush_mef_channel() first for that
+    wait_for_mef_channel(channel_state);
+    
+    // nothing written yet
+    if (channel_state->metadata_fps->universal_header->start_time == UNIVERSAL_HEADER_START_TIME_NO_ENTRY)
+        return 0;
+    
+    update_metadata(channel_state);
+    channel_state->blocks_since_checkpoint = 0;
+    
+    // a new channel is listed in the .mefd file
+    flush_channel_mefd_file(channel_state);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_index_batch_size(CHANNEL_STATE *channel_state, ui4 max_entries)
+{
+    ui1 *new_batch;
+    
+    if (max_entries == 0)
+        return -1;
+    
+    // session workers add entries to the batch
+    wait_for_mef_channel(channel_state);
+    
+    new_batch = (ui1*) calloc(sizeof(ui1), (size_t) max_entries * TIME_SERIES_INDEX_BYTES);
+    if (new_batch == NULL) {
+        fprintf(stderr, "Insufficient memory to allocate index batch\n");
+        exit(1);
+    }
+    
+    // entries are written now rather than copied, the index header catches up at the next checkpoint
+    write_index_batch(channel_state);
+    
+    if (!in_channel_arena(channel_state, channel_state->temp_time_series_index))
+        free(channel_state->temp_time_series_index);
+    channel_state->temp_time_series_index = new_batch;
+    channel_state->index_batch_max_entries = max_entries;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_data_batch_size(CHANNEL_STATE *channel_state, ui8 max_bytes)
+{
+    ui1 *new_batch;
+    
+    // session workers add blocks to the batch
+    wait_for_mef_channel(channel_state);
+    
+    new_batch = NULL;
+    if (max_bytes > 0) {
+        new_batch = (ui1*) malloc((size_t) max_bytes);
+        if (new_batch == NULL) {
+            fprintf(stderr, "Insufficient memory to allocate data batch\n");
+            exit(1);
+        }
+    }
+    
+    write_data_batch(channel_state);
+    
+    if (!in_channel_arena(channel_state, channel_state->data_batch))
+        free(channel_state->data_batch);
+    channel_state->data_batch = new_batch;
+    channel_state->data_batch_max_bytes = max_bytes;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_statistics(CHANNEL_STATE *channel_state, si4 enabled)
+{
+    channel_state->statistics_enabled = (enabled != 0);
+    channel_state->statistics_number_of_samples = 0;
+    channel_state->statistics_sum = 0.0;
+    channel_state->statistics_sum_of_squares = 0.0;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 get_mef_channel_statistics(CHANNEL_STATE *channel_state, ui8 *number_of_samples, sf8 *mean, sf8 *rms)
+{
+    sf8 scale, n;
+    
+    *number_of_samples = channel_state->statistics_number_of_samples;
+    if (channel_state->statistics_number_of_samples == 0)
+    {
+        *mean = *rms = 0.0;
+        return -1;
+    }
+    
+    // samples are counted as they are passed in, before any bit shift
+    scale = channel_state->metadata_fps->metadata.time_series_section_2->units_conversion_factor;
+    if (channel_state->bit_shift_flag)
+        scale /= 4.0;
+    n = (sf8) channel_state->statistics_number_of_samples;
+    *mean = (channel_state->statistics_sum / n) * scale;
+    *rms = sqrt(channel_state->statistics_sum_of_squares / n) * fabs(scale);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 get_mef_channel_writer_stats(CHANNEL_STATE *channel_state, MEF_WRITER_STATS *stats)
+{
+#ifdef MEF_ENABLE_WRITER_STATS
+    *stats = channel_state->writer_stats;
+    return 0;
+#else
+    memset(stats, 0, sizeof(MEF_WRITER_STATS));
+    return -1;
+#endif
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 get_mef_session_writer_stats(SESSION_STATE *session, MEF_WRITER_STATS *stats)
+{
+#ifdef MEF_ENABLE_WRITER_STATS
+    MEF_WRITER_STATS *channel_stats;
+    si4 i;
+    
+    memset(stats, 0, sizeof(MEF_WRITER_STATS));
+    mef_mutex_lock(&session->lock);
+    for (i = 0; i < session->num_channels; i++)
+    {
+        channel_stats = &session->channels[i]->writer_stats;
+        stats->blocks_encoded += channel_stats->blocks_encoded;
+        stats->samples_encoded += channel_stats->samples_encoded;
+        stats->bytes_written += channel_stats->bytes_written;
+        stats->writes += channel_stats->writes;
+        stats->metadata_updates += channel_stats->metadata_updates;
+        stats->segment_rolls += channel_stats->segment_rolls;
+        stats->encode_nsecs += channel_stats->encode_nsecs;
+        stats->extrema_nsecs += channel_stats->extrema_nsecs;
+        stats->crc_nsecs += channel_stats->crc_nsecs;
+        stats->write_nsecs += channel_stats->write_nsecs;
+        stats->metadata_nsecs += channel_stats->metadata_nsecs;
+        stats->segment_roll_nsecs += channel_stats->segment_roll_nsecs;
+    }
+    mef_mutex_unlock(&session->lock);
+    
+    return 0;
+#else
+    memset(stats, 0, sizeof(MEF_WRITER_STATS));
+    return -1;
+#endif
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 reset_mef_channel_writer_stats(CHANNEL_STATE *channel_state)
+{
+    memset(&channel_state->writer_stats, 0, sizeof(MEF_WRITER_STATS));
+    
+#ifdef MEF_ENABLE_WRITER_STATS
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_writer_stats_callback(CHANNEL_STATE *channel_state, MEF_WRITER_STATS_CALLBACK callback, void *callback_context)
+{
+    channel_state->writer_stats_callback = callback;
+    channel_state->writer_stats_context = callback_context;
+    
+#ifdef MEF_ENABLE_WRITER_STATS
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_adaptive_blocks(CHANNEL_STATE *channel_state, si4 enabled, sf8 min_secs_per_block)
+{
+    TIME_SERIES_METADATA_SECTION_2 *md2;
+    si8 interval;
+    
+    md2 = channel_state->metadata_fps->metadata.time_series_section_2;
+    if (enabled && (min_secs_per_block <= 0.0 || (si8) (min_secs_per_block * 1e6) >= md2->block_interval))
+        return -1;
+    
+    // queued blocks are still using the adaptive fields
+    wait_for_mef_channel(channel_state);
+    
+    channel_state->adaptive_blocks_enabled = (enabled != 0);
+    if (!enabled)
+        return 0;
+    
+    channel_state->adaptive_min_interval = (si8) (min_secs_per_block * 1e6);
+    channel_state->adaptive_max_interval = md2->block_interval;
+    interval = (si8) (((sf8) ADAPTIVE_TARGET_BLOCK_SAMPLES / md2->sampling_frequency) * 1e6);
+    if (interval > channel_state->adaptive_max_interval)
+        interval = channel_state->adaptive_max_interval;
+    if (interval < channel_state->adaptive_min_interval)
+        interval = channel_state->adaptive_min_interval;
+    channel_state->adaptive_interval_in_use = interval;
+    channel_state->adaptive_interval_next = interval;
+    channel_state->adaptive_interval_ready = interval;
+    channel_state->adaptive_window_blocks = 0;
+    channel_state->adaptive_window_samples = 0;
+    channel_state->adaptive_window_bytes = 0;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_block_encryption(CHANNEL_STATE *channel_state, si4 level)
+{
+    if (level != NO_ENCRYPTION && level != LEVEL_1_ENCRYPTION && level != LEVEL_2_ENCRYPTION)
+        return -1;
+    if (level != NO_ENCRYPTION && (channel_state->pwd == NULL || channel_state->pwd->access_level < level))
+        return -1;
+    
+    // queued blocks are encoded with the directives as they were
+    wait_for_mef_channel(channel_state);
+    channel_state->rps->directives.encryption_level = (si1) level;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_offline_mode(CHANNEL_STATE *channel_state, si4 enabled)
+{
+    wait_for_mef_channel(channel_state);
+    
+    channel_state->offline_mode = enabled ? 1 : 0;
+    if (enabled)
+    {
+        set_mef_channel_checkpoint_policy(channel_state, CHECKPOINT_ON_CLOSE, 0, 0.0);
+        set_mef_channel_data_batch_size(channel_state, OFFLINE_DATA_BATCH_BYTES);
+        set_mef_channel_index_batch_size(channel_state, OFFLINE_INDEX_BATCH_ENTRIES);
+    }
+    else
+    {
+        set_mef_channel_checkpoint_policy(channel_state, CHECKPOINT_EVERY_N_BLOCKS, 1, 0.0);
+        set_mef_channel_data_batch_size(channel_state, DEFAULT_DATA_BATCH_BYTES);
+        set_mef_channel_index_batch_size(channel_state, DEFAULT_INDEX_BATCH_ENTRIES);
+    }
+    if (channel_state->pipeline != NULL)
+        set_pipeline_parallel_encode((MEF_BLOCK_PIPELINE *) channel_state->pipeline, channel_state->offline_mode);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_segment_preopen(CHANNEL_STATE *channel_state, si4 enabled)
+{
+    // session workers prepare segments while processing blocks
+    wait_for_mef_channel(channel_state);
+    
+    channel_state->segment_preopen_enabled = (enabled != 0);
+    if (!channel_state->segment_preopen_enabled)
+        discard_next_segment(channel_state);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_mapped_io(CHANNEL_STATE *channel_state, si4 enabled, ui8 extent_bytes, si4 sync_mode)
+{
+#ifndef _WIN32
+    if (sync_mode != MAPPED_SYNC_NONE && sync_mode != MAPPED_SYNC_ASYNC && sync_mode != MAPPED_SYNC_WAIT)
+        return -1;
+    
+    // session workers write the files
+    wait_for_mef_channel(channel_state);
+    
+    // the current mappings are released, and new ones made with the new extent size at the next write
+    release_mapped_file(channel_state, channel_state->ts_data_fps, &channel_state->data_map);
+    release_mapped_file(channel_state, channel_state->ts_inds_fps, &channel_state->inds_map);
+    
+    channel_state->mapped_io_enabled = (enabled != 0);
+    channel_state->mapped_extent_bytes = (extent_bytes > 0) ? extent_bytes : DEFAULT_MAPPED_EXTENT_BYTES;
+    channel_state->mapped_sync_mode = sync_mode;
+    
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 set_mef_channel_journal(CHANNEL_STATE *channel_state, si4 enabled)
 {
-    return update_metadata(channel_state);
+    // session workers write the files
+    wait_for_mef_channel(channel_state);
+    
+    channel_state->journal_enabled = (enabled != 0);
+    if (channel_state->journal_enabled)
+    {
+        open_journal(channel_state);
+        if (channel_state->journal_fp == NULL)
+        {
+            channel_state->journal_enabled = 0;
+            return -1;
+        }
+        // describe what is already in the files, so the journal is never behind them
+        if (channel_state->ts_data_fps->universal_header->number_of_entries > 0)
+        {
+            update_metadata(channel_state);
+            channel_state->blocks_since_checkpoint = 0;
+            commit_journal(channel_state);
+        }
+    }
+    // turning the journal off leaves the segment exactly as safe as it would be without one
+    else
+        remove_journal(channel_state);
+    
+    return 0;
 }
+
+// Sets a segment file's length, without closing it
+static si4 truncate_segment_file(FILE *fp, si8 file_bytes)
+{
+    fflush(fp);
+#ifdef _WIN32
+    if (_chsize_s(_fileno(fp), (__int64) file_bytes) != 0)
+        return -1;
+#else
+    if (ftruncate(fileno(fp), (off_t) file_bytes) != 0)
+        return -1;
 #endif
+    return 0;
+}
 
-si4 update_metadata(CHANNEL_STATE *channel_state)
+// Brings the universal header of a data or index file into line with a journal entry, and cuts off blocks
+// the journal doesn't cover
+static si4 recover_segment_file(si1 *file_name, MEF_JOURNAL_ENTRY *entry, si8 file_bytes, ui4 body_CRC, si8 maximum_entry_size)
 {
+    FILE *fp;
+    UNIVERSAL_HEADER uh;
+    struct stat sb;
     
-    extern MEF_GLOBALS	*MEF_globals;
-    int rewriting_metadata = 1;
-    si1 *mode;
-    struct stat	sb;
+    fp = fopen(file_name, "r+b");
+    if (fp == NULL)
+        return -1;
+    // a file shorter than the journal says lost blocks it was told about, and can't be fixed from the journal
+    if (fstat(fileno(fp), &sb) != 0 || (si8) sb.st_size < file_bytes ||
+        fread(&uh, (size_t) UNIVERSAL_HEADER_BYTES, (size_t) 1, fp) != 1)
+    {
+        fclose(fp);
+        return -1;
+    }
     
-    // rewrite metadata file
-    channel_state->metadata_fps->directives.close_file = MEF_FALSE;
-    // this fseek might not be necessary, but it shouldn't hurt anything
-    if (channel_state->metadata_fps->fp != NULL)
-        e_fseek(channel_state->metadata_fps->fp, 0, SEEK_SET, channel_state->metadata_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    write_MEF_file(channel_state->metadata_fps);
-    // decrypt if necessary, because write_MEF_file() encrypts if necessary
-    // the "necessary" part is automatic in both cases
-    decrypt_metadata(channel_state->metadata_fps);
+    uh.number_of_entries = entry->number_of_entries;
+    uh.maximum_entry_size = maximum_entry_size;
+    uh.start_time = entry->start_time;
+    uh.end_time = entry->end_time;
+    uh.body_CRC = body_CRC;
+    uh.header_CRC = mef_crc_calculate((ui1 *) &uh + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
     
+    fseek(fp, 0, SEEK_SET);
+    if (fwrite(&uh, (size_t) UNIVERSAL_HEADER_BYTES, (size_t) 1, fp) != 1 || truncate_segment_file(fp, file_bytes) != 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
     
-    // re-calculate header CRC for index and data files.  Body CRCs for both files should already be up-to-date.
-    channel_state->ts_inds_fps->universal_header->header_CRC = CRC_calculate(channel_state->ts_inds_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
-    channel_state->ts_data_fps->universal_header->header_CRC = CRC_calculate(channel_state->ts_data_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 recover_mef_segment(si1 *segment_path, si1 *password)
+{
+    MEF_JOURNAL_ENTRY entry;
+    FILE_PROCESSING_STRUCT *metadata_fps;
+    TIME_SERIES_METADATA_SECTION_2 *md2;
+    FILE *journal_fp;
+    si1 path[MEF_FULL_FILE_NAME_BYTES], name[MEF_BASE_FILE_NAME_BYTES], extension[TYPE_BYTES];
+    si1 base_name[MEF_FULL_FILE_NAME_BYTES];
+    si1 journal_name[MEF_FULL_FILE_NAME_BYTES], file_name[MEF_FULL_FILE_NAME_BYTES];
+    ui1 *key;
+    si8 journal_bytes, offset;
+    si4 found, i;
+    
+    // <segment_path>/<segment name>.<type>
+    extract_path_parts(segment_path, path, name, extension);
+    MEF_snprintf(base_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s.%s/%s", path, name, extension, name);
+    
+    MEF_snprintf(journal_name, MEF_FULL_FILE_NAME_BYTES, "%s.%s", base_name, JOURNAL_FILE_TYPE_STRING);
+    journal_fp = fopen(journal_name, "rb");
+    if (journal_fp == NULL)
+        return 0;  // the segment was finished normally
+    
+    // the last entry wins, an entry cut short by the crash is skipped
+    found = 0;
+    fseek(journal_fp, 0, SEEK_END);
+    journal_bytes = (si8) ftell(journal_fp);
+    for (offset = (journal_bytes / (si8) sizeof(MEF_JOURNAL_ENTRY) - 1) * (si8) sizeof(MEF_JOURNAL_ENTRY); offset >= 0; offset -= (si8) sizeof(MEF_JOURNAL_ENTRY))
+    {
+        fseek(journal_fp, (long) offset, SEEK_SET);
+        if (fread(&entry, sizeof(MEF_JOURNAL_ENTRY), (size_t) 1, journal_fp) != 1)
+            continue;
+        if (entry.CRC == mef_crc_calculate((ui1 *) &entry + CRC_BYTES, (si8) sizeof(MEF_JOURNAL_ENTRY) - CRC_BYTES))
+        {
+            found = 1;
+            break;
+        }
+    }
+    fclose(journal_fp);
+    if (!found)
+        return -1;
+    
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s.%s", base_name, TIME_SERIES_METADATA_FILE_TYPE_STRING);
+    metadata_fps = read_MEF_file(NULL, file_name, password, NULL, NULL, USE_GLOBAL_BEHAVIOR);
+    if (metadata_fps == NULL)
+        return -1;
+    if (metadata_fps->fp != NULL)
+    {
+        fclose(metadata_fps->fp);
+        metadata_fps->fp = NULL;
+    }
     
-    // re-write data universal header and then go back to where we were
-    e_fseek(channel_state->ts_data_fps->fp, 0, SEEK_SET, channel_state->ts_data_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    (void)e_fwrite(channel_state->ts_data_fps->universal_header, sizeof(UNIVERSAL_HEADER), (size_t)1, channel_state->ts_data_fps->fp, channel_state->ts_data_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    e_fseek(channel_state->ts_data_fps->fp, channel_state->data_file_offset, SEEK_SET, channel_state->ts_data_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    if (entry.encryption != NO_ENCRYPTION)
+    {
+        if (metadata_fps->password_data == NULL || metadata_fps->password_data->access_level < entry.encryption)
+        {
+            free_file_processing_struct(metadata_fps);
+            return -1;
+        }
+        key = (entry.encryption == LEVEL_1_ENCRYPTION) ? metadata_fps->password_data->level_1_encryption_key : metadata_fps->password_data->level_2_encryption_key;
+        for (i = 0; i < (si4) sizeof(MEF_JOURNAL_METADATA); i += 16)
+            AES_decrypt((ui1 *) &entry.metadata + i, (ui1 *) &entry.metadata + i, NULL, key);
+    }
     
-    // re-write index universal header and then go back to where we were
-    e_fseek(channel_state->ts_inds_fps->fp, 0, SEEK_SET, channel_state->ts_inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    (void)e_fwrite(channel_state->ts_inds_fps->universal_header, sizeof(UNIVERSAL_HEADER), (size_t)1, channel_state->ts_inds_fps->fp, channel_state->ts_inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    e_fseek(channel_state->ts_inds_fps->fp, channel_state->inds_file_offset, SEEK_SET, channel_state->ts_inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    // data and index files first, so a second crash during recovery still leaves the journal to recover from
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s.%s", base_name, TIME_SERIES_DATA_FILE_TYPE_STRING);
+    if (recover_segment_file(file_name, &entry, entry.data_file_bytes, entry.data_body_CRC, entry.maximum_entry_size) != 0)
+    {
+        free_file_processing_struct(metadata_fps);
+        return -1;
+    }
+    MEF_snprintf(file_name, MEF_FULL_FILE_NAME_BYTES, "%s.%s", base_name, TIME_SERIES_INDICES_FILE_TYPE_STRING);
+    if (recover_segment_file(file_name, &entry, entry.index_file_bytes, entry.index_body_CRC, TIME_SERIES_INDEX_BYTES) != 0)
+    {
+        free_file_processing_struct(metadata_fps);
+        return -1;
+    }
     
-    // fprintf(stderr, "done update_metadata()\n");
+    md2 = metadata_fps->metadata.time_series_section_2;
+    md2->recording_duration = entry.metadata.recording_duration;
+    md2->number_of_samples = entry.metadata.number_of_samples;
+    md2->number_of_blocks = entry.metadata.number_of_blocks;
+    md2->maximum_block_bytes = entry.metadata.maximum_block_bytes;
+    md2->number_of_discontinuities = entry.metadata.number_of_discontinuities;
+    md2->maximum_contiguous_blocks = entry.metadata.maximum_contiguous_blocks;
+    md2->maximum_contiguous_block_bytes = entry.metadata.maximum_contiguous_block_bytes;
+    md2->maximum_contiguous_samples = entry.metadata.maximum_contiguous_samples;
+    md2->maximum_native_sample_value = entry.metadata.maximum_native_sample_value;
+    md2->minimum_native_sample_value = entry.metadata.minimum_native_sample_value;
+    md2->maximum_block_samples = entry.metadata.maximum_block_samples;
+    md2->maximum_difference_bytes = entry.metadata.maximum_difference_bytes;
+    metadata_fps->universal_header->start_time = entry.start_time;
+    metadata_fps->universal_header->end_time = entry.end_time;
+    
+    // write_MEF_file() encrypts and CRCs the metadata again
+    metadata_fps->fp = fopen(metadata_fps->full_file_name, "r+b");
+    if (metadata_fps->fp == NULL)
+    {
+        free_file_processing_struct(metadata_fps);
+        return -1;
+    }
+    metadata_fps->fd = fileno(metadata_fps->fp);
+    metadata_fps->directives.close_file = MEF_TRUE;
+    metadata_fps->directives.io_bytes = FPS_FULL_FILE;
+    write_MEF_file(metadata_fps);
+    metadata_fps->fp = NULL;
+    free_file_processing_struct(metadata_fps);
     
-    return(0);
+    remove(journal_name);
+    
+    return 0;
 }
 
+// Frees the channel's file processing structs.  Their password data is shared with other channels (see
+// cached_password_data()), so it stays.
+static void free_channel_file_structs(CHANNEL_STATE *channel_state)
+{
+    FILE_PROCESSING_STRUCT **fps[4];
+    si4 i;
+    
+    fps[0] = &channel_state->gen_fps;
+    fps[1] = &channel_state->ts_inds_fps;
+    fps[2] = &channel_state->metadata_fps;
+    fps[3] = &channel_state->ts_data_fps;
+    for (i = 0; i < 4; i++)
+    {
+        if (*fps[i] == NULL)
+            continue;
+        (*fps[i])->password_data = NULL;
+        free_file_processing_struct(*fps[i]);
+        *fps[i] = NULL;
+    }
+}
 
-#ifdef _EXPORT_FOR_DLL
-__declspec (dllexport)
-#endif
-
-si4 close_mef_channel(CHANNEL_STATE *channel_state)
+// Everything close_mef_channel() and reset_mef_channel() do with the files: writes what is still buffered, brings
+// the metadata and headers up to date, and closes the files.
+static void finish_mef_channel(CHANNEL_STATE *channel_state)
 {
+    // finish any blocks still being encoded by session workers, and take the channel out of its session
+    remove_mef_session_channel(channel_state);
     
     // write remaining buffered data
     process_filled_block(channel_state,
@@ -1303,34 +4770,65 @@ si4 close_mef_channel(CHANNEL_STATE *channel_state)
                          (channel_state->raw_data_ptr_current - channel_state->raw_data_ptr_start),
                          channel_state->block_len,
                          channel_state->discontinuity_flag,
-                         channel_state->block_hdr_time);
+                         channel_state->block_hdr_time,
+                         channel_state->raw_data_minimum,
+                         channel_state->raw_data_maximum);
     
     
     // update and write segment metadata files as well as universal headers
     update_metadata(channel_state);
     
     // close files
+    remove_journal(channel_state);
+    release_mapped_file(channel_state, channel_state->ts_data_fps, &channel_state->data_map);
+    release_mapped_file(channel_state, channel_state->ts_inds_fps, &channel_state->inds_map);
     fclose(channel_state->ts_data_fps->fp);
     fclose(channel_state->ts_inds_fps->fp);
     fclose(channel_state->metadata_fps->fp);
+    channel_state->ts_data_fps->fp = NULL;
+    channel_state->ts_inds_fps->fp = NULL;
+    channel_state->metadata_fps->fp = NULL;
     
-    return(0);
+    // the recording ended before the prepared segment was needed
+    discard_next_segment(channel_state);
     
-    // TBD skip freeing memory for now, c# isn't happy with it, may not even be necessary with garbage collection?
+    write_resume_state(channel_state);
     
-    // free memory
-    free_file_processing_struct(channel_state->gen_fps);
-    free_file_processing_struct(channel_state->ts_inds_fps);
-    free_file_processing_struct(channel_state->metadata_fps);
-    free_file_processing_struct(channel_state->ts_data_fps);
+    release_channel_mefd_file(channel_state);
+    
+    // file processing structs are allocated for each recording
+    free_channel_file_structs(channel_state);
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 close_mef_channel(CHANNEL_STATE *channel_state)
+{
+    // a channel that was reset has no files open
+    if (channel_state->buffers_retained != CHANNEL_BUFFERS_RETAINED)
+        finish_mef_channel(channel_state);
     
-    free(channel_state->raw_data_ptr_start);
-    channel_state->rps->original_data = NULL;  // original data was previously free'd and re-assigned, so no need to deallocate it here
+    // free memory
+    channel_state->rps->original_data = NULL;  // original data was never allocated, and points into the raw buffer
     RED_free_processing_struct(channel_state->rps);
-    free(channel_state->out_data);
-    free(channel_state->temp_time_series_index);
+    free(channel_state->metadata_image);
+    if (!in_channel_arena(channel_state, channel_state->temp_time_series_index))
+        free(channel_state->temp_time_series_index);
+    if (!in_channel_arena(channel_state, channel_state->data_batch))
+        free(channel_state->data_batch);
+    free(channel_state->arena);
     // TBD there appears to still be a small (368 byte) memory leak associated with each channel, it might be in meflib.c somewhere
     
+    channel_state->rps = NULL;
+    channel_state->metadata_image = NULL;
+    channel_state->temp_time_series_index = NULL;
+    channel_state->data_batch = NULL;
+    channel_state->arena = NULL;
+    channel_state->raw_data_ptr_start = channel_state->raw_data_ptr_current = NULL;
+    channel_state->buffers_retained = 0;
+    
     return(0);
 }
 
@@ -1338,6 +4836,255 @@ si4 close_mef_channel(CHANNEL_STATE *channel_state)
 __declspec (dllexport)
 #endif
 
+si4 reset_mef_channel(CHANNEL_STATE *channel_state)
+{
+    if (channel_state->buffers_retained == CHANNEL_BUFFERS_RETAINED)
+        return 0;
+    
+    finish_mef_channel(channel_state);
+    
+    // batch buffers resized for this recording go; the next one starts with the default sizes, in the arena
+    if (!in_channel_arena(channel_state, channel_state->temp_time_series_index))
+        free(channel_state->temp_time_series_index);
+    if (!in_channel_arena(channel_state, channel_state->data_batch))
+        free(channel_state->data_batch);
+    channel_state->temp_time_series_index = NULL;
+    channel_state->data_batch = NULL;
+    channel_state->buffers_retained = CHANNEL_BUFFERS_RETAINED;
+    
+    return 0;
+}
+
+/***************************************  SESSION INGEST  ***************************************/
+
+// Writer thread of an ingest queue.  Batches are written in queue order; a slot still being filled by its
+// producer holds up the ones after it, which keeps the batches of each channel in order.
+static MEF_THREAD_FUNCTION(mef_ingest_writer, arg)
+{
+    MEF_INGEST_QUEUE *queue;
+    INGEST_BATCH *batch;
+    
+    queue = (MEF_INGEST_QUEUE *) arg;
+    
+    mef_mutex_lock(&queue->lock);
+    for (;;)
+    {
+        while ((queue->count == 0) ? !queue->shutting_down : (queue->batches[queue->head].state != INGEST_SLOT_READY))
+            mef_cond_wait(&queue->batch_ready, &queue->lock);
+        
+        // only exit once all queued batches are written
+        if (queue->count == 0)
+            break;
+        
+        batch = &(queue->batches[queue->head]);
+        mef_mutex_unlock(&queue->lock);
+        
+        write_mef_channel_data(batch->channel_state, batch->packet_times, batch->samps, batch->n_packets,
+                               batch->secs_per_block, batch->sampling_frequency);
+        
+        mef_mutex_lock(&queue->lock);
+        batch->channel_state->ingest_pending--;
+        batch->state = INGEST_SLOT_FREE;
+        queue->head = (queue->head + 1) % queue->num_batches;
+        queue->count--;
+        
+        // wake up producers waiting for room, and anyone waiting for a channel to drain
+        mef_cond_broadcast(&queue->batch_done);
+    }
+    mef_mutex_unlock(&queue->lock);
+    
+    return MEF_THREAD_RETURN;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 start_mef_session_ingest(SESSION_STATE *session, si4 num_writer_threads, si4 batches_per_writer)
+{
+    MEF_INGEST_QUEUE *queue;
+    si4 i;
+    
+    if (session == NULL || session->ingest_queues != NULL)
+        return -1;
+    
+    if (num_writer_threads < 1)
+        num_writer_threads = 1;
+    if (batches_per_writer <= 0)
+        batches_per_writer = DEFAULT_INGEST_QUEUE_BATCHES;
+    
+    session->ingest_queues = (MEF_INGEST_QUEUE *) calloc((size_t) num_writer_threads, sizeof(MEF_INGEST_QUEUE));
+    if (session->ingest_queues == NULL)
+    {
+        fprintf(stderr, "Insufficient memory to allocate ingest queues\n");
+        exit(1);
+    }
+    for (i = 0; i < num_writer_threads; i++)
+    {
+        queue = &(session->ingest_queues[i]);
+        // slot buffers are allocated as batches arrive, and grown to the largest batch given to the slot
+        queue->batches = (INGEST_BATCH *) calloc((size_t) batches_per_writer, sizeof(INGEST_BATCH));
+        if (queue->batches == NULL)
+        {
+            fprintf(stderr, "Insufficient memory to allocate ingest queues\n");
+            exit(1);
+        }
+        mef_mutex_init(&queue->lock);
+        mef_cond_init(&queue->batch_ready);
+        mef_cond_init(&queue->batch_done);
+        queue->num_batches = (ui4) batches_per_writer;
+        queue->head = 0;
+        queue->count = 0;
+        queue->shutting_down = 0;
+        queue->full_queue_count = 0;
+        if (mef_thread_create(&(queue->writer), mef_ingest_writer, queue) != 0)
+        {
+            fprintf(stderr, "Unable to start ingest writer thread\n");
+            exit(1);
+        }
+        // counted as it starts, so stop_mef_session_ingest() only joins running writers
+        session->num_ingest_queues = i + 1;
+    }
+    session->next_ingest_queue = 0;
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 enqueue_mef_channel_data(CHANNEL_STATE *channel_state,
+                             ui8 *packet_times,
+                             si4 *samps,
+                             ui8 n_packets_to_process,
+                             sf8 secs_per_block,
+                             sf8 sampling_frequency,
+                             si4 wait)
+{
+    SESSION_STATE *session;
+    MEF_INGEST_QUEUE *queue;
+    INGEST_BATCH *batch;
+    ui4 slot;
+    
+    session = channel_state->session;
+    if (session == NULL || session->num_ingest_queues == 0)
+        return -1;
+    
+    // the first batch of a channel picks the queue (and so the writer) the channel stays with
+    if (channel_state->ingest_queue == NULL)
+    {
+        mef_mutex_lock(&session->lock);
+        if (channel_state->ingest_queue == NULL)
+        {
+            channel_state->ingest_queue = &(session->ingest_queues[session->next_ingest_queue]);
+            session->next_ingest_queue = (session->next_ingest_queue + 1) % session->num_ingest_queues;
+        }
+        mef_mutex_unlock(&session->lock);
+    }
+    queue = (MEF_INGEST_QUEUE *) channel_state->ingest_queue;
+    
+    // take the next slot
+    mef_mutex_lock(&queue->lock);
+    if (queue->count == queue->num_batches)
+    {
+        queue->full_queue_count++;
+        if (!wait)
+        {
+            mef_mutex_unlock(&queue->lock);
+            return 1;
+        }
+        while (queue->count == queue->num_batches)
+            mef_cond_wait(&queue->batch_done, &queue->lock);
+    }
+    slot = (queue->head + queue->count) % queue->num_batches;
+    batch = &(queue->batches[slot]);
+    batch->state = INGEST_SLOT_FILLING;
+    queue->count++;
+    channel_state->ingest_pending++;
+    mef_mutex_unlock(&queue->lock);
+    
+    // fill it without the lock, so producers only contend for taking slots
+    if (n_packets_to_process > batch->capacity)
+    {
+        free(batch->packet_times);
+        free(batch->samps);
+        batch->packet_times = (ui8 *) malloc((size_t) n_packets_to_process * sizeof(ui8));
+        batch->samps = (si4 *) malloc((size_t) n_packets_to_process * sizeof(si4));
+        if (batch->packet_times == NULL || batch->samps == NULL)
+        {
+            fprintf(stderr, "Insufficient memory to queue channel data\n");
+            exit(1);
+        }
+        batch->capacity = n_packets_to_process;
+    }
+    if (n_packets_to_process > 0)
+    {
+        memcpy(batch->packet_times, packet_times, (size_t) n_packets_to_process * sizeof(ui8));
+        memcpy(batch->samps, samps, (size_t) n_packets_to_process * sizeof(si4));
+    }
+    batch->channel_state = channel_state;
+    batch->n_packets = n_packets_to_process;
+    batch->secs_per_block = secs_per_block;
+    batch->sampling_frequency = sampling_frequency;
+    
+    mef_mutex_lock(&queue->lock);
+    batch->state = INGEST_SLOT_READY;
+    if (slot == queue->head)
+        mef_cond_signal(&queue->batch_ready);
+    mef_mutex_unlock(&queue->lock);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 get_mef_session_ingest_backlog(SESSION_STATE *session, ui8 *queued_batches, ui8 *full_queue_count)
+{
+    MEF_INGEST_QUEUE *queue;
+    si4 i;
+    
+    *queued_batches = 0;
+    *full_queue_count = 0;
+    if (session == NULL || session->num_ingest_queues == 0)
+        return -1;
+    
+    for (i = 0; i < session->num_ingest_queues; i++)
+    {
+        queue = &(session->ingest_queues[i]);
+        mef_mutex_lock(&queue->lock);
+        *queued_batches += queue->count;
+        *full_queue_count += queue->full_queue_count;
+        mef_mutex_unlock(&queue->lock);
+    }
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 close_mef_session(SESSION_STATE *session)
+{
+    if (session == NULL)
+        return 0;
+    
+    // close channels that are still part of the session.  close_mef_channel() removes each one from the list.
+    while (session->num_channels > 0)
+        close_mef_channel(session->channels[session->num_channels - 1]);
+    
+    free_mef_session(session);
+    
+    return 0;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
 si4 create_or_append_annotations(ANNOTATION_STATE* annotation_state,
                                  si1* dir_name,
                                  sf4 gmt_offset,
@@ -1353,6 +5100,10 @@ si4 create_or_append_annotations(ANNOTATION_STATE* annotation_state,
     
     annotation_state->gmt_offset = gmt_offset;
     
+    // grown by write_annotations_batch() as needed
+    annotation_state->batch_buffer = NULL;
+    annotation_state->batch_buffer_bytes = 0;
+    
     // set up a generic fps for universal header and password data
     annotation_state->gen_fps = allocate_file_processing_struct(UNIVERSAL_HEADER_BYTES, NO_FILE_TYPE_CODE, NULL, NULL, 0);
     initialize_universal_header(annotation_state->gen_fps, MEF_FALSE, MEF_FALSE, MEF_FALSE);
@@ -1410,7 +5161,7 @@ si4 create_or_append_annotations(ANNOTATION_STATE* annotation_state,
         annotation_state->gen_fps->universal_header->start_time = UNIVERSAL_HEADER_START_TIME_NO_ENTRY;
         annotation_state->gen_fps->universal_header->end_time = UNIVERSAL_HEADER_END_TIME_NO_ENTRY;
         // generate level UUID into generic universal_header
-        generate_UUID(annotation_state->gen_fps->universal_header->level_UUID);
+        generate_UUID_thread_safe(annotation_state->gen_fps->universal_header->level_UUID);
         
         // allocate memory for new files
         annotation_state->rdat_fps = allocate_file_processing_struct(UNIVERSAL_HEADER_BYTES, RECORD_DATA_FILE_TYPE_CODE, NULL, annotation_state->gen_fps, UNIVERSAL_HEADER_BYTES);
@@ -1426,11 +5177,11 @@ si4 create_or_append_annotations(ANNOTATION_STATE* annotation_state,
         annotation_state->ridx_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;
         annotation_state->ridx_fps->directives.open_mode = FPS_W_OPEN_MODE;
         annotation_state->rdat_fps->universal_header->number_of_entries = 0;
-        generate_UUID(annotation_state->rdat_fps->universal_header->file_UUID);
+        generate_UUID_thread_safe(annotation_state->rdat_fps->universal_header->file_UUID);
         annotation_state->rdat_fps->universal_header->body_CRC = CRC_START_VALUE;
         write_MEF_file(annotation_state->rdat_fps);
         annotation_state->ridx_fps->universal_header->number_of_entries = 0;
-        generate_UUID(annotation_state->ridx_fps->universal_header->file_UUID);
+        generate_UUID_thread_safe(annotation_state->ridx_fps->universal_header->file_UUID);
         annotation_state->ridx_fps->universal_header->body_CRC = CRC_START_VALUE;
         write_MEF_file(annotation_state->ridx_fps);
         
@@ -1452,345 +5203,322 @@ si4 create_or_append_annotations(ANNOTATION_STATE* annotation_state,
     return 0;
 }
 
-#ifdef _EXPORT_FOR_DLL
-__declspec (dllexport)
-#endif
+/***************************************  RECORD TYPES  ***************************************/
 
-si4 write_annotation(ANNOTATION_STATE* annotation_state,
-                     ui8 unixTimestamp,
-                     si1* type,
-                     void* record)
+// Copy field by field, into zeroed memory, so excess random characters aren't written after the strings
+static void serialize_curs_record(ui1 *body, void *record, si8 body_bytes)
 {
-    extern MEF_GLOBALS	*MEF_globals;
-    
-    // record-type specific pointers
-    char* note_text;
-    MEFREC_Seiz_1_0* mefrec_seiz;
-    MEFREC_Curs_1_0* mefrec_curs;
-    MEFREC_Epoc_1_0* mefrec_epoc;
-    
-    int allocated_new_struct;
-    
-    RECORD_HEADER *new_header;
-    RECORD_INDEX *new_index;
-    si4 pad_bytes;
-    static const si1 pad_bytes_string[] = "~~~~~~~~~~~~~~~";  // 15 tildes, so we can fwrite between 0 and 15 of them to pad a record
-    
-    allocated_new_struct = 0;
+    MEFREC_Curs_1_0 *curs_temp, *mefrec_curs;
+    
+    curs_temp = (MEFREC_Curs_1_0*) record;
+    mefrec_curs = (MEFREC_Curs_1_0*) body;
+    mefrec_curs->id_number = curs_temp->id_number;
+    mefrec_curs->trace_timestamp = curs_temp->trace_timestamp;
+    mefrec_curs->latency = curs_temp->latency;
+    mefrec_curs->value = curs_temp->value;
+    strncpy(mefrec_curs->name, curs_temp->name, MEFREC_Curs_1_0_NAME_BYTES - 1);
+}
 
-    // initialize these, so Visual Studio doesn't complain
-    note_text = NULL;
-    mefrec_seiz = NULL;
-    mefrec_curs = NULL;
-    mefrec_epoc = NULL;
-    
-    if (!strcmp(type, "Siez") && !strcmp(type, "Note") && !strcmp(type, "Curs") && !strcmp(type, "Epoc"))
-        return 0;
-    
-    if (record == NULL)
-        return 0;
-    
-    if (annotation_state->rdat_fps == NULL)
+static void serialize_epoc_record(ui1 *body, void *record, si8 body_bytes)
+{
+    MEFREC_Epoc_1_0 *epoc_temp, *mefrec_epoc;
+    
+    epoc_temp = (MEFREC_Epoc_1_0*) record;
+    mefrec_epoc = (MEFREC_Epoc_1_0*) body;
+    mefrec_epoc->id_number = epoc_temp->id_number;
+    mefrec_epoc->timestamp = epoc_temp->timestamp;
+    mefrec_epoc->end_timestamp = epoc_temp->end_timestamp;
+    mefrec_epoc->duration = epoc_temp->duration;
+    strncpy(mefrec_epoc->epoch_type, epoc_temp->epoch_type, MEFREC_Epoc_1_0_EPOCH_TYPE_BYTES - 1);
+    strncpy(mefrec_epoc->text, epoc_temp->text, MEFREC_Epoc_1_0_TEXT_BYTES - 1);
+}
+
+// The four character type string, as one compare
+#define RECORD_TYPE_CODE(a, b, c, d)    ((ui4) (ui1) (a) | ((ui4) (ui1) (b) << 8) | ((ui4) (ui1) (c) << 16) | ((ui4) (ui1) (d) << 24))
+
+// The types the writer knows, built in first, then any added with register_mef_record_type().  A fixed_bytes
+// of 0 means the record is a null terminated string, and a NULL serializer means the record is copied as is.
+static MEF_RECORD_TYPE record_types[MAX_RECORD_TYPES] = {
+    { RECORD_TYPE_CODE('N', 'o', 't', 'e'), 1, 0, 0,                     NULL },
+    { RECORD_TYPE_CODE('S', 'e', 'i', 'z'), 1, 0, MEFREC_Seiz_1_0_BYTES, NULL },
+    { RECORD_TYPE_CODE('C', 'u', 'r', 's'), 1, 0, MEFREC_Curs_1_0_BYTES, serialize_curs_record },
+    { RECORD_TYPE_CODE('E', 'p', 'o', 'c'), 1, 0, MEFREC_Epoc_1_0_BYTES, serialize_epoc_record }
+};
+static si4 number_of_record_types = 4;  // changed under mef_globals_lock, read with mef_load_acquire()
+
+static ui4 record_type_code(si1 *type)
+{
+    if (type == NULL || strlen(type) != 4)
         return 0;
     
-    if (annotation_state->ridx_fps == NULL)
-        return 0;
+    return RECORD_TYPE_CODE(type[0], type[1], type[2], type[3]);
+}
+
+// Returns the descriptor for a type string, or NULL for a type this writer doesn't know
+static MEF_RECORD_TYPE *find_record_type(si1 *type)
+{
+    ui4 type_code;
+    si4 i, n;
     
-    if (annotation_state->rdat_fps->fp == NULL)
-        annotation_state->rdat_fps->fp = fopen(annotation_state->rdat_fps->full_file_name, "r+b");
-    fseek(annotation_state->rdat_fps->fp, annotation_state->rdat_file_offset, SEEK_SET);
-    if (annotation_state->ridx_fps->fp == NULL)
-        annotation_state->ridx_fps->fp = fopen(annotation_state->ridx_fps->full_file_name, "r+b");
-    fseek(annotation_state->ridx_fps->fp, annotation_state->ridx_file_offset, SEEK_SET);
+    type_code = record_type_code(type);
+    if (type_code == 0)
+        return NULL;
     
-    new_header = calloc(1, sizeof(RECORD_HEADER));
-    new_index = calloc(1, sizeof(RECORD_INDEX));
+    // the entries below the count are complete, see register_mef_record_type()
+    n = mef_load_acquire(&number_of_record_types);
+    for (i = 0; i < n; i++)
+        if (record_types[i].type_code == type_code)
+            return &record_types[i];
     
-    // populate header and index entry
-    strcpy(new_header->type_string, type);
-    strcpy(new_index->type_string, type);
-    new_header->version_major = 1;
-    new_index->version_major = 1;
-    new_header->version_minor = 0;
-    new_index->version_minor = 0;
-    new_header->encryption = 0;
-    new_index->encryption = 0;
-    new_header->bytes = 0;
+    return NULL;
+}
 
-    // calculate bytes to put in header
-    if (!strcmp(type, "Note"))
-    {
-        new_header->bytes = strlen((si1*)(record)) + 1;  // add one for null terminator
-    }
-    if (!strcmp(type, "Seiz"))
-    {
-        new_header->bytes = MEFREC_Seiz_1_0_BYTES;
-    }
-    if (!strcmp(type, "Curs"))
-    {
-        new_header->bytes = MEFREC_Curs_1_0_BYTES;
-    }
-    if (!strcmp(type, "Epoc"))
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 register_mef_record_type(si1 *type, ui1 version_major, ui1 version_minor, si8 fixed_bytes, MEF_RECORD_SERIALIZER serializer)
+{
+    MEF_RECORD_TYPE *record_type;
+    ui4 type_code;
+    si4 result;
+    
+    type_code = record_type_code(type);
+    if (type_code == 0 || fixed_bytes < 0)
+        return -1;
+    
+    result = 0;
+    mef_mutex_lock(&mef_globals_lock);
+    if (find_record_type(type) != NULL || number_of_record_types == MAX_RECORD_TYPES)
+        result = -1;
+    else
     {
-        new_header->bytes = MEFREC_Epoc_1_0_BYTES;
+        // fill the entry in before counting it, so writers never see a partial one on any processor
+        record_type = &record_types[number_of_record_types];
+        record_type->type_code = type_code;
+        record_type->version_major = version_major;
+        record_type->version_minor = version_minor;
+        record_type->fixed_bytes = fixed_bytes;
+        record_type->serializer = serializer;
+        mef_store_release(&number_of_record_types, number_of_record_types + 1);
     }
+    mef_mutex_unlock(&mef_globals_lock);
+    
+    return result;
+}
+
+// Bytes of a record's body, before padding
+static si8 annotation_body_bytes(MEF_RECORD_TYPE *record_type, void *record)
+{
+    if (record_type->fixed_bytes == 0)
+        return (si8) strlen((si1*) record) + 1;  // add one for null terminator
+    
+    return record_type->fixed_bytes;
+}
+
+// Lays out one record (header, body and pad bytes) at rdat, and its index entry at ridx, as they go in the
+// files.  rdat must have room for RECORD_HEADER_BYTES plus the padded body.  Returns the bytes used at rdat.
+static si8 serialize_annotation(ui8 unixTimestamp, MEF_RECORD_TYPE *record_type, void* record,
+                                si8 body_bytes, si8 rdat_file_offset, ui1 *rdat, ui1 *ridx)
+{
+    extern MEF_GLOBALS	*MEF_globals;
+    RECORD_HEADER *new_header;
+    RECORD_INDEX *new_index;
+    si4 pad_bytes;
+    si8 record_bytes;
+    static const si1 pad_bytes_string[] = "~~~~~~~~~~~~~~~";  // 15 tildes, so we can copy between 0 and 15 of them to pad a record
     
     // calculate pad bytes for possible encryption.  Encryption is done in 16 byte blocks.
-    pad_bytes = 16 - (new_header->bytes % 16);
+    pad_bytes = 16 - (body_bytes % 16);
     if (pad_bytes == 16)
         pad_bytes = 0;
+    record_bytes = RECORD_HEADER_BYTES + body_bytes + pad_bytes;
+    memset(rdat, 0, (size_t) record_bytes);
+    memset(ridx, 0, (size_t) RECORD_INDEX_BYTES);
+    new_header = (RECORD_HEADER *) rdat;
+    new_index = (RECORD_INDEX *) ridx;
     
-    new_header->bytes += pad_bytes;
-    
-	if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
-	{
-		// if we haven't already calculated an offset, do it now using our time and time zone
-		if (MEF_globals->recording_time_offset == MEF_GLOBALS_RECORDING_TIME_OFFSET_DEFAULT) {
-			generate_recording_time_offset(unixTimestamp, (si4)(annotation_state->gmt_offset * 3600.0));
-		}
-	}
+    // populate header and index entry
+    memcpy(new_header->type_string, &record_type->type_code, (size_t) 4);
+    memcpy(new_index->type_string, &record_type->type_code, (size_t) 4);
+    new_header->version_major = record_type->version_major;
+    new_index->version_major = record_type->version_major;
+    new_header->version_minor = record_type->version_minor;
+    new_index->version_minor = record_type->version_minor;
+    new_header->encryption = 0;
+    new_index->encryption = 0;
+    new_header->bytes = (ui4) (body_bytes + pad_bytes);
     
     // these can be offset since they are not encrypted for both rdat and ridx
     new_header->time = unixTimestamp;
     if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
         apply_recording_time_offset(&(new_header->time));
     new_index->time = new_header->time;
+    new_index->file_offset = rdat_file_offset;
     
-    // update index offset before modifying rdat_file_offset variable, so we get beginning of record offset
-    new_index->file_offset = annotation_state->rdat_file_offset;
+    if (record_type->serializer != NULL)
+        record_type->serializer(rdat + RECORD_HEADER_BYTES, record, body_bytes);
+    else
+        memcpy(rdat + RECORD_HEADER_BYTES, record, (size_t) body_bytes);
+    memcpy(rdat + RECORD_HEADER_BYTES + body_bytes, pad_bytes_string, (size_t) pad_bytes);
     
-    // keep track of where we are in rdat for next ridx entry
-    annotation_state->rdat_file_offset += RECORD_HEADER_BYTES;
+    // the record CRC covers the header and the padded body
+    new_header->record_CRC = mef_crc_calculate(rdat + CRC_BYTES, record_bytes - CRC_BYTES);
     
-    long max_entry_size = 0;
+    return record_bytes;
+}
+
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 write_annotations_batch(ANNOTATION_STATE* annotation_state,
+                            si4 number_of_records,
+                            ui8* unixTimestamps,
+                            si1** types,
+                            void** records)
+{
+    extern MEF_GLOBALS	*MEF_globals;
+    UNIVERSAL_HEADER *uh_rdat, *uh_ridx;
+    MEF_RECORD_TYPE *record_type;
+    ui1 *rdat, *ridx, *new_buffer;
+    si8 body_bytes, rdat_bytes, record_bytes, max_entry_size;
+    ui8 buffer_bytes;
+    si4 i;
     
-    if (!strcmp(type, "Note"))
-    {
-        note_text = (si1*) record;
-        
-        // calculate offset for record data file
-        annotation_state->rdat_file_offset += strlen(note_text) + 1;  // add one for null terminator
-        
-        // calculate offset for record data file
-        max_entry_size = strlen(note_text) + 1 + RECORD_HEADER_BYTES;
-        
-        // calculate CRC
-        new_header->record_CRC = CRC_calculate((ui1*)new_header + CRC_BYTES, RECORD_HEADER_BYTES - CRC_BYTES);
-        new_header->record_CRC = CRC_update((ui1*)note_text, (size_t)(strlen(note_text) + 1), new_header->record_CRC);
-    }
-    if (!strcmp(type, "Seiz"))
-    {
-        mefrec_seiz = (MEFREC_Seiz_1_0*) record;
-        
-        // keep track of where we are in rdat for next ridx entry
-        annotation_state->rdat_file_offset += MEFREC_Seiz_1_0_BYTES;
-        
-        // keep track of entry size to update universal header from rdat
-        max_entry_size = MEFREC_Seiz_1_0_BYTES + RECORD_HEADER_BYTES;
-        
-        // calculate CRC
-        new_header->record_CRC = CRC_calculate((ui1*)new_header + CRC_BYTES, RECORD_HEADER_BYTES - CRC_BYTES);
-        new_header->record_CRC = CRC_update((ui1*)mefrec_seiz, (size_t)MEFREC_Seiz_1_0_BYTES, new_header->record_CRC);
-    }
-    if (!strcmp(type, "Curs"))
+    if (number_of_records <= 0)
+        return 0;
+    
+    if (annotation_state->rdat_fps == NULL || annotation_state->ridx_fps == NULL)
+        return -1;
+    
+    // size everything first, so nothing is written if any record can't be
+    rdat_bytes = 0;
+    for (i = 0; i < number_of_records; i++)
     {
-        MEFREC_Curs_1_0 *curs_temp;
-        
-        // create a new struct - this way we can guarantee the string is (name) is zero'd out and excess random
-        // characters aren'te written after the string terminator
-        curs_temp = (MEFREC_Curs_1_0*) record;
-        mefrec_curs = (MEFREC_Curs_1_0*) calloc(1,(size_t)MEFREC_Curs_1_0_BYTES);
-        allocated_new_struct = 1;
-        
-        if (mefrec_curs != NULL)
-        {
-            // copy from old struct to new struct
-            mefrec_curs->id_number = curs_temp->id_number;
-            mefrec_curs->trace_timestamp = curs_temp->trace_timestamp;
-            mefrec_curs->latency = curs_temp->latency;
-            mefrec_curs->value = curs_temp->value;
-            strncpy(mefrec_curs->name, curs_temp->name, MEFREC_Curs_1_0_NAME_BYTES - 1);
-        }
-        else
-        {
-            // allocation failed, so revert to use what was passed in
-            mefrec_curs = (MEFREC_Curs_1_0*) record;
-            allocated_new_struct = 0;
-        }
-        
-        // keep track of where we are in rdat for next ridx entry
-        annotation_state->rdat_file_offset += MEFREC_Curs_1_0_BYTES;
-        
-        // keep track of entry size to update universal header from rdat
-        max_entry_size = MEFREC_Curs_1_0_BYTES + RECORD_HEADER_BYTES;
-        
-        // calculate CRC
-        new_header->record_CRC = CRC_calculate((ui1*)new_header + CRC_BYTES, RECORD_HEADER_BYTES - CRC_BYTES);
-        new_header->record_CRC = CRC_update((ui1*)mefrec_curs, MEFREC_Curs_1_0_BYTES, new_header->record_CRC);
+        record_type = find_record_type(types[i]);
+        if (record_type == NULL || records[i] == NULL)
+            return -1;
+        body_bytes = annotation_body_bytes(record_type, records[i]);
+        rdat_bytes += RECORD_HEADER_BYTES + ((body_bytes + 15) / 16) * 16;
     }
-    if (!strcmp(type, "Epoc"))
+    
+    // records go in one buffer, followed by their index entries
+    buffer_bytes = (ui8) rdat_bytes + ((ui8) number_of_records * RECORD_INDEX_BYTES);
+    if (buffer_bytes > annotation_state->batch_buffer_bytes)
     {
-        MEFREC_Epoc_1_0 *epoc_temp;
-        
-        // create a new struct - this way we can guarantee the string is (name) is zero'd out and excess random
-        // characters aren'te written after the string terminator
-        epoc_temp = (MEFREC_Epoc_1_0*) record;
-        mefrec_epoc = (MEFREC_Epoc_1_0*) calloc(1,(size_t)MEFREC_Epoc_1_0_BYTES);
-        allocated_new_struct = 1;
-        
-        if (mefrec_epoc != NULL)
-        {
-            // copy from old struct to new struct
-            mefrec_epoc->id_number = epoc_temp->id_number;
-            mefrec_epoc->timestamp = epoc_temp->timestamp;
-            mefrec_epoc->end_timestamp = epoc_temp->end_timestamp;
-            mefrec_epoc->duration = epoc_temp->duration;
-            strncpy(mefrec_epoc->epoch_type, epoc_temp->epoch_type, MEFREC_Epoc_1_0_EPOCH_TYPE_BYTES - 1);
-            strncpy(mefrec_epoc->text, epoc_temp->text, MEFREC_Epoc_1_0_TEXT_BYTES - 1);
-        }
-        else
+        new_buffer = (ui1 *) realloc(annotation_state->batch_buffer, (size_t) buffer_bytes);
+        if (new_buffer == NULL)
         {
-            // allocation failed, so revert to use what was passed in
-            mefrec_epoc = (MEFREC_Epoc_1_0*) record;
-            allocated_new_struct = 0;
+            fprintf(stderr, "Insufficient memory to allocate annotation buffers\n");
+            exit(1);
         }
-        
-        // keep track of where we are in rdat for next ridx entry
-        annotation_state->rdat_file_offset += MEFREC_Epoc_1_0_BYTES;
-        
-        // keep track of entry size to update universal header from rdat
-        max_entry_size = MEFREC_Epoc_1_0_BYTES + RECORD_HEADER_BYTES;
-        
-        // calculate CRC
-        new_header->record_CRC = CRC_calculate((ui1*)new_header + CRC_BYTES, RECORD_HEADER_BYTES - CRC_BYTES);
-        new_header->record_CRC = CRC_update((ui1*)mefrec_epoc, (size_t)MEFREC_Epoc_1_0_BYTES, new_header->record_CRC);
+        annotation_state->batch_buffer = new_buffer;
+        annotation_state->batch_buffer_bytes = buffer_bytes;
     }
-
     
-    // account for pad bytes, this code will be the same regardless of record type
-    annotation_state->rdat_file_offset += pad_bytes;
-    max_entry_size += pad_bytes;
-    if (pad_bytes)
-        new_header->record_CRC = CRC_update((ui1*)pad_bytes_string, (size_t)pad_bytes, new_header->record_CRC);
+	if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
+	{
+		// if we haven't already calculated an offset, do it now using our time and time zone
+		mef_mutex_lock(&mef_globals_lock);
+		if (MEF_globals->recording_time_offset == MEF_GLOBALS_RECORDING_TIME_OFFSET_DEFAULT) {
+			generate_recording_time_offset(unixTimestamps[0], (si4)(annotation_state->gmt_offset * 3600.0));
+		}
+		mef_mutex_unlock(&mef_globals_lock);
+	}
     
-    // we know the CRC for the record header (crc of header and body) so now we can write them.
-    // update CRC of body of rdat file as we do this.
-    (void)e_fwrite(new_header, sizeof(ui1), (size_t)RECORD_HEADER_BYTES, annotation_state->rdat_fps->fp, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    annotation_state->rdat_fps->universal_header->body_CRC = CRC_update((ui1*)new_header, (size_t)RECORD_HEADER_BYTES, annotation_state->rdat_fps->universal_header->body_CRC);
-    if (!strcmp(type, "Note"))
-    {
-        (void)e_fwrite((ui1*)note_text, sizeof(ui1), (size_t)(strlen(note_text) + 1), annotation_state->rdat_fps->fp, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-        annotation_state->rdat_fps->universal_header->body_CRC = CRC_update((ui1*)note_text, (size_t)(strlen(note_text) + 1), annotation_state->rdat_fps->universal_header->body_CRC);
-    }
-    if (!strcmp(type, "Seiz"))
-    {
-        (void)e_fwrite(mefrec_seiz, sizeof(ui1), (size_t)MEFREC_Seiz_1_0_BYTES, annotation_state->rdat_fps->fp, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-        annotation_state->rdat_fps->universal_header->body_CRC = CRC_update((ui1*)mefrec_seiz, (size_t)MEFREC_Seiz_1_0_BYTES, annotation_state->rdat_fps->universal_header->body_CRC);
-    }
-    if (!strcmp(type, "Curs"))
-    {
-        (void)e_fwrite(mefrec_curs, sizeof(ui1), (size_t)MEFREC_Curs_1_0_BYTES, annotation_state->rdat_fps->fp, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-        annotation_state->rdat_fps->universal_header->body_CRC = CRC_update((ui1*)mefrec_curs, (size_t)MEFREC_Curs_1_0_BYTES, annotation_state->rdat_fps->universal_header->body_CRC);
-    }
-    if (!strcmp(type, "Epoc"))
-    {
-        (void)e_fwrite(mefrec_epoc, sizeof(ui1), (size_t)MEFREC_Epoc_1_0_BYTES, annotation_state->rdat_fps->fp, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-        annotation_state->rdat_fps->universal_header->body_CRC = CRC_update((ui1*)mefrec_epoc, (size_t)MEFREC_Epoc_1_0_BYTES, annotation_state->rdat_fps->universal_header->body_CRC);
-    }
-
-    // write pad bytes, if necessary
-    if (pad_bytes)
+    uh_rdat = annotation_state->rdat_fps->universal_header;
+    uh_ridx = annotation_state->ridx_fps->universal_header;
+    rdat = annotation_state->batch_buffer;
+    ridx = annotation_state->batch_buffer + rdat_bytes;
+    max_entry_size = 0;
+    for (i = 0; i < number_of_records; i++)
     {
-        (void)e_fwrite((ui1*)pad_bytes_string, sizeof(si1), (size_t)pad_bytes, annotation_state->rdat_fps->fp, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-        annotation_state->rdat_fps->universal_header->body_CRC = CRC_update((ui1*)pad_bytes_string, (size_t)pad_bytes, annotation_state->rdat_fps->universal_header->body_CRC);
+        record_type = find_record_type(types[i]);
+        record_bytes = serialize_annotation(unixTimestamps[i], record_type, records[i],
+                                            annotation_body_bytes(record_type, records[i]),
+                                            annotation_state->rdat_file_offset + (rdat - annotation_state->batch_buffer),
+                                            rdat, ridx + ((si8) i * RECORD_INDEX_BYTES));
+        if (record_bytes > max_entry_size)
+            max_entry_size = record_bytes;
+        rdat += record_bytes;
     }
-    // write index
-    (void)e_fwrite(new_index, sizeof(ui1), (size_t)RECORD_INDEX_BYTES, annotation_state->ridx_fps->fp, annotation_state->ridx_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    annotation_state->ridx_file_offset += RECORD_INDEX_BYTES;
     
-    /*
-     // done appending, close files
-     fclose(annotation_state->rdat_fps->fp);
-     fclose(annotation_state->ridx_fps->fp);
-     
-     // reopen files, so we can modify the header
-     annotation_state->rdat_fps->fp = fopen(annotation_state->rdat_fps->full_file_name, "w+b");
-     fseek(annotation_state->rdat_fps->fp, 0, SEEK_SET);
-     annotation_state->ridx_fps->fp = fopen(annotation_state->ridx_fps->full_file_name, "w+b");
-     fseek(annotation_state->ridx_fps->fp, 0, SEEK_SET);
-     */
+    if (annotation_state->rdat_fps->fp == NULL)
+        annotation_state->rdat_fps->fp = fopen(annotation_state->rdat_fps->full_file_name, "r+b");
+    if (annotation_state->ridx_fps->fp == NULL)
+        annotation_state->ridx_fps->fp = fopen(annotation_state->ridx_fps->full_file_name, "r+b");
+    
+    // one write to each file
+    e_fseek(annotation_state->rdat_fps->fp, annotation_state->rdat_file_offset, SEEK_SET, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    (void)e_fwrite(annotation_state->batch_buffer, sizeof(ui1), (size_t) rdat_bytes, annotation_state->rdat_fps->fp, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    e_fseek(annotation_state->ridx_fps->fp, annotation_state->ridx_file_offset, SEEK_SET, annotation_state->ridx_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    (void)e_fwrite(ridx, sizeof(ui1), (size_t) number_of_records * RECORD_INDEX_BYTES, annotation_state->ridx_fps->fp, annotation_state->ridx_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    uh_rdat->body_CRC = mef_crc_update(annotation_state->batch_buffer, rdat_bytes, uh_rdat->body_CRC);
+    uh_ridx->body_CRC = mef_crc_update(ridx, (si8) number_of_records * RECORD_INDEX_BYTES, uh_ridx->body_CRC);
+    annotation_state->rdat_file_offset += rdat_bytes;
+    annotation_state->ridx_file_offset += (si8) number_of_records * RECORD_INDEX_BYTES;
     
     // udpdate universal_header fields
     // update start_time, if necessary
-    if (annotation_state->rdat_fps->universal_header->start_time == UNIVERSAL_HEADER_START_TIME_NO_ENTRY)
+    if (uh_rdat->start_time == UNIVERSAL_HEADER_START_TIME_NO_ENTRY)
     {
-        annotation_state->rdat_fps->universal_header->start_time = unixTimestamp;
-        annotation_state->ridx_fps->universal_header->start_time = unixTimestamp;
+        uh_rdat->start_time = unixTimestamps[0];
+        uh_ridx->start_time = unixTimestamps[0];
         // apply offset, since universal header is always written unencrypted
         if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
         {
-            apply_recording_time_offset(&annotation_state->rdat_fps->universal_header->start_time);
-            apply_recording_time_offset(&annotation_state->ridx_fps->universal_header->start_time);
+            apply_recording_time_offset(&uh_rdat->start_time);
+            apply_recording_time_offset(&uh_ridx->start_time);
         }
     }
     
     // update end_time
-    annotation_state->rdat_fps->universal_header->end_time = unixTimestamp;
-    annotation_state->ridx_fps->universal_header->end_time = unixTimestamp;
+    uh_rdat->end_time = unixTimestamps[number_of_records - 1];
+    uh_ridx->end_time = unixTimestamps[number_of_records - 1];
     // apply offset, since universal header is always written unencrypted
     if (MEF_globals->recording_time_offset_mode & (RTO_APPLY | RTO_APPLY_ON_OUTPUT))
     {
-        apply_recording_time_offset(&annotation_state->rdat_fps->universal_header->end_time);
-        apply_recording_time_offset(&annotation_state->ridx_fps->universal_header->end_time);
+        apply_recording_time_offset(&uh_rdat->end_time);
+        apply_recording_time_offset(&uh_ridx->end_time);
     }
     
     // update max_entry_size, if necessary
-    if ((annotation_state->rdat_fps->universal_header->maximum_entry_size < max_entry_size) ||
-        (annotation_state->rdat_fps->universal_header->maximum_entry_size == UNIVERSAL_HEADER_MAXIMUM_ENTRY_SIZE_NO_ENTRY))
+    if ((uh_rdat->maximum_entry_size < max_entry_size) ||
+        (uh_rdat->maximum_entry_size == UNIVERSAL_HEADER_MAXIMUM_ENTRY_SIZE_NO_ENTRY))
     {
-        annotation_state->rdat_fps->universal_header->maximum_entry_size = max_entry_size;
-        annotation_state->ridx_fps->universal_header->maximum_entry_size = max_entry_size;
+        uh_rdat->maximum_entry_size = max_entry_size;
+        uh_ridx->maximum_entry_size = max_entry_size;
     }
     
-    // update body CRC in ridx file
-    annotation_state->ridx_fps->universal_header->body_CRC = CRC_update((ui1*)new_index,  (size_t)RECORD_INDEX_BYTES,  annotation_state->ridx_fps->universal_header->body_CRC);
-    
     // update number_of_entries for both files
-    annotation_state->rdat_fps->universal_header->number_of_entries++;
-    annotation_state->ridx_fps->universal_header->number_of_entries++;
+    uh_rdat->number_of_entries += number_of_records;
+    uh_ridx->number_of_entries += number_of_records;
     
     // re-calculate header CRC for index and data files.  Body CRCs for both files should already be up-to-date.
-    annotation_state->rdat_fps->universal_header->header_CRC = CRC_calculate((ui1*)annotation_state->rdat_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
-    annotation_state->ridx_fps->universal_header->header_CRC = CRC_calculate((ui1*)annotation_state->ridx_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
+    uh_rdat->header_CRC = mef_crc_calculate((ui1*)annotation_state->rdat_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
+    uh_ridx->header_CRC = mef_crc_calculate((ui1*)annotation_state->ridx_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
     
-    // rewrite universal headers
-    // re-write data universal header and then go back to where we were
-    e_fseek(annotation_state->rdat_fps->fp, 0, SEEK_SET, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    (void)e_fwrite(annotation_state->rdat_fps->universal_header, sizeof(UNIVERSAL_HEADER), (size_t)1, annotation_state->rdat_fps->fp, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    e_fseek(annotation_state->rdat_fps->fp, annotation_state->rdat_file_offset, SEEK_SET, annotation_state->rdat_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    
-    // re-write data universal header and then go back to where we were
-    e_fseek(annotation_state->ridx_fps->fp, 0, SEEK_SET, annotation_state->ridx_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    (void)e_fwrite(annotation_state->ridx_fps->universal_header, sizeof(UNIVERSAL_HEADER), (size_t)1, annotation_state->ridx_fps->fp, annotation_state->ridx_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    e_fseek(annotation_state->ridx_fps->fp, annotation_state->ridx_file_offset, SEEK_SET, annotation_state->ridx_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    
-    // free memory
-    free(new_header);
-    free(new_index);
-    if (allocated_new_struct) {
-        if (!strcmp(type, "Curs")) {
-            if (mefrec_curs != NULL)
-                free (mefrec_curs);
-        }
-        if (!strcmp(type, "Epoc")) {
-            if (mefrec_epoc != NULL)
-                free (mefrec_epoc);
-        }
-    }
+    // rewrite universal headers, once for the whole batch
+    rewrite_universal_header(annotation_state->rdat_fps, annotation_state->rdat_file_offset);
+    rewrite_universal_header(annotation_state->ridx_fps, annotation_state->ridx_file_offset);
     
     return 0;
 }
 
+#ifdef _EXPORT_FOR_DLL
+__declspec (dllexport)
+#endif
+
+si4 write_annotation(ANNOTATION_STATE* annotation_state,
+                     ui8 unixTimestamp,
+                     si1* type,
+                     void* record)
+{
+    // a batch of one, which turns away unknown types and missing records
+    return write_annotations_batch(annotation_state, 1, &unixTimestamp, &type, &record);
+}
+
 #ifdef _EXPORT_FOR_DLL
 __declspec (dllexport)
 #endif 
@@ -1811,30 +5539,316 @@ si4 close_annotation(ANNOTATION_STATE* annotation_state)
         annotation_state->ridx_fps->fp = NULL;
     }
     
+    free(annotation_state->batch_buffer);
+    annotation_state->batch_buffer = NULL;
+    annotation_state->batch_buffer_bytes = 0;
+    
     return 0;
 }
 
-// See comment in .h file for use instructions.
-void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1* chan_name, si1* full_file_name, si8 start_time, si8 end_time, 
-    si4 width, si4 height, si4 num_frames, sf8 frame_rate, FILE_PROCESSING_STRUCT* proto_metadata_fps)
+/***************************************  VIDEO  ***************************************/
+
+// 64-bit seeks, video files are often larger than 2 GB
+static si4 video_seek(FILE *fp, si8 offset)
 {
-    si1 command[1024];
-    FILE_PROCESSING_STRUCT* metadata_fps;
-    FILE_PROCESSING_STRUCT* inds_fps;
-    VIDEO_INDEX index_block;
-    VIDEO_METADATA_SECTION_2* md2;
-    ui4 crc;
-    FILE* fp;
-    si8 i;
-    si4 bytes_to_read;
-    si4* buffer;
-    si4 fd;
+#ifdef _WIN32
+    return _fseeki64(fp, (__int64) offset, SEEK_SET);
+#else
+    return fseeko(fp, (off_t) offset, SEEK_SET);
+#endif
+}
+
+// What the RIFF header of an AVI file says, see read_avi_header()
+typedef struct {
+    si4     width;
+    si4     height;
+    si4     num_frames;
+    sf8     frame_rate;
+    si1     video_chunk_id[2];        // stream number, as two digits, of the first video stream
+    si8     movi_offset;              // of the "movi" fourcc, idx1 offsets are usually relative to this
+    si8     idx1_offset;              // of the idx1 entries, 0 if there's no idx1 chunk
+    si8     idx1_bytes;
+} AVI_INFO;
+
+#define AVI_FOURCC_IS(p, s)     (!memcmp((p), (s), (size_t) 4))
+#define AVI_LE4(p)              ((ui4) (p)[0] | ((ui4) (p)[1] << 8) | ((ui4) (p)[2] << 16) | ((ui4) (p)[3] << 24))
+#define AVI_MAX_LIST_DEPTH      4       // hdrl lists hold strl and odml lists, and nothing deeper is looked at
+
+// Walks the chunks of an AVI file from offset to end, picking out the main header, the first video stream header,
+// the OpenDML frame count, and where the movi list and idx1 index are.  Only small chunks are read.  Nothing is
+// trusted to stay inside end, the file's size or its parent list, and lists nested deeper than AVI_MAX_LIST_DEPTH
+// make the file unreadable.
+static si4 read_avi_chunks(FILE *fp, si8 offset, si8 end, si4 depth, AVI_INFO *info, si4 *stream_number)
+{
+    ui1 chunk[64];
+    si8 chunk_bytes, list_end;
+    
+    while (offset + 8 <= end)
+    {
+        if (video_seek(fp, offset) != 0 || fread(chunk, 1, 8, fp) != 8)
+            return -1;
+        chunk_bytes = AVI_LE4(chunk + 4);
+        
+        if (AVI_FOURCC_IS(chunk, "LIST"))
+        {
+            if (fread(chunk + 8, 1, 4, fp) != 4)
+                return -1;
+            if (AVI_FOURCC_IS(chunk + 8, "movi"))
+                info->movi_offset = offset + 8;
+            else if (AVI_FOURCC_IS(chunk + 8, "hdrl") || AVI_FOURCC_IS(chunk + 8, "strl") || AVI_FOURCC_IS(chunk + 8, "odml"))
+            {
+                if (depth >= AVI_MAX_LIST_DEPTH)
+                    return -1;
+                list_end = offset + 8 + chunk_bytes;
+                if (list_end > end)
+                    list_end = end;
+                if (read_avi_chunks(fp, offset + 12, list_end, depth + 1, info, stream_number) != 0)
+                    return -1;
+                if (AVI_FOURCC_IS(chunk + 8, "strl"))
+                    (*stream_number)++;
+            }
+        }
+        else if (AVI_FOURCC_IS(chunk, "avih") && chunk_bytes >= 40)
+        {
+            // MainAVIHeader: dwMicroSecPerFrame ... dwTotalFrames at 16, dwWidth at 32, dwHeight at 36
+            if (fread(chunk, 1, 40, fp) != 40)
+                return -1;
+            if (info->frame_rate <= 0.0 && AVI_LE4(chunk) > 0)
+                info->frame_rate = 1e6 / (sf8) AVI_LE4(chunk);
+            if (info->num_frames <= 0)
+                info->num_frames = (si4) AVI_LE4(chunk + 16);
+            info->width = (si4) AVI_LE4(chunk + 32);
+            info->height = (si4) AVI_LE4(chunk + 36);
+        }
+        else if (AVI_FOURCC_IS(chunk, "strh") && chunk_bytes >= 36 && info->video_chunk_id[0] == 0)
+        {
+            // AVIStreamHeader: fccType, fccHandler, dwFlags, wPriority, wLanguage, dwInitialFrames, dwScale, dwRate
+            if (fread(chunk, 1, 36, fp) != 36)
+                return -1;
+            if (AVI_FOURCC_IS(chunk, "vids"))
+            {
+                info->video_chunk_id[0] = (si1) ('0' + (*stream_number / 10) % 10);
+                info->video_chunk_id[1] = (si1) ('0' + *stream_number % 10);
+                // the stream's rate is exact, the main header's frame time is rounded to microseconds
+                if (AVI_LE4(chunk + 20) > 0 && AVI_LE4(chunk + 24) > 0)
+                    info->frame_rate = (sf8) AVI_LE4(chunk + 24) / (sf8) AVI_LE4(chunk + 20);
+            }
+        }
+        else if (AVI_FOURCC_IS(chunk, "dmlh") && chunk_bytes >= 4)
+        {
+            // files over 1 GB only count the first RIFF's frames in the main header
+            if (fread(chunk, 1, 4, fp) != 4)
+                return -1;
+            if (AVI_LE4(chunk) > 0)
+                info->num_frames = (si4) AVI_LE4(chunk);
+        }
+        else if (AVI_FOURCC_IS(chunk, "idx1"))
+        {
+            info->idx1_offset = offset + 8;
+            info->idx1_bytes = chunk_bytes;
+            // a truncated file would have find_avi_clip_bytes() allocate for an index that isn't there
+            if (info->idx1_bytes > end - info->idx1_offset)
+                info->idx1_bytes = end - info->idx1_offset;
+        }
+        
+        // chunks are padded to an even number of bytes
+        offset += 8 + chunk_bytes + (chunk_bytes & 1);
+    }
+    
+    return 0;
+}
+
+static si4 read_avi_header(FILE *fp, si8 file_size, AVI_INFO *info)
+{
+    ui1 riff[12];
+    si4 stream_number;
+    si8 end;
+    
+    memset(info, 0, sizeof(AVI_INFO));
+    if (video_seek(fp, 0) != 0 || fread(riff, 1, 12, fp) != 12 || !AVI_FOURCC_IS(riff, "RIFF") || !AVI_FOURCC_IS(riff + 8, "AVI "))
+        return -1;
+    
+    // the first RIFF has the headers and (for files under 1 GB) the only index
+    end = 8 + (si8) AVI_LE4(riff + 4);
+    if (end > file_size)
+        end = file_size;
+    stream_number = 0;
+    if (read_avi_chunks(fp, 12, end, 0, info, &stream_number) != 0)
+        return -1;
+    
+    return (info->width > 0 && info->height > 0) ? 0 : -1;
+}
+
+si4 probe_avi_file(si1 *file_name, si4 *width, si4 *height, si4 *num_frames, sf8 *frame_rate)
+{
+    AVI_INFO info;
+    FILE *fp;
+    si4 result;
 #ifdef _WIN32
     struct _stat64 sb64;
 #else
     struct stat sb;
 #endif
+    
+    fp = fopen(file_name, "rb");
+    if (fp == NULL)
+        return -1;
+#ifdef _WIN32
+    _fstat64(_fileno(fp), &sb64);
+    result = read_avi_header(fp, (si8) sb64.st_size, &info);
+#else
+    fstat(fileno(fp), &sb);
+    result = read_avi_header(fp, (si8) sb.st_size, &info);
+#endif
+    fclose(fp);
+    if (result != 0)
+        return -1;
+    
+    if (width != NULL)
+        *width = info.width;
+    if (height != NULL)
+        *height = info.height;
+    if (num_frames != NULL)
+        *num_frames = info.num_frames;
+    if (frame_rate != NULL)
+        *frame_rate = info.frame_rate;
+    
+    return 0;
+}
+
+// Fills in file_offset and clip_bytes of clips that don't have them, from the AVI's idx1 index: the bytes from
+// the start of the clip's first frame chunk to the end of its last.  Clips of files without idx1 (OpenDML files
+// over 1 GB) are left as they are, as are all clips if there isn't the memory to read the index.
+static void find_avi_clip_bytes(FILE *fp, AVI_INFO *info, si4 number_of_clips, VIDEO_INDEX *clips)
+{
+    ui1 *idx1, *entry;
+    si8 *frame_offsets, base, n_entries, i, frame, chunk_bytes;
+    si4 clip, n_frames;
+    
+    if (info->idx1_offset == 0 || info->idx1_bytes < 16 || info->video_chunk_id[0] == 0)
+        return;
+    
+    n_entries = info->idx1_bytes / 16;
+    idx1 = (ui1 *) malloc((size_t) (n_entries * 16));
+    // start and end offset of each frame's chunk
+    frame_offsets = (si8 *) malloc((size_t) (n_entries * 2) * sizeof(si8));
+    if (idx1 == NULL || frame_offsets == NULL)
+    {
+        fprintf(stderr, "Insufficient memory to allocate video index, clip offsets not found\n");
+        free(idx1);
+        free(frame_offsets);
+        return;
+    }
+    if (video_seek(fp, info->idx1_offset) != 0 || fread(idx1, 16, (size_t) n_entries, fp) != (size_t) n_entries)
+    {
+        free(idx1);
+        free(frame_offsets);
+        return;
+    }
+    
+    // offsets are relative to the "movi" fourcc, except in files where they're from the start of the file
+    base = ((si8) AVI_LE4(idx1 + 8) < info->movi_offset) ? info->movi_offset : 0;
+    n_frames = 0;
+    for (i = 0; i < n_entries; i++)
+    {
+        // NNdc or NNdb chunks of the video stream
+        entry = idx1 + i * 16;
+        if (entry[0] != (ui1) info->video_chunk_id[0] || entry[1] != (ui1) info->video_chunk_id[1] || entry[2] != 'd')
+            continue;
+        chunk_bytes = AVI_LE4(entry + 12);
+        frame_offsets[2 * n_frames] = base + (si8) AVI_LE4(entry + 8);
+        frame_offsets[2 * n_frames + 1] = frame_offsets[2 * n_frames] + 8 + chunk_bytes + (chunk_bytes & 1);
+        n_frames++;
+    }
+    
+    for (clip = 0; clip < number_of_clips; clip++)
+    {
+        if (clips[clip].file_offset >= 0 || (si4) clips[clip].start_frame < 0 || (si4) clips[clip].end_frame < (si4) clips[clip].start_frame)
+            continue;
+        frame = (si4) clips[clip].end_frame;
+        if (frame >= n_frames)
+            continue;
+        clips[clip].file_offset = frame_offsets[2 * (si8) (si4) clips[clip].start_frame];
+        clips[clip].clip_bytes = frame_offsets[2 * frame + 1] - clips[clip].file_offset;
+    }
+    
+    free(idx1);
+    free(frame_offsets);
+}
+
+// Puts the video file into the segment, and works out its CRC in the same pass: a hard link (if asked for and if
+// possible) only needs the file read, a copy reads and writes each piece once.  Pieces are VIDEO_CRC_THREADS reads
+// long, so they are CRCed in parallel.  Returns the file's size, or -1 if it couldn't be read or written.
+static si8 copy_video_file(si1 *source_name, si1 *destination_name, si4 link_file, ui4 *crc)
+{
+    FILE *in_fp, *out_fp;
+    ui1 *buffer;
+    size_t bytes_read;
     si8 file_size;
+    
+    out_fp = NULL;
+    remove(destination_name);
+#ifdef _WIN32
+    if (!(link_file && CreateHardLinkA(destination_name, source_name, NULL)))
+#else
+    if (!(link_file && link(source_name, destination_name) == 0))
+#endif
+    {
+        out_fp = fopen(destination_name, "wb");
+        if (out_fp == NULL)
+            return -1;
+    }
+    in_fp = fopen(source_name, "rb");
+    if (in_fp == NULL)
+    {
+        if (out_fp != NULL)
+            fclose(out_fp);
+        return -1;
+    }
+    
+    buffer = (ui1 *) malloc((size_t) VIDEO_CRC_THREADS * VIDEO_FILE_READ_SIZE);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Insufficient memory to allocate video buffer\n");
+        exit(1);
+    }
+    *crc = CRC_START_VALUE;
+    file_size = 0;
+    while ((bytes_read = fread(buffer, 1, (size_t) VIDEO_CRC_THREADS * VIDEO_FILE_READ_SIZE, in_fp)) > 0)
+    {
+        if (out_fp != NULL && fwrite(buffer, 1, bytes_read, out_fp) != bytes_read)
+        {
+            file_size = -1;
+            break;
+        }
+        *crc = crc_update_parallel(buffer, (si8) bytes_read, *crc);
+        file_size += (si8) bytes_read;
+    }
+    if (ferror(in_fp))
+        file_size = -1;
+    
+    free(buffer);
+    fclose(in_fp);
+    if (out_fp != NULL && fclose(out_fp) != 0)
+        file_size = -1;
+    
+    return file_size;
+}
+
+// See comment in .h file for use instructions.
+si4 write_video_file_with_clips(si1* output_directory, si4 segment_num, si1* chan_name, si1* full_file_name, si4 number_of_clips, VIDEO_INDEX* clips,
+    si4 width, si4 height, sf8 frame_rate, si4 link_file, FILE_PROCESSING_STRUCT* proto_metadata_fps)
+{
+    si1 segment_path[MEF_FULL_FILE_NAME_BYTES];
+    si1 video_file_name[MEF_FULL_FILE_NAME_BYTES];
+    FILE_PROCESSING_STRUCT* metadata_fps;
+    FILE_PROCESSING_STRUCT* inds_fps;
+    VIDEO_METADATA_SECTION_2* md2;
+    AVI_INFO avi_info;
+    FILE* fp;
+    ui4 crc;
+    si8 file_size, maximum_clip_bytes;
+    si4 i, have_avi_info;
     si1 extension[TYPE_BYTES];
     si1 name[MEF_BASE_FILE_NAME_BYTES];
 
@@ -1843,6 +5857,9 @@ void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1*
         fprintf(stderr, "Problem - a video channel is being created without an EEG channel having first been created!  Exiting!");
         exit(1);
     }
+    
+    if (number_of_clips < 1 || clips == NULL)
+        return -1;
 
     extract_path_parts(full_file_name, NULL, name, extension);
     if (!(!strcmp(extension, "AVI") || !strcmp(extension, "avi") || !strcmp(extension, "Avi")))
@@ -1851,60 +5868,58 @@ void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1*
         exit(1);
     }
 
-    // create new segment directory
-#ifdef _WIN32
-    sprintf(command, "mkdir \"%s.mefd/%s.vidd/%s-%06d.segd\"", output_directory, chan_name, chan_name, segment_num);
-#else
-    sprintf(command, "mkdir -p \"%s.mefd/%s.vidd/%s-%06d.segd\"", output_directory, chan_name, chan_name, segment_num);  // -p makes intermediate directories
-#endif
-    system(command);
+    // create new segment directory (and the intermediate directories)
+    if (MEF_snprintf(segment_path, MEF_FULL_FILE_NAME_BYTES, "%s.mefd/%s.vidd/%s-%06d.segd", output_directory, chan_name, chan_name, segment_num) >= MEF_FULL_FILE_NAME_BYTES ||
+        MEF_snprintf(video_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s-%06d.%s", segment_path, chan_name, segment_num, extension) >= MEF_FULL_FILE_NAME_BYTES)
+    {
+        fprintf(stderr, "Video segment path for %s is too long\n", chan_name);
+        return -1;
+    }
+    make_directory(segment_path);
 
-    // copy video file into new directory, renaming the file as we do so (but keeping the same file extension)
-#ifdef _WIN32
-    sprintf(command, "copy \"%s\" \"%s.mefd/%s.vidd/%s-%06d.segd/%s-%06d.%s\"", full_file_name, output_directory, chan_name, chan_name, segment_num, chan_name, segment_num, extension);
-    // use only backslashes here, because the "copy" command in Windows 10 is very picky about it.  TBD: check on other Windows versions
-    slash_to_backslash(&command);
-    system(command);
-#else
-    // Unix doesn't allow copying to a new directory and renaming at the same time... so... copy, then rename.  (Ugh!)
-    // copy
-    sprintf(command, "cp \"%s\" \"%s.mefd/%s.vidd/%s-%06d.segd/\"", full_file_name, output_directory, chan_name, chan_name, segment_num);
-    system(command);
-    // rename
-    sprintf(command, "mv \"%s.mefd/%s.vidd/%s-%06d.segd/%s.%s\" \"%s.mefd/%s.vidd/%s-%06d.segd/%s-%06d.%s\"", output_directory, chan_name, chan_name, segment_num, name, extension, output_directory, chan_name, chan_name, segment_num, chan_name, segment_num, extension);
-    system(command);
-#endif
+    // copy (or link) video file into new directory, renaming the file as we do so (but keeping the same file
+    // extension), and get its crc on the way
+    file_size = copy_video_file(full_file_name, video_file_name, link_file, &crc);
+    if (file_size < 0)
+    {
+        fprintf(stderr, "Could not copy %s to %s\n", full_file_name, video_file_name);
+        return -1;
+    }
     
-
-    // open file to get file size, and to get crc of video file (reading file a million bytes at a time)
+    // anything the caller doesn't know comes from the AVI header, so nobody has to run ffprobe
+    have_avi_info = 0;
     fp = fopen(full_file_name, "rb");
-    // get file size, which will be used a lot
-#ifdef _WIN32
-    fd = _fileno(fp);
-    _fstat64(fd, &sb64);  // 64-bit necessary for file sizes greater than 4 GB
-    file_size = sb64.st_size;
-#else
-    fd = fileno(fp);
-    fstat(fd, &sb);
-    file_size = sb.st_size;
-#endif
-
-    // do crc calculation
-    buffer = malloc(VIDEO_FILE_READ_SIZE);
-    crc = CRC_START_VALUE;
-    i = 0;
-    while (i < file_size)
+    if (fp != NULL)
     {
-        if ((i + (si8)VIDEO_FILE_READ_SIZE) >= file_size)
-            bytes_to_read = file_size - i;
-        else
-            bytes_to_read = VIDEO_FILE_READ_SIZE;
-        fread(buffer, 1, bytes_to_read, fp);
-        crc = CRC_update(buffer, bytes_to_read, crc);
-        i = i + VIDEO_FILE_READ_SIZE;
+        if (read_avi_header(fp, file_size, &avi_info) == 0)
+        {
+            have_avi_info = 1;
+            find_avi_clip_bytes(fp, &avi_info, number_of_clips, clips);
+        }
+        fclose(fp);
+    }
+    if (have_avi_info)
+    {
+        if (width <= 0)
+            width = avi_info.width;
+        if (height <= 0)
+            height = avi_info.height;
+        if (frame_rate <= 0.0)
+            frame_rate = avi_info.frame_rate;
+    }
+    
+    // the largest clip, or the file if clip sizes aren't known
+    maximum_clip_bytes = 0;
+    for (i = 0; i < number_of_clips; i++)
+    {
+        if (clips[i].clip_bytes < 0)
+        {
+            maximum_clip_bytes = file_size;
+            break;
+        }
+        if (clips[i].clip_bytes > maximum_clip_bytes)
+            maximum_clip_bytes = clips[i].clip_bytes;
     }
-    fclose(fp);
-    free(buffer);
 
     // create video metadata file (.vmet) and vido indices file (.vidx)
     // .vmet file
@@ -1912,17 +5927,17 @@ void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1*
     initialize_metadata(metadata_fps);
     metadata_fps->directives.close_file = MEF_TRUE;
     // generate level UUID into universal_header
-    generate_UUID(metadata_fps->universal_header->level_UUID);
-    generate_UUID(metadata_fps->universal_header->file_UUID);
+    generate_UUID_thread_safe(metadata_fps->universal_header->level_UUID);
+    generate_UUID_thread_safe(metadata_fps->universal_header->file_UUID);
 
     // encryption is OFF in this use-case
     metadata_fps->metadata.section_1->section_2_encryption = NO_ENCRYPTION;
     metadata_fps->metadata.section_1->section_3_encryption = NO_ENCRYPTION;
     // copy section 3 (patient info) from EEG channel, as this information is the same
     memcpy(metadata_fps->raw_data + METADATA_SECTION_3_OFFSET, proto_metadata_fps->raw_data + METADATA_SECTION_3_OFFSET, METADATA_SECTION_3_BYTES);
-    MEF_snprintf(metadata_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s.mefd/%s.vidd/%s-%06d.segd/%s-%06d.%s", output_directory, chan_name, chan_name, segment_num, chan_name, segment_num, VIDEO_METADATA_FILE_TYPE_STRING);
-    metadata_fps->universal_header->start_time = start_time;
-    metadata_fps->universal_header->end_time = end_time;
+    MEF_snprintf(metadata_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s-%06d.%s", segment_path, chan_name, segment_num, VIDEO_METADATA_FILE_TYPE_STRING);
+    metadata_fps->universal_header->start_time = clips[0].start_time;
+    metadata_fps->universal_header->end_time = clips[number_of_clips - 1].end_time;
     metadata_fps->universal_header->number_of_entries = 1;  // always for metadata
     metadata_fps->universal_header->maximum_entry_size = METADATA_FILE_BYTES;
     metadata_fps->universal_header->segment_number = segment_num;
@@ -1938,18 +5953,12 @@ void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1*
     md2->frame_rate = frame_rate;
     md2->horizontal_resolution = width;
     md2->vertical_resolution = height;
-    md2->maximum_clip_bytes = file_size;  // TBD: make this more precise
-    md2->number_of_clips = 1;
-    md2->recording_duration = end_time - start_time;
+    md2->maximum_clip_bytes = maximum_clip_bytes;
+    md2->number_of_clips = number_of_clips;
+    md2->recording_duration = clips[number_of_clips - 1].end_time - clips[0].start_time;
     md2->video_file_CRC = crc;
     memset(md2->video_format, 0, VIDEO_METADATA_VIDEO_FORMAT_BYTES);
-    if (!strcmp(extension, "AVI") || !strcmp(extension, "avi") || !strcmp(extension, "Avi"))
-        sprintf(md2->video_format, "AVI");
-    else
-    {
-        fprintf(stderr, "Problem - Video file detected that is not an AVI file!  Code needs to be updated to handle this new type (%s).  Exiting!", extension);
-        exit(1);
-    }
+    sprintf(md2->video_format, "AVI");
     write_MEF_file(metadata_fps);
 
     // .vidx file
@@ -1957,16 +5966,43 @@ void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1*
     inds_fps = allocate_file_processing_struct(UNIVERSAL_HEADER_BYTES, VIDEO_INDICES_FILE_TYPE_CODE, NULL, metadata_fps, UNIVERSAL_HEADER_BYTES);
     // use same level UUID as video metadata
     memcpy(inds_fps->universal_header->level_UUID, metadata_fps->universal_header->level_UUID, 16);
-    generate_UUID(inds_fps->universal_header->file_UUID);
-    MEF_snprintf(inds_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s.mefd/%s.vidd/%s-%06d.segd/%s-%06d.%s", output_directory, chan_name, chan_name, segment_num, chan_name, segment_num, VIDEO_INDICES_FILE_TYPE_STRING);
-    inds_fps->universal_header->number_of_entries = 1;  // because we have just one clip
-    inds_fps->universal_header->maximum_entry_size = file_size;    // TBD: make this more precise
+    generate_UUID_thread_safe(inds_fps->universal_header->file_UUID);
+    MEF_snprintf(inds_fps->full_file_name, MEF_FULL_FILE_NAME_BYTES, "%s/%s-%06d.%s", segment_path, chan_name, segment_num, VIDEO_INDICES_FILE_TYPE_STRING);
+    inds_fps->universal_header->number_of_entries = number_of_clips;
+    inds_fps->universal_header->maximum_entry_size = maximum_clip_bytes;
     inds_fps->directives.io_bytes = UNIVERSAL_HEADER_BYTES;  // write out the universal header, then index blocks piecemeal
     inds_fps->directives.close_file = MEF_FALSE;
     write_MEF_file(inds_fps);
-    inds_fps->universal_header->body_CRC = CRC_START_VALUE;
-    // then write block
-    // just one block, as we are assuming there is one "clip" per avi file, for this use-case.
+    // then write all the index entries (clips) at once
+    for (i = 0; i < number_of_clips; i++)
+    {
+        memset(clips[i].protected_region, 0, VIDEO_INDEX_PROTECTED_REGION_BYTES);
+        memset(clips[i].discretionary_region, 0, VIDEO_INDEX_DISCRETIONARY_REGION_BYTES);
+    }
+    (void)e_fwrite(clips, sizeof(ui1), (size_t) number_of_clips * VIDEO_INDEX_BYTES, inds_fps->fp, inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    inds_fps->universal_header->body_CRC = mef_crc_calculate((ui1 *) clips, (si8) number_of_clips * VIDEO_INDEX_BYTES);
+    // rewrite header with new body CRC
+    inds_fps->universal_header->header_CRC = mef_crc_calculate(inds_fps->raw_data + CRC_BYTES, UNIVERSAL_HEADER_BYTES - CRC_BYTES);
+    rewrite_universal_header(inds_fps, UNIVERSAL_HEADER_BYTES + (si8) number_of_clips * VIDEO_INDEX_BYTES);
+    fclose(inds_fps->fp);
+    inds_fps->fp = NULL;
+    
+    free_file_processing_struct(inds_fps);
+    free_file_processing_struct(metadata_fps);
+    
+    return 0;
+}
+
+// See comment in .h file for use instructions.
+void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1* chan_name, si1* full_file_name, si8 start_time, si8 end_time, 
+    si4 width, si4 height, si4 num_frames, sf8 frame_rate, FILE_PROCESSING_STRUCT* proto_metadata_fps)
+{
+    VIDEO_INDEX index_block;
+    
+    // just one clip, for the whole avi file
+    memset(&index_block, 0, sizeof(VIDEO_INDEX));
+    if (num_frames <= 0)
+        (void) probe_avi_file(full_file_name, NULL, NULL, &num_frames, NULL);
     index_block.start_time = start_time;
     index_block.end_time = end_time;
     if (num_frames > 0)
@@ -1979,14 +6015,9 @@ void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1*
         index_block.start_frame = -1;
         index_block.end_frame = -1;
     }
-    index_block.file_offset = -1; // not filled in, video file type dependent.  TBD: this can be filled in if the video format is known.
-    index_block.clip_bytes = -1; // not filled in, video file type dependent.  TBD: this can be filled in if the video format is known.
-    memset(index_block.protected_region, 0, VIDEO_INDEX_PROTECTED_REGION_BYTES);
-    memset(index_block.discretionary_region, 0, VIDEO_INDEX_DISCRETIONARY_REGION_BYTES);
-    (void)e_fwrite(&index_block, sizeof(ui1), (size_t)(VIDEO_INDEX_BYTES), inds_fps->fp, inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    inds_fps->universal_header->body_CRC = CRC_update(&index_block, VIDEO_INDEX_BYTES, inds_fps->universal_header->body_CRC);
-    // rewrite header with new body CRC
-    e_fseek(inds_fps->fp, 0, SEEK_SET, inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    (void)e_fwrite(inds_fps->universal_header, sizeof(UNIVERSAL_HEADER), (size_t)1, inds_fps->fp, inds_fps->full_file_name, __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
-    fclose(inds_fps->fp);
+    index_block.file_offset = -1;  // filled in from the avi index, if it has one
+    index_block.clip_bytes = -1;
+    
+    (void) write_video_file_with_clips(output_directory, segment_num, chan_name, full_file_name, 1, &index_block,
+                                       width, height, frame_rate, 0, proto_metadata_fps);
 }
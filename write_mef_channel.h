@@ -5,7 +5,8 @@
  This library contains functions to convert data samples to MEF version 3.0
  initialize_mef_channel_data() should be called first for each channel, which initializes the data in the channel
  structure.  Then write_mef_channel_data() is called with the actual sample data to be written to the mef.  Finally,
- close_mef_channel_file() will close out the channel mef file, and free allocated memory.
+ close_mef_channel_file() will close out the channel mef file, and free allocated memory.  reset_mef_channel() closes
+ it out too, but keeps the buffers for the next recording made with the same channel structure.
  
  To compile for a 64-bit intel system, linking with the following files is necessary:
  meflib.c, mefrec.c
@@ -46,6 +47,47 @@ extern "C" {
     
     typedef struct SESSION_STATE SESSION_STATE;
     
+    // called when the memory of a block passed to write_mef_channel_block() can be reused
+    typedef void (*MEF_BLOCK_RELEASE)(si4 *samples, void *release_context);
+    
+    // a segment file written through a memory mapping, see set_mef_channel_mapped_io()
+    typedef struct {
+        ui1*    base;
+        ui8     mapped_bytes;             // file size while mapped; grown in extents
+        ui8     length;                   // bytes written, the file is truncated to this when unmapped
+    } MEF_MAPPED_FILE;
+    
+    // lays out a record's body from what was passed to write_annotation(), see register_mef_record_type()
+    typedef void (*MEF_RECORD_SERIALIZER)(ui1 *body, void *record, si8 body_bytes);
+    
+    // a record type write_annotation() knows how to write
+    typedef struct {
+        ui4     type_code;                // the four type characters, in file order
+        ui1     version_major;
+        ui1     version_minor;
+        si8     fixed_bytes;              // body bytes before padding, 0 for a null terminated string
+        MEF_RECORD_SERIALIZER serializer; // NULL to copy the record as is
+    } MEF_RECORD_TYPE;
+    
+    // Writer counters, see get_mef_channel_writer_stats().  Times are in nanoseconds.
+    typedef struct {
+        ui8     blocks_encoded;
+        ui8     samples_encoded;
+        ui8     bytes_written;            // compressed blocks and index entries
+        ui8     writes;                   // writes (or mapped appends) of block data and index entries
+        ui8     metadata_updates;         // update_metadata() calls: checkpoints, segment rolls and close
+        ui8     segment_rolls;
+        ui8     encode_nsecs;             // RED_encode()
+        ui8     extrema_nsecs;            // finding block extrema, as samples are copied in or with RED_find_extrema()
+        ui8     crc_nsecs;                // body CRCs of the data and index files
+        ui8     write_nsecs;
+        ui8     metadata_nsecs;           // update_metadata(), which includes writing the staged blocks
+        ui8     segment_roll_nsecs;       // check_for_new_segment() starting a new segment, which includes an update_metadata()
+    } MEF_WRITER_STATS;
+    
+    // called after each update_metadata() with the channel's counters, see set_mef_channel_writer_stats_callback()
+    typedef void (*MEF_WRITER_STATS_CALLBACK)(si1 *channel_path, MEF_WRITER_STATS *stats, void *callback_context);
+    
     typedef struct {
         si4     chan_num;
         RED_PROCESSING_STRUCT	*rps;
@@ -64,7 +106,6 @@ extern "C" {
         si4     discontinuity_flag;
         si4     bit_shift_flag;
         FILE    *out_file;
-        ui1*    out_data;
         ui1*    temp_time_series_index;
         ui4     discont_contiguous_blocks;
         si8     discont_contiguous_samples;
@@ -84,6 +125,66 @@ extern "C" {
         ui8 next_segment_start_time;
         si1 channel_path[MEF_FULL_FILE_NAME_BYTES];
         si1    if_appending;
+        ui8     raw_data_buffer_samples;  // size of raw_data_ptr_start buffer, in samples, see block_buffer_samples()
+        SESSION_STATE *session;           // session this channel belongs to, or NULL
+        void    *pipeline;                // block buffers shared with session workers (internal)
+        void    *ingest_queue;            // session ingest queue feeding this channel (internal), see enqueue_mef_channel_data()
+        ui4     ingest_pending;           // batches of this channel in ingest_queue, protected by its lock
+        si4     offline_mode;             // see set_mef_channel_offline_mode()
+        si4     checkpoint_mode;          // when metadata and universal headers are rewritten, see CHECKPOINT_* below
+        ui8     checkpoint_interval_blocks;
+        si8     checkpoint_interval_usecs;
+        ui8     blocks_since_checkpoint;
+        ui8     last_checkpoint_time;
+        void*   mefd_registry;            // the session's .mefd file in memory (internal), see update_mefd_file()
+        si4     mefd_listed;              // the channel is in the .mefd file, so its checkpoints leave the file alone
+        ui4     index_batch_entries;      // index entries in temp_time_series_index not yet written to the .tidx file
+        ui4     index_batch_max_entries;
+        ui1*    data_batch;               // compressed blocks not yet written to the .tdat file
+        ui8     data_batch_bytes;
+        ui8     data_batch_max_bytes;
+        si4     raw_data_minimum;         // extrema of the samples in the block being filled
+        si4     raw_data_maximum;
+        si4     statistics_enabled;       // running statistics, see set_mef_channel_statistics()
+        ui8     statistics_number_of_samples;
+        sf8     statistics_sum;
+        sf8     statistics_sum_of_squares;
+        ui8     regular_anchor_time;      // clock of write_mef_channel_data_regular(): time of sample 0
+        ui8     regular_samples_since_anchor;
+        sf8     regular_sampling_frequency;
+        ui1*    arena;                    // one allocation holding raw buffer, index batch and data batch
+        ui8     arena_bytes;
+        ui8     rps_buffer_samples;       // raw samples the RED buffers of rps are sized for
+        ui4     buffers_retained;         // CHANNEL_BUFFERS_RETAINED after reset_mef_channel()
+        si4     segment_preopen_enabled;  // see set_mef_channel_segment_preopen()
+        si4     next_segment_prepared;
+        FILE*   next_segment_data_fp;
+        FILE*   next_segment_inds_fp;
+        FILE*   next_segment_metadata_fp;
+        ui1     next_segment_level_UUID[16];
+        ui1     next_segment_file_UUIDs[3][16];  // data, index and metadata files
+        si4     mapped_io_enabled;        // see set_mef_channel_mapped_io()
+        si4     mapped_sync_mode;
+        ui8     mapped_extent_bytes;
+        MEF_MAPPED_FILE data_map;
+        MEF_MAPPED_FILE inds_map;
+        si4     journal_enabled;          // see set_mef_channel_journal()
+        si4     journal_pending;          // blocks were written since the last journal entry
+        FILE*   journal_fp;
+        MEF_WRITER_STATS writer_stats;    // only counted when compiled with MEF_ENABLE_WRITER_STATS
+        MEF_WRITER_STATS_CALLBACK writer_stats_callback;
+        void*   writer_stats_context;
+        si4     adaptive_blocks_enabled;  // see set_mef_channel_adaptive_blocks()
+        si8     adaptive_min_interval;
+        si8     adaptive_max_interval;
+        si8     adaptive_interval_in_use; // interval write_mef_channel_data() cuts blocks at
+        si8     adaptive_interval_next;   // worked out as blocks are encoded, picked up when the next block is submitted
+        si8     adaptive_interval_ready;  // adaptive_interval_next, handed over under the session lock
+        ui8     adaptive_window_blocks;   // full length blocks encoded since the last adjustment
+        ui8     adaptive_window_samples;
+        ui8     adaptive_window_bytes;
+        ui1*    metadata_image;           // the metadata file as written, when it is encrypted, see update_metadata()
+        si4     metadata_section_3_cached; // metadata_image holds the encryption of metadata_image + METADATA_FILE_BYTES
     } CHANNEL_STATE;
     
     typedef struct {
@@ -93,6 +194,8 @@ extern "C" {
         sf4 gmt_offset;
         si8     rdat_file_offset;
         si8     ridx_file_offset;
+        ui1*    batch_buffer;             // records and index entries being written, see write_annotations_batch()
+        ui8     batch_buffer_bytes;
     } ANNOTATION_STATE;
     
     // Subroutine declarations
@@ -135,12 +238,195 @@ extern "C" {
      sf8 secs_per_block,
      sf8 sampling_frequency);
 #endif
+
+    // Ingest of interleaved frames from a multi-channel DAQ.  Frame f is frame_stride samples long, starting at
+    // frames + f * frame_stride, and its first num_channels samples are those of channel_states[0] ...
+    // channel_states[num_channels - 1], all at time packet_times[f].  The samples are copied straight into each
+    // channel's block buffer, as write_mef_channel_data() would copy them from per-channel arrays, so the frames
+    // don't have to be split up first.  The channels must share the sampling frequency and secs_per_block.
+    // Returns -1 if frame_stride is less than num_channels.
+#ifndef _EXPORT_FOR_DLL
+    si4 write_mef_channels_interleaved(CHANNEL_STATE **channel_states,
+     si4 num_channels,
+     ui8 *packet_times,
+     si4 *frames,
+     ui8 n_frames,
+     si8 frame_stride,
+     sf8 secs_per_block,
+     sf8 sampling_frequency);
+#endif
+
+    // Ingest for regularly sampled data, without a timestamp per sample.  Sample i of the stream is at
+    // start_time + i * 1e6 / sampling_frequency microseconds, rounded.  A start_time of 0 continues the stream
+    // right after the previous call; a new start_time (or write_mef_channel_gap()) starts the count over, and if
+    // the jump is DISCONTINUITY_TIME_THRESHOLD or more the next block is marked as a discontinuity, as usual.
+    // Returns -1 if the stream has no start time yet.
+#ifndef _EXPORT_FOR_DLL
+    si4 write_mef_channel_data_regular(CHANNEL_STATE *channel_state,
+     ui8 start_time,
+     si4 *samps,
+     ui8 n_samples,
+     sf8 secs_per_block,
+     sf8 sampling_frequency);
+    si4 write_mef_channel_gap(CHANNEL_STATE *channel_state, ui8 next_sample_time);
+#endif
+
+    // Zero-copy ingest of a whole block that is already in the caller's memory, such as a DAQ ring buffer.  The block
+    // is RED-encoded straight from samples, and release(samples, release_context) is called when the memory is no
+    // longer needed; until then it must not change.  In a session that can be after this returns, from a worker
+    // thread.  With the bit shift flag set, the samples are copied first and release is called before returning.
+    // Samples already given to write_mef_channel_data() are written as a block of their own first.
+    // num_samples can be at most the size of the channel's block buffer; returns -1 otherwise.
+    // discontinuity forces the block to be marked discontinuous, which it also is after a gap, as usual.
+#ifndef _EXPORT_FOR_DLL
+    si4 write_mef_channel_block(CHANNEL_STATE *channel_state,
+     ui8 block_start_time,
+     si4 *samples,
+     ui4 num_samples,
+     sf8 sampling_frequency,
+     si4 discontinuity,
+     MEF_BLOCK_RELEASE release,
+     void *release_context);
+#endif
     si4 check_for_new_segment(CHANNEL_STATE *channel_state, ui8 start_time);
     
     si4 update_metadata(CHANNEL_STATE *channel_state);
 
+    // Checkpoint policy: when process_filled_block() rewrites the metadata file and the universal headers of the data
+    // and index files.  The default is after every block (CHECKPOINT_EVERY_N_BLOCKS with every_n_blocks of 1), which
+    // lets real-time readers follow the files, but costs a metadata rewrite and four seeks per block.
+    // CHECKPOINT_EVERY_T_SECONDS uses recording time, and CHECKPOINT_ON_CLOSE only rewrites headers at segment rolls
+    // and in close_mef_channel().  Headers are consistent with the data at every checkpoint.
+    // checkpoint_mef_channel() forces a checkpoint of the blocks written so far.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_checkpoint_policy(CHANNEL_STATE *channel_state, si4 checkpoint_mode, ui8 every_n_blocks, sf8 every_t_seconds);
+    si4 checkpoint_mef_channel(CHANNEL_STATE *channel_state);
+#endif
+
+    // Index entries (one per block) are kept in memory and appended to the .tidx file in one write at each
+    // checkpoint, segment roll and close, or when max_entries are waiting.  The default is
+    // DEFAULT_INDEX_BATCH_ENTRIES.  Entries already waiting are written before the batch is resized.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_index_batch_size(CHANNEL_STATE *channel_state, ui4 max_entries);
+#endif
+
+    // Compressed blocks are staged the same way, in a DEFAULT_DATA_BATCH_BYTES buffer per channel, and appended to
+    // the .tdat file when the next block doesn't fit, and at each checkpoint, segment roll and close.
+    // A max_bytes of 0 writes every block as soon as it is compressed.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_data_batch_size(CHANNEL_STATE *channel_state, ui8 max_bytes);
+#endif
+
+    // Running statistics, for quality control while recording.  Once enabled, every sample passed to
+    // write_mef_channel_data() is added to a running sum and sum of squares as it is copied in.
+    // get_mef_channel_statistics() returns the mean and RMS in native units (units_conversion_factor applied),
+    // and returns -1 if no samples have been counted.  Enabling again starts over.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_statistics(CHANNEL_STATE *channel_state, si4 enabled);
+    si4 get_mef_channel_statistics(CHANNEL_STATE *channel_state, ui8 *number_of_samples, sf8 *mean, sf8 *rms);
+#endif
+
+    // Writer counters: blocks and bytes written, and the time spent encoding, finding extrema, CRCing, writing,
+    // updating metadata and rolling segments.  They are only kept if the library is compiled with
+    // MEF_ENABLE_WRITER_STATS defined; otherwise the timing code isn't compiled in at all, and the functions below
+    // return -1 (with zeroed counters).  CHANNEL_STATE is the same size either way.  get_mef_session_writer_stats()
+    // adds up the counters of the channels in a session.  Counters read while blocks are being written (by the
+    // session workers, or an asynchronous channel's thread) may be a block behind.  A callback set with
+    // set_mef_channel_writer_stats_callback() is called with the channel's counters after every update_metadata(),
+    // from the thread that did it, so counters can be exported as they change.  It should return quickly.
+#ifndef _EXPORT_FOR_DLL
+    si4 get_mef_channel_writer_stats(CHANNEL_STATE *channel_state, MEF_WRITER_STATS *stats);
+    si4 get_mef_session_writer_stats(SESSION_STATE *session, MEF_WRITER_STATS *stats);
+    si4 reset_mef_channel_writer_stats(CHANNEL_STATE *channel_state);
+    si4 set_mef_channel_writer_stats_callback(CHANNEL_STATE *channel_state, MEF_WRITER_STATS_CALLBACK callback, void *callback_context);
+#endif
+
+    // Adaptive block length.  Once enabled, the time covered by each block is tuned between min_secs_per_block and
+    // the channel's block_interval, which stays the upper bound (the raw buffers are sized for it) and is what
+    // the metadata records.  Blocks start at ADAPTIVE_TARGET_BLOCK_SAMPLES samples.  Every ADAPTIVE_BLOCK_WINDOW
+    // full length blocks, the share of the compressed bytes taken by block headers is checked: above
+    // ADAPTIVE_MAX_HEADER_SHARE (the data compresses well, or the sample rate is low) blocks are made longer, and
+    // below ADAPTIVE_MIN_HEADER_SHARE, with blocks over ADAPTIVE_MAX_BLOCK_SAMPLES, they are made shorter, so
+    // readers decompress less to find a given time.  Returns -1 if min_secs_per_block is not less than the
+    // block_interval.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_adaptive_blocks(CHANNEL_STATE *channel_state, si4 enabled, sf8 min_secs_per_block);
+#endif
+
+    // Encryption of RED blocks, for channels with passwords.  level is LEVEL_1_ENCRYPTION or LEVEL_2_ENCRYPTION
+    // (NO_ENCRYPTION, the default, turns it off again).  Blocks are encrypted by RED_encode(), so with a session
+    // writer or in asynchronous mode the encryption is spread over the worker threads along with the compression.
+    // Returns -1 if the channel has no password for that level.  Channels with the same passwords share one set of
+    // key schedules, and metadata checkpoints only encrypt the sections that changed.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_block_encryption(CHANNEL_STATE *channel_state, si4 level);
+#endif
+
+    // The shared password data (the expanded keys, not the passwords) stays in memory until this is called.  It
+    // zeroes and frees it, so call it only when no channel with a password is open (channels made afterwards
+    // work the password data out again).
+#ifndef _EXPORT_FOR_DLL
+    void release_mef_password_cache(void);
+#endif
+
+    // Offline mode, for converting recordings that are already complete.  Headers and metadata are only written
+    // when a segment is finished and at close (CHECKPOINT_ON_CLOSE), and blocks and index entries go out in
+    // OFFLINE_DATA_BATCH_BYTES / OFFLINE_INDEX_BATCH_ENTRIES batches, so the files are written front to back in large
+    // writes.  If the channel is (or is later) in a session with more than one worker, its blocks are also
+    // RED-encoded by several workers at once, each with its own RED buffers, and written in order; give the session
+    // at least one buffer per worker, plus one.  Turning offline mode off goes back to a checkpoint after every
+    // block and the default batch sizes.  Readers can't follow a channel in offline mode while it is written.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_offline_mode(CHANNEL_STATE *channel_state, si4 enabled);
+#endif
+
+    // Segment pre-opening, for channels with a num_secs_per_segment.  Once enabled, the next segment's directory is
+    // made, its three files are opened and its UUIDs are generated when the current segment is half over, so the
+    // segment roll itself only has to swap file handles and write the new universal headers.  With a session
+    // writer this preparation happens on the worker threads.  A prepared segment that is never used is removed
+    // when the channel is closed.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_segment_preopen(CHANNEL_STATE *channel_state, si4 enabled);
+#endif
+
+    // Memory mapped output for the .tdat and .tidx files (POSIX systems only, returns -1 elsewhere).  Both files
+    // are grown extent_bytes at a time (0 means DEFAULT_MAPPED_EXTENT_BYTES) and written with stores into the
+    // mapping, and the universal header rewrites of a checkpoint become stores too.  sync_mode is one of
+    // MAPPED_SYNC_NONE (the kernel writes pages back when it likes), MAPPED_SYNC_ASYNC (write-back is started
+    // at each checkpoint), or MAPPED_SYNC_WAIT (each checkpoint waits until the pages are on disk).  Files are
+    // truncated to their real length at each segment roll and at close.  If a mapping can't be made, the channel
+    // goes back to stdio writes.  Note an error on a mapped file (a full disk, say) raises SIGBUS rather than
+    // being reported by the write.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_mapped_io(CHANNEL_STATE *channel_state, si4 enabled, ui8 extent_bytes, si4 sync_mode);
+#endif
+
+    // Checkpoint journal.  Once enabled, each time blocks reach the data and index files an entry is appended to
+    // <segment>.wjnl in the segment directory, after the blocks: the committed lengths and body CRCs of both files,
+    // and the header and metadata fields that go with them (the metadata part is encrypted like section 2).  The
+    // first block of each segment is always checkpointed, so section 3 is on disk.  The journal is removed when
+    // a segment is finished normally, so a journal left behind means the writer didn't finish that segment.
+    // recover_mef_segment() then uses the last good journal entry to truncate the data and index files to whole
+    // blocks and bring the headers and metadata up to date, without reading the data.  password is the one used
+    // for the channel, if any.  Returns 0 if the segment is now consistent (or had no journal), -1 if it can't be
+    // recovered.  Entries are flushed to the operating system, not synced, so this covers the writer dying, not
+    // the machine.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_journal(CHANNEL_STATE *channel_state, si4 enabled);
+    si4 recover_mef_segment(si1 *segment_path, si1 *password);
+#endif
+
+    // close_mef_channel() finishes the channel's files and frees everything the channel allocated, so a
+    // CHANNEL_STATE can be freed (or initialized again) after it.  reset_mef_channel() finishes the files the same
+    // way, but keeps the channel's raw buffer, batch buffers and RED buffers.  The next
+    // initialize_mef_channel_data(), append_mef_channel_data() or resume_mef_channel_data() with that CHANNEL_STATE
+    // reuses them, growing them only if the new recording needs bigger blocks.  This is for long running writers
+    // that start a new recording every so often.  Settings such as the checkpoint policy or a session go back to
+    // their defaults, as for a new channel.  A channel that was reset and won't be used again is freed with
+    // close_mef_channel().
 #ifndef _EXPORT_FOR_DLL
      si4 close_mef_channel(CHANNEL_STATE *channel_state);
+     si4 reset_mef_channel(CHANNEL_STATE *channel_state);
      
      si4 append_mef_channel_data(CHANNEL_STATE *channel_state,
      si1 *chan_map_name,
@@ -152,38 +438,183 @@ extern "C" {
      si4 bit_shift_flag
      );
 #endif
+
+    // Appends to a channel without being told the segment number.  Each channel keeps a small resume file
+    // (<channel>.timd/<channel>.wrst) holding the next segment number, written when a segment is started and at
+    // close.  It holds no metadata, so nothing is stored there that is encrypted in the segment files.  Returns
+    // what append_mef_channel_data() returns, or 0 if there is no (valid) resume file.
+#ifndef _EXPORT_FOR_DLL
+    si4 resume_mef_channel_data(CHANNEL_STATE *channel_state,
+                                si1 *chan_map_name,
+                                si1 *mef_3_level_1_password,
+                                si1 *mef_3_level_2_password,
+                                si1 *mef3_session_directory,
+                                ui8 num_secs_per_segment,
+                                si4 bit_shift_flag);
+#endif
     
 #ifndef _EXPORT_FOR_DLL
     si4 create_or_append_annotations(ANNOTATION_STATE* annotation_state,
                                      si1* dir_name,
                                      sf4 gmt_offset,
                                      si1 *anonymized_subject_name);
+    si4 close_annotation(ANNOTATION_STATE* annotation_state);
+#endif
+
+    // Writes one record of the given type at unixTimestamp, as a batch of one (see write_annotations_batch()).
+    // Returns 0, or -1 without writing anything if record is NULL or type is unknown.
+#ifndef _EXPORT_FOR_DLL
     si4 write_annotation(ANNOTATION_STATE* annotation_state,
                          ui8 unixTimestamp,
                          si1* type,
                          void* record);
-    si4 close_annotation(ANNOTATION_STATE* annotation_state);
+#endif
+
+    // Writes number_of_records records at once: records[i] is of type types[i] ("Note", "Seiz", "Curs", "Epoc" or
+    // a type added with register_mef_record_type()), at time unixTimestamps[i], as it would be given to
+    // write_annotation().  The records are laid out in one buffer, so each file gets one write and one universal
+    // header rewrite for the whole batch.  Returns 0, or -1 without writing anything if any record is missing or of
+    // an unknown type.
+#ifndef _EXPORT_FOR_DLL
+    si4 write_annotations_batch(ANNOTATION_STATE* annotation_state,
+                                si4 number_of_records,
+                                ui8* unixTimestamps,
+                                si1** types,
+                                void** records);
+#endif
+
+    // Adds a record type, such as an in-house "Stim" event, for write_annotation() and write_annotations_batch().
+    // type is four characters.  Records of the type are fixed_bytes long (padded to 16 bytes in the file), or
+    // null terminated strings if fixed_bytes is 0.  serializer, if not NULL, is given zeroed memory of the body's
+    // size to fill in from the record; otherwise the record is copied.  Types should be registered before records
+    // are written.  Returns 0, or -1 if the type is malformed, already known, or there are MAX_RECORD_TYPES types.
+#ifndef _EXPORT_FOR_DLL
+    si4 register_mef_record_type(si1 *type, ui1 version_major, ui1 version_minor, si8 fixed_bytes, MEF_RECORD_SERIALIZER serializer);
+#endif
+
+    // Multi-channel session writer.  A session owns a pool of worker threads that RED-encode and write filled blocks,
+    // so channels are compressed in parallel.  Create the session, then create channels as usual with
+    // initialize_mef_channel_data() or append_mef_channel_data(), and add each one with add_mef_session_channel().
+    // After that, write_mef_channel_data() only copies samples and queues filled blocks; each channel gets
+    // buffers_per_channel raw buffers (at least 2), and blocks of one channel are always written in order.
+    // num_worker_threads of 0 means one worker per processor.  A channel must still only be written from one thread
+    // at a time.  close_mef_channel() waits for the channel's queued blocks, and close_mef_session() closes all
+    // channels still in the session, then stops the workers.
+#ifndef _EXPORT_FOR_DLL
+    SESSION_STATE *create_mef_session(si4 num_worker_threads, si4 buffers_per_channel);
+    si4 add_mef_session_channel(SESSION_STATE *session, CHANNEL_STATE *channel_state);
+    si4 remove_mef_session_channel(CHANNEL_STATE *channel_state);
+    si4 wait_for_mef_channel(CHANNEL_STATE *channel_state);
+    si4 wait_for_mef_session(SESSION_STATE *session);
+    si4 close_mef_session(SESSION_STATE *session);
+#endif
+
+    // Multi-producer ingest for a session, for acquisition systems with a thread per amplifier or headstage.
+    // start_mef_session_ingest() starts num_writer_threads writer threads (at least 1), each with a queue of
+    // batches_per_writer batches (0 means DEFAULT_INGEST_QUEUE_BATCHES).  Any thread may then call
+    // enqueue_mef_channel_data() for any channel of the session, with the arguments of write_mef_channel_data();
+    // the batch is copied into the queue, and a writer thread passes it on to write_mef_channel_data().  Producers
+    // need no locking of their own.  Each channel is drained by one writer, so batches of a channel are written in
+    // the order they were queued, but a channel should still be fed from one thread at a time to keep its samples
+    // ordered.  When the queue is full, enqueue_mef_channel_data() waits for room if wait is set, and otherwise
+    // returns 1 without queueing anything, so a producer can drop or buffer data itself.  It returns -1 if the
+    // channel isn't in a session with ingest started.  get_mef_session_ingest_backlog() reports the batches queued
+    // and how often producers found a queue full.  While a channel is fed this way, other calls on it (besides
+    // close_mef_channel(), which writes its queued batches first) must wait for wait_for_mef_session().
+#ifndef _EXPORT_FOR_DLL
+    si4 start_mef_session_ingest(SESSION_STATE *session, si4 num_writer_threads, si4 batches_per_writer);
+    si4 enqueue_mef_channel_data(CHANNEL_STATE *channel_state,
+     ui8 *packet_times,
+     si4 *samps,
+     ui8 n_packets_to_process,
+     sf8 secs_per_block,
+     sf8 sampling_frequency,
+     si4 wait);
+    si4 get_mef_session_ingest_backlog(SESSION_STATE *session, ui8 *queued_batches, ui8 *full_queue_count);
+#endif
+
+    // Asynchronous mode for a single channel, without a session.  The channel gets num_buffers raw sample buffers
+    // (2 for double buffering) and its own background thread, which does the bit shifting, RED compression, CRCs and
+    // writes of filled blocks.  write_mef_channel_data() then keeps accepting samples into the next buffer, and only
+    // waits if all buffers are still queued.  num_buffers less than 2 switches the channel back to synchronous mode.
+    // flush_mef_channel() and close_mef_channel() wait for queued blocks.  Returns -1 if the channel is part of a session.
+#ifndef _EXPORT_FOR_DLL
+    si4 set_mef_channel_async_mode(CHANNEL_STATE *channel_state, si4 num_buffers);
 #endif
 
     // This function updates the ".mefd" file, which is an optional MEF 3 extenion, that Persyst reads to load channel information.
+    // The file is read once per session and the channel list is kept in memory; a new channel reaches the file at
+    // its first checkpoint (see set_mef_channel_checkpoint_policy() and checkpoint_mef_channel()) or when it is
+    // closed, and the list is freed once all channels of the session are closed.  flush_mefd_files() writes every
+    // session's list now, and frees the lists of sessions without open channels.
     void update_mefd_file(si1* mef3_session_path, si1* mef3_session_name, si1* chan_name, si1* anonymized_subject_name);
+#ifndef _EXPORT_FOR_DLL
+    void flush_mefd_files(void);
+#endif
 
     // The following function can be used for the use-case where a series of video files should be placed within a MEF 3.0 video channel (.vidd) directory.
-    // For now it only works for .avi files.  Clip byte/offset information is not filled in, and the maximum clip bytes is set to the size of the .avi file.
-    // The user is responsible for pulling out information like resolution width/height, number of frame, and frame rate.  (The ffprobe open-source tool is 
-    // very good).  The proto_metadata_fps is used for filling in section 3 of the metadata (info such as patient name/id and recording location) which will 
+    // For now it only works for .avi files.  Clip byte/offset information is taken from the avi file's idx1 index if it has one (otherwise it is not
+    // filled in, and the maximum clip bytes is set to the size of the .avi file).  Resolution width/height, number of frames, and frame rate can be
+    // given as 0, and are then read from the avi file's header (see probe_avi_file()).  The proto_metadata_fps is used for filling in section 3 of the metadata (info such as patient name/id and recording location) which will 
     // be the same as with time series data channels.  The start_time and end_time are the uUTC of the beginning and end of this avi file.  This use-case 
     // assumes exactly one clip (subsection of a video file) is defined for the entire video file.  Modification of this function would be necessary for 
     // multiple clips.  The video channel is not encrypted in this use-case.
     void write_video_file_with_one_clip(si1* output_directory, si4 segment_num, si1* chan_name, si1* full_file_name, si8 start_time, si8 end_time, 
         si4 width, si4 height, si4 num_frames, sf8 frame_rate, FILE_PROCESSING_STRUCT* proto_metadata_fps);
 
+    // Like write_video_file_with_one_clip(), for an avi file split into number_of_clips clips.  The caller fills in start_time, end_time,
+    // start_frame and end_frame of each clip; file_offset and clip_bytes may be -1, to be worked out from the avi index.  The clips are written
+    // to the .vidx file as they are after that.  With link_file set, the video file is hard linked into the segment rather than copied, where
+    // the file system allows it.  Either way the file is read only once, for its CRC.  Returns 0, or -1 if the file couldn't be copied.
+    si4 write_video_file_with_clips(si1* output_directory, si4 segment_num, si1* chan_name, si1* full_file_name, si4 number_of_clips, VIDEO_INDEX* clips,
+        si4 width, si4 height, sf8 frame_rate, si4 link_file, FILE_PROCESSING_STRUCT* proto_metadata_fps);
+
+    // Reads width/height, number of frames and frame rate from the RIFF header of an avi file, for the functions above.  Any of them may be NULL.
+    // Returns 0, or -1 if the file isn't an avi file.
+    si4 probe_avi_file(si1 *file_name, si4 *width, si4 *height, si4 *num_frames, sf8 *frame_rate);
+
     
     
 
 #define DISCONTINUITY_TIME_THRESHOLD 100000   // 100000 microseconds = .1 seconds
 
+#define CHECKPOINT_EVERY_N_BLOCKS   1
+#define CHECKPOINT_EVERY_T_SECONDS  2
+#define CHECKPOINT_ON_CLOSE         3   // also at segment rolls
+
+#define DEFAULT_INDEX_BATCH_ENTRIES 256 // 256 * 56 byte index entries per channel
+#define DEFAULT_DATA_BATCH_BYTES    1048576  // 1 MB of compressed blocks per channel
+#define DEFAULT_INGEST_QUEUE_BATCHES 64     // per ingest writer thread, see start_mef_session_ingest()
+#define OFFLINE_DATA_BATCH_BYTES    8388608  // 8 MB, see set_mef_channel_offline_mode()
+#define OFFLINE_INDEX_BATCH_ENTRIES 4096
+
+#define ADAPTIVE_BLOCK_WINDOW           8       // full length blocks between adjustments, see set_mef_channel_adaptive_blocks()
+#define ADAPTIVE_TARGET_BLOCK_SAMPLES   25000   // where adaptive blocks start
+#define ADAPTIVE_MAX_BLOCK_SAMPLES      30000   // adaptive blocks are only shortened above this
+#define ADAPTIVE_MAX_HEADER_SHARE       0.02    // block headers above 2% of the compressed bytes lengthen blocks
+#define ADAPTIVE_MIN_HEADER_SHARE       0.005   // and below 0.5% (with long blocks) shorten them
+
+#define REGULAR_TIMESTAMP_CHUNK     1024     // timestamps made at a time by write_mef_channel_data_regular()
+#define INTERLEAVED_FRAME_CHUNK     256      // frames scattered at a time by write_mef_channels_interleaved()
+
+#define RESUME_STATE_FILE_TYPE_STRING   "wrst"  // writer resume state, see resume_mef_channel_data()
+#define RESUME_STATE_VERSION            2
+
+#define CHANNEL_BUFFERS_RETAINED        0x52535452  // marks a CHANNEL_STATE reset with reset_mef_channel()
+
+#define MEFD_ENTRY_BYTES                1024    // one channel directory name in the .mefd file
+
+#define MAX_RECORD_TYPES                32      // built in record types and those added with register_mef_record_type()
+
+#define JOURNAL_FILE_TYPE_STRING        "wjnl"  // checkpoint journal, see set_mef_channel_journal()
+
+#define MAPPED_SYNC_NONE            0
+#define MAPPED_SYNC_ASYNC           1
+#define MAPPED_SYNC_WAIT            2
+#define DEFAULT_MAPPED_EXTENT_BYTES 16777216 // 16 MB
+
 #define VIDEO_FILE_READ_SIZE   1000000 // 1 million bytes - this is for reading video files, to do a CRC calculation.
+#define VIDEO_CRC_THREADS      4       // reads CRCed at the same time
     
     
 #ifdef __cplusplus